@@ -0,0 +1,488 @@
+// Micro-benchmarks for the watch app, built on the host against the pebble.h shim in this directory
+// Each route is packed into header and point frame messages the way the phone packs them, then replayed through
+// the inbox handler, the hull diameter and the route layer's update proc.
+//
+// Usage: bench [route.txt ...]
+// A recorded route file holds one "latitude longitude" pair per line, in degrees. Lines starting with # are skipped
+#define main tamu_main
+#include "../src/c/tamu_buses.c"
+#undef main
+
+// The bench's own allocations stay out of the app's heap accounting
+#undef malloc
+#undef calloc
+#undef free
+
+#include <math.h>
+
+#define BENCH_MAX_POINTS UINT16_MAX
+#define BENCH_WORK 400000 // Points processed per case, so big and small routes run for similar times
+#define BENCH_MIN_ITERATIONS 20
+#define BENCH_TRANSFER_ID 1 // Every replay of a route is sent as the same transfer
+
+// College Station, where the synthetic routes are laid out
+#define BENCH_LAT 30.6
+#define BENCH_LON -96.3
+
+typedef struct {
+  char name[32];
+  double *lat;
+  double *lon;
+  uint16_t len;
+} BenchRoute;
+
+// A packed AppMessage dictionary, as it would arrive in the inbox
+typedef struct {
+  uint8_t buffer[INBOX_SIZE];
+  uint16_t size;
+} BenchMessage;
+
+typedef struct {
+  BenchMessage *messages;
+  uint16_t len;
+} BenchTransfer;
+
+static double now_seconds(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//========================================= ROUTES ======================================================
+static BenchRoute* route_create(const char *name, uint16_t len){
+  BenchRoute *route = (BenchRoute*)calloc(1, sizeof(BenchRoute));
+  snprintf(route->name, sizeof(route->name), "%s", name);
+  route->lat = (double*)calloc(len, sizeof(double));
+  route->lon = (double*)calloc(len, sizeof(double));
+  route->len = len;
+  return route;
+}
+
+static void route_destroy(BenchRoute *route){
+  free(route->lat);
+  free(route->lon);
+  free(route);
+}
+
+// A small deterministic generator so every run replays the same routes
+static uint32_t s_seed = 1;
+static double random_unit(){
+  s_seed = s_seed * 1103515245 + 12345;
+  return ((s_seed >> 8) & 0xFFFF) / 65536.0;
+}
+
+// Points on an ellipse. Every point is a hull vertex, the worst case for the incremental hull
+static BenchRoute* synthetic_loop(const char *name, uint16_t len){
+  BenchRoute *route = route_create(name, len);
+  for(uint16_t i=0; i<len; i++){
+    double angle = 2 * M_PI * i / len;
+    route->lat[i] = BENCH_LAT + 0.01 * sin(angle);
+    route->lon[i] = BENCH_LON + 0.015 * cos(angle);
+  }
+  return route;
+}
+
+// Turns along a street grid, like most bus routes. Few points end up on the hull
+static BenchRoute* synthetic_grid(const char *name, uint16_t len){
+  BenchRoute *route = route_create(name, len);
+  double lat = BENCH_LAT;
+  double lon = BENCH_LON;
+  int heading = 0;
+  for(uint16_t i=0; i<len; i++){
+    if(random_unit() < 0.2) heading = (heading + (random_unit() < 0.5 ? 1 : 3)) % 4;
+    double step = 0.0002 + 0.0003 * random_unit();
+    if(heading == 0) lat += step;
+    else if(heading == 1) lon += step;
+    else if(heading == 2) lat -= step;
+    else lon -= step;
+    route->lat[i] = lat;
+    route->lon[i] = lon;
+  }
+  return route;
+}
+
+static BenchRoute* recorded_route(const char *path){
+  FILE *file = fopen(path, "r");
+  if(file == NULL){
+    fprintf(stderr, "Could not open %s\n", path);
+    return NULL;
+  }
+  const char *name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+  BenchRoute *route = route_create(name, BENCH_MAX_POINTS);
+  char line[128];
+  uint16_t len = 0;
+  while(len < BENCH_MAX_POINTS && fgets(line, sizeof(line), file) != NULL){
+    if(line[0] == '#') continue;
+    if(sscanf(line, "%lf %lf", &route->lat[len], &route->lon[len]) == 2) len++;
+  }
+  fclose(file);
+  route->len = len;
+  if(len == 0){
+    fprintf(stderr, "No points in %s\n", path);
+    route_destroy(route);
+    return NULL;
+  }
+  return route;
+}
+
+//========================================= MESSAGES ======================================================
+// Mirrors quantizePattern and packPointFrames in app.js. The phone sends every number as an int32
+// Given a screen the points are projected onto it like fitProjection does for a rectangular screen
+
+static uint16_t message_end(BenchMessage *message, DictionaryIterator *iter){
+  message->size = dict_write_end(iter);
+  return message->size;
+}
+
+static BenchTransfer pack_route(const BenchRoute *route, uint8_t route_id, const GRect *screen){
+  double min_lat = route->lat[0], max_lat = route->lat[0];
+  double min_lon = route->lon[0], max_lon = route->lon[0];
+  for(uint16_t i=1; i<route->len; i++){
+    min_lat = fmin(min_lat, route->lat[i]);
+    max_lat = fmax(max_lat, route->lat[i]);
+    min_lon = fmin(min_lon, route->lon[i]);
+    max_lon = fmax(max_lon, route->lon[i]);
+  }
+  double center_lat = (min_lat + max_lat) / 2;
+  double center_lon = (min_lon + max_lon) / 2;
+  double span = fmax(max_lat - min_lat, max_lon - min_lon);
+  double step = span > 0 ? span / (2 * 32767) : 1;
+  double aspect = cos(center_lat * M_PI / 180);
+  double scale = 0;
+  if(screen != NULL){
+    double scale_x = (screen->size.w - PATTERN_FRAME_PADDING) / fmax((max_lon - min_lon) / step * aspect, 1);
+    double scale_y = (screen->size.h - PATTERN_FRAME_PADDING) / fmax((max_lat - min_lat) / step, 1);
+    scale = PATTERN_MAX_ZOOM * fmin(scale_x, scale_y);
+  }
+
+  // At worst every point needs its own frame
+  BenchTransfer transfer = { (BenchMessage*)calloc(route->len + 1, sizeof(BenchMessage)), 0 };
+  DictionaryIterator iter;
+
+  BenchMessage *header = &transfer.messages[transfer.len++];
+  dict_write_begin(&iter, header->buffer, sizeof(header->buffer));
+  dict_write_int32(&iter, MESSAGE_KEY_message_type, MESSAGE_ROUTE_PATTERN_HEADER);
+  dict_write_int32(&iter, MESSAGE_KEY_route_id, route_id);
+  dict_write_int32(&iter, MESSAGE_KEY_list_index, 0);
+  dict_write_int32(&iter, MESSAGE_KEY_list_len, route->len);
+  dict_write_int32(&iter, MESSAGE_KEY_bbox_min_lat, lround(min_lat * 1e6));
+  dict_write_int32(&iter, MESSAGE_KEY_bbox_min_lon, lround(min_lon * 1e6));
+  dict_write_int32(&iter, MESSAGE_KEY_bbox_max_lat, lround(max_lat * 1e6));
+  dict_write_int32(&iter, MESSAGE_KEY_bbox_max_lon, lround(max_lon * 1e6));
+  dict_write_int32(&iter, MESSAGE_KEY_aspect, screen != NULL ? Q16_ONE : lround(aspect * Q16_ONE));
+  dict_write_int32(&iter, MESSAGE_KEY_stops_len, 0);
+  dict_write_int32(&iter, MESSAGE_KEY_transfer_id, BENCH_TRANSFER_ID);
+  if(screen != NULL) dict_write_int32(&iter, MESSAGE_KEY_projected, 1);
+  message_end(header, &iter);
+
+  uint16_t i = 0;
+  while(i < route->len){
+    BenchMessage *frame = &transfer.messages[transfer.len++];
+    dict_write_begin(&iter, frame->buffer, sizeof(frame->buffer));
+    dict_write_int32(&iter, MESSAGE_KEY_message_type, MESSAGE_ROUTE_PATTERN_POINTS_FRAME);
+    dict_write_int32(&iter, MESSAGE_KEY_route_id, route_id);
+    dict_write_int32(&iter, MESSAGE_KEY_list_index, i);
+    dict_write_int32(&iter, MESSAGE_KEY_list_len, route->len);
+    dict_write_int32(&iter, MESSAGE_KEY_transfer_id, BENCH_TRANSFER_ID);
+    uint16_t budget = (const uint8_t*)iter.end - (const uint8_t*)iter.cursor - sizeof(Tuple);
+
+    uint8_t data[INBOX_SIZE];
+    uint16_t data_len = 0;
+    int32_t prev_x = 0, prev_y = 0;
+    for(; i < route->len; i++){
+      int32_t x = lround((route->lon[i] - center_lon) / step);
+      int32_t y = lround((route->lat[i] - center_lat) / step);
+      if(screen != NULL){
+        int32_t quantized_x = x;
+        x = lround(quantized_x * aspect * scale + screen->size.w * PATTERN_MAX_ZOOM / 2.0);
+        y = lround(screen->size.h * PATTERN_MAX_ZOOM / 2.0 - y * scale);
+      }
+      uint8_t encoded[10];
+      uint16_t encoded_len = 0;
+      write_varint(encoded, sizeof(encoded), &encoded_len, zigzag_encode(x - prev_x));
+      write_varint(encoded, sizeof(encoded), &encoded_len, zigzag_encode(y - prev_y));
+      if(data_len + encoded_len > budget) break;
+      memcpy(&data[data_len], encoded, encoded_len);
+      data_len += encoded_len;
+      prev_x = x;
+      prev_y = y;
+    }
+    dict_write_data(&iter, MESSAGE_KEY_frame_data, data, data_len);
+    message_end(frame, &iter);
+  }
+  return transfer;
+}
+
+static void deliver(BenchMessage *message){
+  DictionaryIterator iter;
+  dict_read_begin_from_buffer(&iter, message->buffer, message->size);
+  in_received_handler(&iter, NULL);
+}
+
+//========================================= CHECKS ======================================================
+// Cheap checks of what each benchmarked routine produced, run outside the timed loops, so a change that is fast
+// because it is wrong fails the run instead of passing as a speedup
+static int s_check_failures = 0;
+
+static void check(bool ok, const BenchRoute *route, const char *what){
+  if(ok) return;
+  fprintf(stderr, "%s: check failed: %s\n", route->name, what);
+  s_check_failures++;
+}
+
+// Every point of a complete pattern is on or inside the hull, which turns counter-clockwise at every vertex
+static bool hull_contains_pattern(const Pattern *pattern){
+  const ConvexHull *hull = pattern->convex_hull;
+  if(hull == NULL || hull->points_len == 0) return false;
+  if(hull->points_len < 3) return true;
+  for(uint16_t i=0; i<hull->points_len; i++){
+    const GPoint *a = &hull->points[i];
+    const GPoint *b = &hull->points[(i + 1) % hull->points_len];
+    if(cross(a, b, &hull->points[(i + 2) % hull->points_len]) < 0) return false;
+    for(uint16_t j=0; j<pattern->points_len; j++){
+      if(cross(a, b, &pattern->points[j]) < 0) return false;
+    }
+  }
+  return true;
+}
+
+// The extremes are as far apart as the farthest pair of hull vertices
+static bool diameter_matches(const ConvexHull *hull, GPoint *extremes){
+  uint64_t farthest = 0;
+  for(uint16_t i=0; i<hull->points_len; i++){
+    for(uint16_t j=i+1; j<hull->points_len; j++){
+      uint64_t dist = squared_distance(&hull->points[i], &hull->points[j]);
+      if(dist > farthest) farthest = dist;
+    }
+  }
+  return squared_distance(&extremes[0], &extremes[1]) == farthest;
+}
+
+// Each level keeps the ends of the pattern and indexes in order, and no level has more points than the next one in
+static bool lod_valid(const Pattern *pattern){
+  if(!pattern->lod_valid) return false;
+  for(int level=0; level<PATTERN_ZOOM_LEVELS - 1; level++){
+    const uint16_t *indexes = pattern->lod[level];
+    uint16_t len = pattern->lod_len[level];
+    if(len < 2 || indexes[0] != 0 || indexes[len - 1] != pattern->points_len - 1) return false;
+    for(uint16_t i=1; i<len; i++){
+      if(indexes[i] <= indexes[i - 1]) return false;
+    }
+    if(level > 0 && len < pattern->lod_len[level - 1]) return false;
+  }
+  return true;
+}
+
+// A projected pattern's points are pixels of the deepest zoom inside the screen
+static bool projected_on_screen(const Pattern *pattern, GRect screen){
+  for(uint16_t i=0; i<pattern->points_len; i++){
+    GPoint point = pattern->points[i];
+    if(point.x < 0 || point.y < 0 || point.x > screen.size.w * PATTERN_MAX_ZOOM || point.y > screen.size.h * PATTERN_MAX_ZOOM) return false;
+  }
+  return true;
+}
+
+//========================================= CASES ======================================================
+typedef struct {
+  double start;
+  uint32_t allocs;
+} BenchCase;
+
+// Peak heap is the most the app had allocated at once during the case, everything it holds included
+static BenchCase case_begin(){
+  bench_heap.peak = bench_heap.used;
+  return (BenchCase){ now_seconds(), bench_heap.allocs };
+}
+
+static void case_end(BenchCase *bench_case, const BenchRoute *route, const char *stage, uint32_t iterations){
+  double seconds = now_seconds() - bench_case->start;
+  printf("%-20s %-12s %6d %8d %12.2f %10.1f %10d\n", route->name, stage, route->len, (int)iterations,
+         seconds * 1e6 / iterations, (double)(bench_heap.allocs - bench_case->allocs) / iterations,
+         (int)bench_heap.peak);
+}
+
+// One route in a fresh catalog blob, as route ID 0 in the first section
+static MenuItem* bench_catalog(const BenchRoute *route){
+  destroy_menu_items();
+  const char title[] = "BENCH";
+  uint16_t strings_len = sizeof(title) + strlen(route->name) + 1;
+  s_catalog_len = SECTIONS_LEN + sizeof(MenuItem) + strings_len;
+  s_catalog = (uint8_t*)arena_alloc(&s_catalog_arena, s_catalog_len);
+  memset(s_catalog, 0, s_catalog_len);
+  s_catalog[0] = 1;
+  MenuItem item = { .id = 0, .section = 0, .color = GColorFromRGB(0x50, 0x00, 0x00).argb, .title = 0, .subtitle = sizeof(title) };
+  memcpy(&s_catalog[SECTIONS_LEN], &item, sizeof(item));
+  memcpy(&s_catalog[SECTIONS_LEN + sizeof(MenuItem)], title, sizeof(title));
+  memcpy(&s_catalog[SECTIONS_LEN + sizeof(MenuItem) + sizeof(title)], route->name, strlen(route->name) + 1);
+  s_catalog_received = s_catalog_len;
+  attach_catalog();
+  return &s_menu_items[0][0];
+}
+
+static void bench_route(const BenchRoute *route, Layer *layer){
+  uint32_t iterations = BENCH_WORK / route->len;
+  if(iterations < BENCH_MIN_ITERATIONS) iterations = BENCH_MIN_ITERATIONS;
+  BenchTransfer transfer = pack_route(route, 0, NULL);
+  MenuItem *item = bench_catalog(route);
+  BenchCase bench_case;
+
+  // Receiving the header and every frame, decoding and growing the hull. The route is selected and viewed, as it is
+  // when the route window asks for it, so the memory budget keeps it and it is saved once it completes
+  s_selected_route = item;
+  route_pattern(item)->last_viewed = ++s_view_clock;
+  bench_case = case_begin();
+  for(uint32_t n=0; n<iterations; n++){
+    for(uint16_t i=0; i<transfer.len; i++) deliver(&transfer.messages[i]);
+  }
+  case_end(&bench_case, route, "ingest", iterations);
+  check(pattern_complete(route_pattern(item)) && route_pattern(item)->points_total == route->len, route, "ingest completes the pattern");
+  check(hull_contains_pattern(route_pattern(item)), route, "hull contains every point");
+
+  // Only decoding the messages into their fields, without handling them
+  InboxMessage message;
+  uint32_t decoded_fields = 0;
+  bench_case = case_begin();
+  for(uint32_t n=0; n<iterations; n++){
+    for(uint16_t i=0; i<transfer.len; i++){
+      DictionaryIterator iter;
+      dict_read_begin_from_buffer(&iter, transfer.messages[i].buffer, transfer.messages[i].size);
+      decode_inbox(&iter, &message);
+      decoded_fields += message.present != 0;
+    }
+  }
+  case_end(&bench_case, route, "decode", iterations);
+  check(decoded_fields == iterations * transfer.len, route, "every message decodes");
+  DictionaryIterator header_iter;
+  dict_read_begin_from_buffer(&header_iter, transfer.messages[0].buffer, transfer.messages[0].size);
+  decode_inbox(&header_iter, &message);
+  check(message.message_type == MESSAGE_ROUTE_PATTERN_HEADER && message.list_len == route->len &&
+        message.transfer_id == BENCH_TRANSFER_ID && INBOX_HAS(&message, INBOX_ASPECT), route, "header decodes its fields");
+
+  // The hull diameter, which sets the scale every time the hull changes
+  GPoint extremes[2];
+  uint32_t diameter_iterations = iterations * 10;
+  bench_case = case_begin();
+  for(uint32_t n=0; n<diameter_iterations; n++){
+    extreme_points(route_pattern(item)->convex_hull, extremes);
+  }
+  case_end(&bench_case, route, "diameter", diameter_iterations);
+  check(diameter_matches(route_pattern(item)->convex_hull, extremes), route, "diameter is the farthest hull pair");
+
+  // Fitting the whole route to the screen, as when the route window opens. The levels of detail are built by the
+  // first of these and kept with the pattern. Every draw but the blits strokes the line, missing the line cache
+  s_view_zoom = 0;
+  bench_case = case_begin();
+  for(uint32_t n=0; n<iterations; n++){
+    route_pattern(item)->diameter_valid = false;
+    s_pattern_cache_key.pattern = NULL;
+    pattern_layer_update_proc(layer, NULL);
+  }
+  case_end(&bench_case, route, "first draw", iterations);
+  GPoint fit_center;
+  check(fit_pattern(route_pattern(item), layer_get_frame(layer), &fit_center) > 0, route, "first draw fits the pattern");
+  check(lod_valid(route_pattern(item)), route, "levels of detail");
+
+  // Drawing again with the diameter cached
+  bench_case = case_begin();
+  for(uint32_t n=0; n<iterations; n++){
+    s_pattern_cache_key.pattern = NULL;
+    pattern_layer_update_proc(layer, NULL);
+  }
+  case_end(&bench_case, route, "redraw", iterations);
+
+  // Drawing again for vehicles that moved, copying the line from the cache
+  bench_case = case_begin();
+  for(uint32_t n=0; n<iterations; n++){
+    pattern_layer_update_proc(layer, NULL);
+  }
+  case_end(&bench_case, route, "blit redraw", iterations);
+  check(s_pattern_cache == NULL || s_pattern_cache_key.pattern == route_pattern(item), route, "redraw is served from the line cache");
+
+  // The deepest zoom on the middle of the route, where most segments are clipped away
+  s_view_zoom = PATTERN_ZOOM_LEVELS - 1;
+  s_view_center = route_pattern(item)->points[route_pattern(item)->points_len / 2];
+  bench_case = case_begin();
+  for(uint32_t n=0; n<iterations; n++){
+    s_pattern_cache_key.pattern = NULL;
+    pattern_layer_update_proc(layer, NULL);
+  }
+  case_end(&bench_case, route, "zoomed draw", iterations);
+  s_view_zoom = 0;
+
+  // Receiving the route while it is on screen, drawing after every frame
+  bench_case = case_begin();
+  for(uint32_t n=0; n<iterations; n++){
+    for(uint16_t i=0; i<transfer.len; i++){
+      deliver(&transfer.messages[i]);
+      pattern_layer_update_proc(layer, NULL);
+    }
+  }
+  case_end(&bench_case, route, "stream+draw", iterations);
+  check(pattern_complete(route_pattern(item)), route, "streamed pattern completes");
+  free(transfer.messages);
+
+  // The same route projected to the screen by the phone, which the watch draws without a hull
+  GRect screen = layer_get_frame(layer);
+  transfer = pack_route(route, 0, &screen);
+  bench_case = case_begin();
+  for(uint32_t n=0; n<iterations; n++){
+    for(uint16_t i=0; i<transfer.len; i++) deliver(&transfer.messages[i]);
+  }
+  case_end(&bench_case, route, "proj ingest", iterations);
+  check(pattern_complete(route_pattern(item)) && route_pattern(item)->bounds.projected, route, "projected pattern completes");
+  check(projected_on_screen(route_pattern(item), screen), route, "projected points are on screen");
+
+  bench_case = case_begin();
+  for(uint32_t n=0; n<iterations; n++){
+    s_pattern_cache_key.pattern = NULL;
+    pattern_layer_update_proc(layer, NULL);
+  }
+  case_end(&bench_case, route, "proj redraw", iterations);
+
+  s_view_zoom = PATTERN_ZOOM_LEVELS - 1;
+  s_view_center = route_pattern(item)->points[route_pattern(item)->points_len / 2];
+  bench_case = case_begin();
+  for(uint32_t n=0; n<iterations; n++){
+    s_pattern_cache_key.pattern = NULL;
+    pattern_layer_update_proc(layer, NULL);
+  }
+  case_end(&bench_case, route, "proj zoomed", iterations);
+  s_view_zoom = 0;
+
+  s_selected_route = NULL;
+  destroy_pattern_cache();
+  destroy_menu_items();
+  free(transfer.messages);
+}
+
+int main(int argc, char **argv){
+  bench_heap.size = PBL_IF_COLOR_ELSE(64, 24) * 1024;
+  persist_check_version();
+  inbox_decoder_init();
+  Window *window = window_create();
+  Layer *layer = layer_create(layer_get_frame(window_get_root_layer(window)));
+
+  BenchRoute *routes[16];
+  int routes_len = 0;
+  routes[routes_len++] = synthetic_loop("synthetic-loop", 64);
+  routes[routes_len++] = synthetic_grid("synthetic-grid", 256);
+  routes[routes_len++] = synthetic_grid("synthetic-grid-xl", 4096);
+  routes[routes_len++] = synthetic_loop("synthetic-loop-xl", 2048);
+  for(int i=1; i<argc && routes_len < 16; i++){
+    BenchRoute *route = recorded_route(argv[i]);
+    if(route != NULL) routes[routes_len++] = route;
+  }
+
+  printf("%s, %d byte inbox, %d byte heap\n", PBL_IF_COLOR_ELSE("basalt", "aplite"), INBOX_SIZE, (int)bench_heap.size);
+  printf("%-20s %-12s %6s %8s %12s %10s %10s\n", "route", "case", "points", "iters", "us/iter", "allocs", "peak heap");
+  for(int i=0; i<routes_len; i++){
+    bench_route(routes[i], layer);
+    route_destroy(routes[i]);
+  }
+
+  layer_destroy(layer);
+  window_destroy(window);
+  fprintf(stderr, "drawn %llu, heap left in use %d\n", (unsigned long long)bench_drawn_points, (int)bench_heap.used);
+  if(s_check_failures > 0) fprintf(stderr, "%d checks failed\n", s_check_failures);
+  return s_check_failures > 0;
+}
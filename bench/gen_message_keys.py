@@ -0,0 +1,33 @@
+#!/usr/bin/env python3
+"""Write message_keys.auto.h and message_keys.auto.c for the host build.
+
+The keys come from messageKeys in package.json and are numbered from 10000 in
+order, the way the Pebble SDK assigns them.
+
+Usage: gen_message_keys.py path/to/package.json out_dir
+"""
+import json
+import os
+import sys
+
+FIRST_KEY = 10000
+
+
+def main():
+    package_path, out_dir = sys.argv[1], sys.argv[2]
+    with open(package_path) as package_file:
+        keys = json.load(package_file)['pebble']['messageKeys']
+
+    with open(os.path.join(out_dir, 'message_keys.auto.h'), 'w') as header:
+        header.write('#pragma once\n#include <stdint.h>\n\n')
+        for key in keys:
+            header.write('extern uint32_t MESSAGE_KEY_{};\n'.format(key))
+
+    with open(os.path.join(out_dir, 'message_keys.auto.c'), 'w') as source:
+        source.write('#include <stdint.h>\n\n')
+        for index, key in enumerate(keys):
+            source.write('uint32_t MESSAGE_KEY_{} = {};\n'.format(key, FIRST_KEY + index))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,253 @@
+#pragma once
+// A stand-in for the parts of the Pebble SDK the watch app uses, so src/c can be built and measured on a host.
+// Only the dictionary, line drawing, framebuffer, persist and heap functions do real work. Windows, layers and menus are inert.
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include "message_keys.auto.h"
+
+#define S_TRUE 1
+#define S_FALSE 0
+#define ARRAY_LENGTH(array) (sizeof((array))/sizeof((array)[0]))
+
+// Platform. Basalt unless built with PLATFORM=aplite
+#ifdef PBL_PLATFORM_APLITE
+#define PBL_BW 1
+#define PBL_IF_COLOR_ELSE(a, b) (b)
+#else
+#define PBL_PLATFORM_BASALT 1
+#define PBL_COLOR 1
+#define PBL_IF_COLOR_ELSE(a, b) (a)
+#endif
+#define PBL_RECT 1
+#define PBL_IF_ROUND_ELSE(a, b) (b)
+#define PBL_IF_RECT_ELSE(a, b) (a)
+
+//========================================= GRAPHICS TYPES ======================================================
+typedef struct { int16_t x, y; } GPoint;
+#define GPoint(x, y) ((GPoint){(x), (y)})
+#define GPointZero GPoint(0, 0)
+typedef struct { int16_t w, h; } GSize;
+#define GSize(w, h) ((GSize){(w), (h)})
+typedef struct { GPoint origin; GSize size; } GRect;
+#define GRect(x, y, w, h) ((GRect){{(x), (y)}, {(w), (h)}})
+typedef union { uint8_t argb; } GColor8;
+typedef GColor8 GColor;
+#define GColorBlack ((GColor8){0xC0})
+#define GColorWhite ((GColor8){0xFF})
+#define GColorClear ((GColor8){0x00})
+
+typedef struct GContext GContext;
+typedef struct Layer Layer;
+typedef struct Window Window;
+typedef struct TextLayer TextLayer;
+typedef struct MenuLayer MenuLayer;
+typedef struct GBitmap GBitmap;
+typedef enum { GBitmapFormat1Bit = 0, GBitmapFormat8Bit = 1 } GBitmapFormat;
+typedef enum { GTextAlignmentLeft, GTextAlignmentCenter, GTextAlignmentRight } GTextAlignment;
+typedef void (*LayerUpdateProc)(Layer *layer, GContext *ctx);
+
+//========================================= WINDOWS AND MENUS ======================================================
+typedef void (*WindowHandler)(Window *window);
+typedef struct { WindowHandler load, appear, disappear, unload; } WindowHandlers;
+typedef void *ClickRecognizerRef;
+typedef void (*ClickHandler)(ClickRecognizerRef recognizer, void *context);
+typedef void (*ClickConfigProvider)(void *context);
+typedef enum { BUTTON_ID_BACK, BUTTON_ID_UP, BUTTON_ID_SELECT, BUTTON_ID_DOWN } ButtonId;
+
+typedef struct { uint16_t section; uint16_t row; } MenuIndex;
+#define MenuIndex(section, row) ((MenuIndex){(section), (row)})
+typedef enum { MenuRowAlignNone, MenuRowAlignCenter, MenuRowAlignTop, MenuRowAlignBottom } MenuRowAlign;
+#define MENU_CELL_BASIC_HEADER_HEIGHT 16
+#define MENU_CELL_ROUND_FOCUSED_SHORT_CELL_HEIGHT 68
+#define MENU_CELL_ROUND_UNFOCUSED_SHORT_CELL_HEIGHT 24
+typedef struct {
+  uint16_t (*get_num_sections)(MenuLayer *menu_layer, void *context);
+  uint16_t (*get_num_rows)(MenuLayer *menu_layer, uint16_t section_index, void *context);
+  int16_t (*get_cell_height)(MenuLayer *menu_layer, MenuIndex *cell_index, void *context);
+  int16_t (*get_header_height)(MenuLayer *menu_layer, uint16_t section_index, void *context);
+  void (*draw_row)(GContext *ctx, const Layer *cell_layer, MenuIndex *cell_index, void *context);
+  void (*draw_header)(GContext *ctx, const Layer *cell_layer, uint16_t section_index, void *context);
+  void (*select_click)(MenuLayer *menu_layer, MenuIndex *cell_index, void *context);
+  void (*select_long_click)(MenuLayer *menu_layer, MenuIndex *cell_index, void *context);
+  void (*selection_changed)(MenuLayer *menu_layer, MenuIndex new_index, MenuIndex old_index, void *context);
+} MenuLayerCallbacks;
+
+//========================================= DICTIONARIES AND APPMESSAGE ======================================================
+// Laid out like the SDK's, so dictionaries built here have the same sizes as the ones the phone sends
+typedef enum { TUPLE_BYTE_ARRAY = 0, TUPLE_CSTRING = 1, TUPLE_UINT = 2, TUPLE_INT = 3 } TupleType;
+typedef struct __attribute__((packed)) {
+  uint32_t key;
+  TupleType type:8;
+  uint16_t length;
+  union {
+    uint8_t data[0];
+    char cstring[0];
+    uint8_t uint8;
+    uint16_t uint16;
+    uint32_t uint32;
+    int8_t int8;
+    int16_t int16;
+    int32_t int32;
+  } value[];
+} Tuple;
+typedef struct __attribute__((packed)) { uint8_t count; Tuple head[]; } Dictionary;
+typedef struct { Dictionary *dictionary; const void *end; Tuple *cursor; } DictionaryIterator;
+typedef enum { DICT_OK = 0, DICT_NOT_ENOUGH_STORAGE = 2, DICT_INVALID_ARGS = 4 } DictionaryResult;
+
+typedef enum { APP_MSG_OK = 0, APP_MSG_SEND_TIMEOUT = 2, APP_MSG_SEND_REJECTED = 4, APP_MSG_NOT_CONNECTED = 8, APP_MSG_BUSY = 64, APP_MSG_BUFFER_OVERFLOW = 128 } AppMessageResult;
+typedef void (*AppMessageInboxReceived)(DictionaryIterator *iterator, void *context);
+typedef void (*AppMessageInboxDropped)(AppMessageResult reason, void *context);
+typedef void (*AppMessageOutboxSent)(DictionaryIterator *iterator, void *context);
+typedef void (*AppMessageOutboxFailed)(DictionaryIterator *iterator, AppMessageResult reason, void *context);
+#define APP_MESSAGE_INBOX_SIZE_MINIMUM 124
+#define APP_MESSAGE_OUTBOX_SIZE_MINIMUM 636
+
+#define PERSIST_DATA_MAX_LENGTH 256
+
+typedef enum { APP_LOG_LEVEL_ERROR = 1, APP_LOG_LEVEL_WARNING = 50, APP_LOG_LEVEL_INFO = 100, APP_LOG_LEVEL_DEBUG = 200, APP_LOG_LEVEL_DEBUG_VERBOSE = 255 } AppLogLevel;
+void app_log(uint8_t log_level, const char *src_filename, int src_line_number, const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+#define APP_LOG(level, fmt, args...) app_log(level, __FILE__, __LINE__, fmt, ## args)
+
+typedef struct AppTimer AppTimer;
+typedef void (*AppTimerCallback)(void *data);
+
+DictionaryResult dict_write_begin(DictionaryIterator *iter, uint8_t *const buffer, const uint16_t size);
+DictionaryResult dict_write_data(DictionaryIterator *iter, const uint32_t key, const uint8_t *const data, const uint16_t size);
+DictionaryResult dict_write_cstring(DictionaryIterator *iter, const uint32_t key, const char *const cstring);
+DictionaryResult dict_write_int(DictionaryIterator *iter, const uint32_t key, const void *integer, const uint8_t width_bytes, const bool is_signed);
+DictionaryResult dict_write_uint8(DictionaryIterator *iter, const uint32_t key, const uint8_t value);
+DictionaryResult dict_write_uint16(DictionaryIterator *iter, const uint32_t key, const uint16_t value);
+DictionaryResult dict_write_uint32(DictionaryIterator *iter, const uint32_t key, const uint32_t value);
+DictionaryResult dict_write_int32(DictionaryIterator *iter, const uint32_t key, const int32_t value);
+uint32_t dict_write_end(DictionaryIterator *iter);
+Tuple *dict_read_begin_from_buffer(DictionaryIterator *iter, const uint8_t *const buffer, const uint16_t size);
+Tuple *dict_read_next(DictionaryIterator *iter);
+Tuple *dict_read_first(DictionaryIterator *iter);
+Tuple *dict_find(const DictionaryIterator *iter, const uint32_t key);
+
+AppMessageResult app_message_open(const uint32_t size_inbound, const uint32_t size_outbound);
+AppMessageResult app_message_outbox_begin(DictionaryIterator **iterator);
+AppMessageResult app_message_outbox_send(void);
+AppMessageInboxReceived app_message_register_inbox_received(AppMessageInboxReceived received_callback);
+AppMessageInboxDropped app_message_register_inbox_dropped(AppMessageInboxDropped dropped_callback);
+AppMessageOutboxSent app_message_register_outbox_sent(AppMessageOutboxSent sent_callback);
+AppMessageOutboxFailed app_message_register_outbox_failed(AppMessageOutboxFailed failed_callback);
+void app_message_deregister_callbacks(void);
+void app_event_loop(void);
+
+//========================================= UI ======================================================
+Window *window_create(void);
+void window_destroy(Window *window);
+void window_set_window_handlers(Window *window, WindowHandlers handlers);
+void window_set_click_config_provider(Window *window, ClickConfigProvider click_config_provider);
+Layer *window_get_root_layer(const Window *window);
+void window_stack_push(Window *window, bool animated);
+bool window_stack_remove(Window *window, bool animated);
+bool window_stack_contains_window(Window *window);
+Window *window_stack_get_top_window(void);
+void window_single_click_subscribe(ButtonId button_id, ClickHandler handler);
+void window_long_click_subscribe(ButtonId button_id, uint16_t delay_ms, ClickHandler down_handler, ClickHandler up_handler);
+
+Layer *layer_create(GRect frame);
+void layer_destroy(Layer *layer);
+void layer_mark_dirty(Layer *layer);
+void layer_set_update_proc(Layer *layer, LayerUpdateProc update_proc);
+void layer_set_frame(Layer *layer, GRect frame);
+GRect layer_get_frame(const Layer *layer);
+GRect layer_get_bounds(const Layer *layer);
+void layer_set_hidden(Layer *layer, bool hidden);
+void layer_add_child(Layer *parent, Layer *child);
+
+TextLayer *text_layer_create(GRect frame);
+void text_layer_destroy(TextLayer *text_layer);
+Layer *text_layer_get_layer(TextLayer *text_layer);
+void text_layer_set_text(TextLayer *text_layer, const char *text);
+void text_layer_set_background_color(TextLayer *text_layer, GColor color);
+void text_layer_set_text_color(TextLayer *text_layer, GColor color);
+void text_layer_set_text_alignment(TextLayer *text_layer, GTextAlignment text_alignment);
+GSize text_layer_get_content_size(TextLayer *text_layer);
+
+MenuLayer *menu_layer_create(GRect frame);
+void menu_layer_destroy(MenuLayer *menu_layer);
+Layer *menu_layer_get_layer(const MenuLayer *menu_layer);
+void menu_layer_set_callbacks(MenuLayer *menu_layer, void *callback_context, MenuLayerCallbacks callbacks);
+void menu_layer_set_click_config_onto_window(MenuLayer *menu_layer, Window *window);
+void menu_layer_reload_data(MenuLayer *menu_layer);
+void menu_layer_set_selected_index(MenuLayer *menu_layer, MenuIndex index, MenuRowAlign scroll_align, bool animated);
+MenuIndex menu_layer_get_selected_index(const MenuLayer *menu_layer);
+bool menu_layer_is_index_selected(const MenuLayer *menu_layer, MenuIndex *index);
+void menu_layer_set_highlight_colors(MenuLayer *menu_layer, GColor background, GColor foreground);
+void menu_cell_basic_header_draw(GContext *ctx, const Layer *cell_layer, const char *title);
+void menu_cell_basic_draw(GContext *ctx, const Layer *cell_layer, const char *title, const char *subtitle, GBitmap *icon);
+
+//========================================= DRAWING ======================================================
+GColor GColorFromRGB(uint8_t red, uint8_t green, uint8_t blue);
+GPoint grect_center_point(const GRect *rect);
+bool gpoint_equal(const GPoint *const point_a, const GPoint *const point_b);
+void graphics_draw_line(GContext *ctx, GPoint p0, GPoint p1);
+void graphics_context_set_stroke_color(GContext *ctx, GColor color);
+void graphics_context_set_stroke_width(GContext *ctx, uint8_t stroke_width);
+void graphics_context_set_fill_color(GContext *ctx, GColor color);
+void graphics_fill_circle(GContext *ctx, GPoint p, uint16_t radius);
+
+GBitmap *gbitmap_create_blank(GSize size, GBitmapFormat format);
+void gbitmap_destroy(GBitmap *bitmap);
+GRect gbitmap_get_bounds(const GBitmap *bitmap);
+GBitmapFormat gbitmap_get_format(const GBitmap *bitmap);
+uint16_t gbitmap_get_bytes_per_row(const GBitmap *bitmap);
+uint8_t *gbitmap_get_data(const GBitmap *bitmap);
+GBitmap *graphics_capture_frame_buffer(GContext *ctx);
+bool graphics_release_frame_buffer(GContext *ctx, GBitmap *buffer);
+void graphics_draw_bitmap_in_rect(GContext *ctx, const GBitmap *bitmap, GRect rect);
+
+//========================================= SERVICES ======================================================
+AppTimer *app_timer_register(uint32_t timeout_ms, AppTimerCallback callback, void *callback_data);
+bool app_timer_reschedule(AppTimer *timer_handle, uint32_t new_timeout_ms);
+void app_timer_cancel(AppTimer *timer_handle);
+
+typedef enum { SECOND_UNIT = 1, MINUTE_UNIT = 2, HOUR_UNIT = 4, DAY_UNIT = 8, MONTH_UNIT = 16, YEAR_UNIT = 32 } TimeUnits;
+typedef void (*TickHandler)(struct tm *tick_time, TimeUnits units_changed);
+void tick_timer_service_subscribe(TimeUnits tick_units, TickHandler handler);
+void tick_timer_service_unsubscribe(void);
+bool clock_is_24h_style(void);
+uint16_t time_ms(time_t *tloc, uint16_t *out_ms);
+
+bool persist_exists(const uint32_t key);
+int persist_read_int(const uint32_t key);
+int persist_read_data(const uint32_t key, void *buffer, const size_t buffer_size);
+int persist_write_int(const uint32_t key, const int32_t value);
+int persist_write_data(const uint32_t key, const void *data, const size_t size);
+int persist_delete(const uint32_t key);
+
+size_t heap_bytes_free(void);
+size_t heap_bytes_used(void);
+
+//========================================= BENCH HOOKS ======================================================
+// The app's heap calls are counted so each benchmark can report allocations and peak heap
+typedef struct {
+  size_t size; // Heap the shim pretends the watch has, for heap_bytes_free
+  size_t used;
+  size_t peak;
+  uint32_t allocs;
+} BenchHeap;
+extern BenchHeap bench_heap;
+
+void *bench_malloc(size_t size);
+void *bench_calloc(size_t count, size_t size);
+void *bench_realloc(void *ptr, size_t size);
+void bench_free(void *ptr);
+
+// Sum of the line ends handed to graphics_draw_line, so drawing has an observable result
+extern uint64_t bench_drawn_points;
+
+#ifndef BENCH_SHIM_IMPL
+#define malloc(size) bench_malloc(size)
+#define calloc(count, size) bench_calloc(count, size)
+#define realloc(ptr, size) bench_realloc(ptr, size)
+#define free(ptr) bench_free(ptr)
+#endif
@@ -0,0 +1,404 @@
+#define BENCH_SHIM_IMPL
+#include "pebble.h"
+#include <stdarg.h>
+
+//========================================= HEAP ======================================================
+// Each block carries its size in front so frees can be subtracted from the running total
+typedef struct {
+  size_t size;
+  max_align_t align;
+} BenchBlock;
+
+BenchHeap bench_heap = { 64 * 1024, 0, 0, 0 };
+
+void *bench_malloc(size_t size){
+  BenchBlock *block = (BenchBlock*)malloc(sizeof(BenchBlock) + size);
+  if(block == NULL) return NULL;
+  block->size = size;
+  bench_heap.used += size;
+  bench_heap.allocs++;
+  if(bench_heap.used > bench_heap.peak) bench_heap.peak = bench_heap.used;
+  return &block[1];
+}
+
+void *bench_calloc(size_t count, size_t size){
+  void *ptr = bench_malloc(count * size);
+  if(ptr != NULL) memset(ptr, 0, count * size);
+  return ptr;
+}
+
+void bench_free(void *ptr){
+  if(ptr == NULL) return;
+  BenchBlock *block = &((BenchBlock*)ptr)[-1];
+  bench_heap.used -= block->size;
+  free(block);
+}
+
+void *bench_realloc(void *ptr, size_t size){
+  void *grown = bench_malloc(size);
+  if(grown != NULL && ptr != NULL){
+    size_t old_size = ((BenchBlock*)ptr)[-1].size;
+    memcpy(grown, ptr, old_size < size ? old_size : size);
+  }
+  bench_free(ptr);
+  return grown;
+}
+
+size_t heap_bytes_free(void){
+  return bench_heap.used < bench_heap.size ? bench_heap.size - bench_heap.used : 0;
+}
+
+size_t heap_bytes_used(void){
+  return bench_heap.used;
+}
+
+//========================================= LOGGING ======================================================
+// Quiet unless BENCH_LOG is set in the environment, since logging would dominate every timing
+void app_log(uint8_t log_level, const char *src_filename, int src_line_number, const char *fmt, ...){
+  static int enabled = -1;
+  if(enabled < 0) enabled = getenv("BENCH_LOG") != NULL;
+  if(!enabled) return;
+  va_list args;
+  va_start(args, fmt);
+  fprintf(stderr, "%s:%d ", src_filename, src_line_number);
+  vfprintf(stderr, fmt, args);
+  fputc('\n', stderr);
+  va_end(args);
+}
+
+//========================================= DICTIONARIES ======================================================
+static Tuple *next_tuple(const Tuple *tuple){
+  return (Tuple*)((const uint8_t*)tuple + sizeof(Tuple) + tuple->length);
+}
+
+DictionaryResult dict_write_begin(DictionaryIterator *iter, uint8_t *const buffer, const uint16_t size){
+  if(iter == NULL || buffer == NULL || size < sizeof(Dictionary)) return DICT_INVALID_ARGS;
+  iter->dictionary = (Dictionary*)buffer;
+  iter->dictionary->count = 0;
+  iter->end = buffer + size;
+  iter->cursor = iter->dictionary->head;
+  return DICT_OK;
+}
+
+static DictionaryResult write_tuple(DictionaryIterator *iter, uint32_t key, TupleType type, const void *value, uint16_t length){
+  if((const uint8_t*)iter->cursor + sizeof(Tuple) + length > (const uint8_t*)iter->end) return DICT_NOT_ENOUGH_STORAGE;
+  iter->cursor->key = key;
+  iter->cursor->type = type;
+  iter->cursor->length = length;
+  memcpy(iter->cursor->value, value, length);
+  iter->cursor = next_tuple(iter->cursor);
+  iter->dictionary->count++;
+  return DICT_OK;
+}
+
+DictionaryResult dict_write_data(DictionaryIterator *iter, const uint32_t key, const uint8_t *const data, const uint16_t size){
+  return write_tuple(iter, key, TUPLE_BYTE_ARRAY, data, size);
+}
+
+DictionaryResult dict_write_cstring(DictionaryIterator *iter, const uint32_t key, const char *const cstring){
+  return write_tuple(iter, key, TUPLE_CSTRING, cstring, strlen(cstring) + 1);
+}
+
+DictionaryResult dict_write_int(DictionaryIterator *iter, const uint32_t key, const void *integer, const uint8_t width_bytes, const bool is_signed){
+  return write_tuple(iter, key, is_signed ? TUPLE_INT : TUPLE_UINT, integer, width_bytes);
+}
+
+DictionaryResult dict_write_uint8(DictionaryIterator *iter, const uint32_t key, const uint8_t value){
+  return dict_write_int(iter, key, &value, sizeof(value), false);
+}
+
+DictionaryResult dict_write_uint16(DictionaryIterator *iter, const uint32_t key, const uint16_t value){
+  return dict_write_int(iter, key, &value, sizeof(value), false);
+}
+
+DictionaryResult dict_write_uint32(DictionaryIterator *iter, const uint32_t key, const uint32_t value){
+  return dict_write_int(iter, key, &value, sizeof(value), false);
+}
+
+DictionaryResult dict_write_int32(DictionaryIterator *iter, const uint32_t key, const int32_t value){
+  return dict_write_int(iter, key, &value, sizeof(value), true);
+}
+
+uint32_t dict_write_end(DictionaryIterator *iter){
+  iter->end = iter->cursor;
+  return (const uint8_t*)iter->cursor - (const uint8_t*)iter->dictionary;
+}
+
+Tuple *dict_read_begin_from_buffer(DictionaryIterator *iter, const uint8_t *const buffer, const uint16_t size){
+  iter->dictionary = (Dictionary*)buffer;
+  iter->end = buffer + size;
+  return dict_read_first(iter);
+}
+
+Tuple *dict_read_first(DictionaryIterator *iter){
+  iter->cursor = iter->dictionary->head;
+  if(iter->dictionary->count == 0) return NULL;
+  return iter->cursor;
+}
+
+Tuple *dict_read_next(DictionaryIterator *iter){
+  Tuple *next = next_tuple(iter->cursor);
+  if((const void*)next >= iter->end) return NULL;
+  iter->cursor = next;
+  return next;
+}
+
+Tuple *dict_find(const DictionaryIterator *iter, const uint32_t key){
+  Tuple *tuple = iter->dictionary->head;
+  for(uint8_t i=0; i<iter->dictionary->count && (const void*)tuple < iter->end; i++){
+    if(tuple->key == key) return tuple;
+    tuple = next_tuple(tuple);
+  }
+  return NULL;
+}
+
+//========================================= APPMESSAGE ======================================================
+// Outgoing messages are built and dropped, the benchmarks feed the inbox handler directly
+static uint8_t s_outbox[APP_MESSAGE_OUTBOX_SIZE_MINIMUM];
+static DictionaryIterator s_outbox_iter;
+
+AppMessageResult app_message_open(const uint32_t size_inbound, const uint32_t size_outbound){ return APP_MSG_OK; }
+AppMessageResult app_message_outbox_begin(DictionaryIterator **iterator){
+  dict_write_begin(&s_outbox_iter, s_outbox, sizeof(s_outbox));
+  *iterator = &s_outbox_iter;
+  return APP_MSG_OK;
+}
+AppMessageResult app_message_outbox_send(void){ return APP_MSG_OK; }
+AppMessageInboxReceived app_message_register_inbox_received(AppMessageInboxReceived received_callback){ return NULL; }
+AppMessageInboxDropped app_message_register_inbox_dropped(AppMessageInboxDropped dropped_callback){ return NULL; }
+AppMessageOutboxSent app_message_register_outbox_sent(AppMessageOutboxSent sent_callback){ return NULL; }
+AppMessageOutboxFailed app_message_register_outbox_failed(AppMessageOutboxFailed failed_callback){ return NULL; }
+void app_message_deregister_callbacks(void){}
+void app_event_loop(void){}
+
+//========================================= UI ======================================================
+// Every UI object is a layer with a frame. That is all the app ever reads back from them
+// Like the SDK, they are allocated on the app heap so they show up in its accounting
+struct Layer {
+  GRect frame;
+  LayerUpdateProc update_proc;
+};
+struct Window { Layer root; };
+struct TextLayer { Layer layer; };
+struct MenuLayer { Layer layer; };
+
+#define BENCH_SCREEN GRect(0, 0, 144, 168)
+
+Window *window_create(void){
+  Window *window = (Window*)bench_calloc(1, sizeof(Window));
+  window->root.frame = BENCH_SCREEN;
+  return window;
+}
+void window_destroy(Window *window){ bench_free(window); }
+void window_set_window_handlers(Window *window, WindowHandlers handlers){}
+void window_set_click_config_provider(Window *window, ClickConfigProvider click_config_provider){}
+Layer *window_get_root_layer(const Window *window){ return (Layer*)&window->root; }
+void window_stack_push(Window *window, bool animated){}
+bool window_stack_remove(Window *window, bool animated){ return false; }
+bool window_stack_contains_window(Window *window){ return false; }
+Window *window_stack_get_top_window(void){ return NULL; }
+void window_single_click_subscribe(ButtonId button_id, ClickHandler handler){}
+void window_long_click_subscribe(ButtonId button_id, uint16_t delay_ms, ClickHandler down_handler, ClickHandler up_handler){}
+
+Layer *layer_create(GRect frame){
+  Layer *layer = (Layer*)bench_calloc(1, sizeof(Layer));
+  layer->frame = frame;
+  return layer;
+}
+void layer_destroy(Layer *layer){ bench_free(layer); }
+void layer_mark_dirty(Layer *layer){}
+void layer_set_update_proc(Layer *layer, LayerUpdateProc update_proc){ layer->update_proc = update_proc; }
+void layer_set_frame(Layer *layer, GRect frame){ layer->frame = frame; }
+GRect layer_get_frame(const Layer *layer){ return layer->frame; }
+GRect layer_get_bounds(const Layer *layer){ return GRect(0, 0, layer->frame.size.w, layer->frame.size.h); }
+void layer_set_hidden(Layer *layer, bool hidden){}
+void layer_add_child(Layer *parent, Layer *child){}
+
+TextLayer *text_layer_create(GRect frame){ return (TextLayer*)layer_create(frame); }
+void text_layer_destroy(TextLayer *text_layer){ bench_free(text_layer); }
+Layer *text_layer_get_layer(TextLayer *text_layer){ return &text_layer->layer; }
+void text_layer_set_text(TextLayer *text_layer, const char *text){}
+void text_layer_set_background_color(TextLayer *text_layer, GColor color){}
+void text_layer_set_text_color(TextLayer *text_layer, GColor color){}
+void text_layer_set_text_alignment(TextLayer *text_layer, GTextAlignment text_alignment){}
+GSize text_layer_get_content_size(TextLayer *text_layer){ return GSize(text_layer->layer.frame.size.w, 20); }
+
+MenuLayer *menu_layer_create(GRect frame){ return (MenuLayer*)layer_create(frame); }
+void menu_layer_destroy(MenuLayer *menu_layer){ bench_free(menu_layer); }
+Layer *menu_layer_get_layer(const MenuLayer *menu_layer){ return (Layer*)&menu_layer->layer; }
+void menu_layer_set_callbacks(MenuLayer *menu_layer, void *callback_context, MenuLayerCallbacks callbacks){}
+void menu_layer_set_click_config_onto_window(MenuLayer *menu_layer, Window *window){}
+void menu_layer_reload_data(MenuLayer *menu_layer){}
+void menu_layer_set_selected_index(MenuLayer *menu_layer, MenuIndex index, MenuRowAlign scroll_align, bool animated){}
+MenuIndex menu_layer_get_selected_index(const MenuLayer *menu_layer){ return MenuIndex(0, 0); }
+bool menu_layer_is_index_selected(const MenuLayer *menu_layer, MenuIndex *index){ return false; }
+void menu_layer_set_highlight_colors(MenuLayer *menu_layer, GColor background, GColor foreground){}
+void menu_cell_basic_header_draw(GContext *ctx, const Layer *cell_layer, const char *title){}
+void menu_cell_basic_draw(GContext *ctx, const Layer *cell_layer, const char *title, const char *subtitle, GBitmap *icon){}
+
+//========================================= DRAWING ======================================================
+uint64_t bench_drawn_points = 0;
+
+GColor GColorFromRGB(uint8_t red, uint8_t green, uint8_t blue){
+  return (GColor){ .argb = 0xC0 | ((red >> 6) << 4) | ((green >> 6) << 2) | (blue >> 6) };
+}
+
+GPoint grect_center_point(const GRect *rect){
+  return GPoint(rect->origin.x + rect->size.w / 2, rect->origin.y + rect->size.h / 2);
+}
+
+bool gpoint_equal(const GPoint *const point_a, const GPoint *const point_b){
+  return point_a->x == point_b->x && point_a->y == point_b->y;
+}
+
+void graphics_draw_line(GContext *ctx, GPoint p0, GPoint p1){
+  bench_drawn_points += (uint16_t)(p0.x ^ p0.y) + (uint16_t)(p1.x ^ p1.y) + 2;
+}
+void graphics_context_set_stroke_color(GContext *ctx, GColor color){}
+void graphics_context_set_stroke_width(GContext *ctx, uint8_t stroke_width){}
+void graphics_context_set_fill_color(GContext *ctx, GColor color){}
+void graphics_fill_circle(GContext *ctx, GPoint p, uint16_t radius){}
+
+// Bitmaps hold real pixels, in the layout of the platform's framebuffer: rows of 1 bit pixels padded to 4 bytes on
+// Aplite, a byte a pixel otherwise. Blits are copied row by row so they cost about what they would on the watch
+struct GBitmap {
+  GRect bounds;
+  GBitmapFormat format;
+  uint16_t bytes_per_row;
+  uint8_t *data;
+};
+
+static uint16_t bitmap_bytes_per_row(int16_t width, GBitmapFormat format){
+  return format == GBitmapFormat1Bit ? (width + 31) / 32 * 4 : width;
+}
+
+GBitmap *gbitmap_create_blank(GSize size, GBitmapFormat format){
+  GBitmap *bitmap = (GBitmap*)bench_calloc(1, sizeof(GBitmap));
+  if(bitmap == NULL) return NULL;
+  bitmap->bounds = GRect(0, 0, size.w, size.h);
+  bitmap->format = format;
+  bitmap->bytes_per_row = bitmap_bytes_per_row(size.w, format);
+  bitmap->data = (uint8_t*)bench_calloc(size.h, bitmap->bytes_per_row);
+  if(bitmap->data == NULL){
+    bench_free(bitmap);
+    return NULL;
+  }
+  return bitmap;
+}
+void gbitmap_destroy(GBitmap *bitmap){
+  if(bitmap == NULL) return;
+  bench_free(bitmap->data);
+  bench_free(bitmap);
+}
+GRect gbitmap_get_bounds(const GBitmap *bitmap){ return bitmap->bounds; }
+GBitmapFormat gbitmap_get_format(const GBitmap *bitmap){ return bitmap->format; }
+uint16_t gbitmap_get_bytes_per_row(const GBitmap *bitmap){ return bitmap->bytes_per_row; }
+uint8_t *gbitmap_get_data(const GBitmap *bitmap){ return bitmap->data; }
+
+// The screen the layers draw to. Its pixels are outside the app heap, as on the watch
+#define BENCH_FRAME_BUFFER_FORMAT PBL_IF_COLOR_ELSE(GBitmapFormat8Bit, GBitmapFormat1Bit)
+static uint8_t s_frame_buffer_data[168 * 144];
+static GBitmap s_frame_buffer = { {{0, 0}, {144, 168}}, BENCH_FRAME_BUFFER_FORMAT, PBL_IF_COLOR_ELSE(144, 20), s_frame_buffer_data };
+
+GBitmap *graphics_capture_frame_buffer(GContext *ctx){ return &s_frame_buffer; }
+bool graphics_release_frame_buffer(GContext *ctx, GBitmap *buffer){ return true; }
+void graphics_draw_bitmap_in_rect(GContext *ctx, const GBitmap *bitmap, GRect rect){
+  uint16_t bytes = bitmap->bytes_per_row < s_frame_buffer.bytes_per_row ? bitmap->bytes_per_row : s_frame_buffer.bytes_per_row;
+  for(int16_t y=0; y<rect.size.h && y<bitmap->bounds.size.h && rect.origin.y + y < s_frame_buffer.bounds.size.h; y++){
+    memcpy(&s_frame_buffer.data[(rect.origin.y + y) * s_frame_buffer.bytes_per_row], &bitmap->data[y * bitmap->bytes_per_row], bytes);
+  }
+  bench_drawn_points += bitmap->data[0] + 1;
+}
+
+//========================================= SERVICES ======================================================
+// Timers never fire. The app only uses them to pace redraws, which the benchmarks drive directly
+AppTimer *app_timer_register(uint32_t timeout_ms, AppTimerCallback callback, void *callback_data){
+  static int timer;
+  return (AppTimer*)&timer;
+}
+bool app_timer_reschedule(AppTimer *timer_handle, uint32_t new_timeout_ms){ return true; }
+void app_timer_cancel(AppTimer *timer_handle){}
+
+// The tick service never ticks either
+void tick_timer_service_subscribe(TimeUnits tick_units, TickHandler handler){}
+void tick_timer_service_unsubscribe(void){}
+bool clock_is_24h_style(void){ return true; }
+
+// The host's monotonic clock, which is all the app times itself with
+uint16_t time_ms(time_t *tloc, uint16_t *out_ms){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  if(tloc != NULL) *tloc = ts.tv_sec;
+  if(out_ms != NULL) *out_ms = ts.tv_nsec / 1000000;
+  return ts.tv_nsec / 1000000;
+}
+
+// Persistent storage held in memory, with the watch's 4 KB total and 256 byte per key limits
+#define PERSIST_TOTAL 4096
+#define PERSIST_KEYS 256
+
+static struct {
+  uint32_t key;
+  uint16_t length;
+  bool used;
+  uint8_t data[PERSIST_DATA_MAX_LENGTH];
+} s_persist[PERSIST_KEYS];
+
+static int persist_find(uint32_t key){
+  for(int i=0; i<PERSIST_KEYS; i++){
+    if(s_persist[i].used && s_persist[i].key == key) return i;
+  }
+  return -1;
+}
+
+static int persist_total(void){
+  int total = 0;
+  for(int i=0; i<PERSIST_KEYS; i++){
+    if(s_persist[i].used) total += s_persist[i].length;
+  }
+  return total;
+}
+
+bool persist_exists(const uint32_t key){
+  return persist_find(key) >= 0;
+}
+
+int persist_read_data(const uint32_t key, void *buffer, const size_t buffer_size){
+  int i = persist_find(key);
+  if(i < 0) return -1;
+  size_t length = s_persist[i].length < buffer_size ? s_persist[i].length : buffer_size;
+  memcpy(buffer, s_persist[i].data, length);
+  return length;
+}
+
+int persist_read_int(const uint32_t key){
+  int32_t value = 0;
+  persist_read_data(key, &value, sizeof(value));
+  return value;
+}
+
+int persist_write_data(const uint32_t key, const void *data, const size_t size){
+  if(size > PERSIST_DATA_MAX_LENGTH) return -1;
+  int i = persist_find(key);
+  int current = i >= 0 ? s_persist[i].length : 0;
+  if(persist_total() - current + (int)size > PERSIST_TOTAL) return -1;
+  if(i < 0){
+    for(i=0; i<PERSIST_KEYS && s_persist[i].used; i++);
+    if(i == PERSIST_KEYS) return -1;
+  }
+  s_persist[i].key = key;
+  s_persist[i].length = size;
+  s_persist[i].used = true;
+  memcpy(s_persist[i].data, data, size);
+  return size;
+}
+
+int persist_write_int(const uint32_t key, const int32_t value){
+  return persist_write_data(key, &value, sizeof(value)) == sizeof(value) ? (int)sizeof(value) : -1;
+}
+
+int persist_delete(const uint32_t key){
+  int i = persist_find(key);
+  if(i >= 0) s_persist[i].used = false;
+  return 0;
+}
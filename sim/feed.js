@@ -0,0 +1,178 @@
+// A stand-in for the BusRoutesFeed API that app.js talks to, shared by the mock server and the simulator.
+// Recorded responses in sim/fixtures are served when present:
+//   fixtures/Routes.json                every route
+//   fixtures/pattern-{ShortName}.json   a route's pattern, served for any date
+//   fixtures/timetable-{ShortName}.json a route's timetable, served for any date
+// Anything not recorded is generated, deterministically, in the same shape as the live API.
+// Vehicles are always generated, driving along the route's pattern as time goes on.
+var fs = require("fs");
+var path = require("path");
+var crypto = require("crypto");
+
+var FIXTURES_DIR = path.join(__dirname, "fixtures");
+var API_PREFIX = "/BusRoutesFeed/api/";
+
+// Generated routes: [ShortName, Name, Group, Color, pattern points]
+// XL is far larger than anything the real feed serves, to stress simplification and transfer
+var GENERATED_ROUTES = [
+  ["01", "Bonfire", "On Campus", "rgb(80, 0, 0)", 240],
+  ["02", "Yell Practice", "On Campus", "rgb(0, 84, 166)", 320],
+  ["03", "Excel", "On Campus", "rgb(0, 146, 69)", 180],
+  ["04", "Gig 'Em", "On Campus", "rgb(247, 148, 29)", 410],
+  ["05", "Howdy", "On Campus", "rgb(237, 28, 36)", 150],
+  ["12", "Reveille", "Off Campus", "rgb(102, 45, 145)", 520],
+  ["15", "Aggie Spirit", "Off Campus", "rgb(0, 174, 239)", 380],
+  ["22", "Excel Ext", "Off Campus", "rgb(141, 198, 63)", 640],
+  ["26", "Rudder", "Off Campus", "rgb(236, 0, 140)", 290],
+  ["GD1", "Game Day North", "Game Day Routes", "rgb(96, 57, 19)", 90],
+  ["GD2", "Game Day South", "Game Day Routes", "rgb(0, 0, 0)", 110],
+  ["XL", "Stress Loop", "Other", "rgb(128, 128, 128)", 6000]
+];
+
+var VEHICLE_POINTS_PER_S = 0.5; // How fast generated vehicles advance along their pattern
+var STOPS_PER_ROUTE = 24; // About how many stops a generated route has, like a real campus route
+var TRIP_EVERY_MIN = 20; // Generated timetables run a trip this often from FIRST_TRIP_MIN to LAST_TRIP_MIN
+var FIRST_TRIP_MIN = 7 * 60;
+var LAST_TRIP_MIN = 22 * 60;
+
+// A small deterministic generator so generated patterns are the same on every run
+function random(seed) {
+  var state = seed >>> 0;
+  return function() {
+    state = (Math.imul(state, 1103515245) + 12345) >>> 0;
+    return ((state >>> 8) & 0xFFFF) / 65536;
+  };
+}
+
+function seedOf(str) {
+  var seed = 0;
+  for(var i = 0; i < str.length; i++) seed = (Math.imul(seed, 31) + str.charCodeAt(i)) >>> 0;
+  return seed;
+}
+
+function readFixture(name) {
+  var file = path.join(FIXTURES_DIR, name);
+  if(!fs.existsSync(file)) return null;
+  return JSON.parse(fs.readFileSync(file, "utf8"));
+}
+
+function generatedRoutes() {
+  return GENERATED_ROUTES.map(function(route) {
+    return {Name: route[1], ShortName: route[0], Group: route[2], Color: route[3]};
+  });
+}
+
+// A walk along a street grid around College Station, turning now and then, with a stop every few points
+function generatedPattern(shortName) {
+  var spec = GENERATED_ROUTES.filter(function(route) { return route[0] == shortName; })[0];
+  if(!spec) return null;
+  var rand = random(seedOf(shortName));
+  var lat = 30.61, lon = -96.34;
+  var heading = 0;
+  var stopEvery = Math.max(4, Math.ceil(spec[4] / STOPS_PER_ROUTE));
+  var points = [];
+  for(var i = 0; i < spec[4]; i++) {
+    if(rand() < 0.15) heading = (heading + (rand() < 0.5 ? 1 : 3)) % 4;
+    var step = 0.0001 + 0.0004 * rand();
+    if(heading === 0) lat += step;
+    else if(heading == 1) lon += step;
+    else if(heading == 2) lat -= step;
+    else lon -= step;
+    var point = {Latitude: lat, Longtitude: lon, PointTypeCode: 0, Name: "", Stop: null};
+    if(i % stopEvery === 0) {
+      point.PointTypeCode = 1;
+      point.Name = spec[1] + " Stop " + (i / stopEvery + 1);
+      point.Stop = {IsTimePoint: i % (stopEvery * 4) === 0};
+    }
+    points.push(point);
+  }
+  return points;
+}
+
+function clockTime(minutes) {
+  var hour = Math.floor(minutes / 60) % 24;
+  var minute = minutes % 60;
+  return (hour % 12 || 12) + ":" + (minute < 10 ? "0" : "") + minute + (hour < 12 ? " AM" : " PM");
+}
+
+// One row per trip with a column per timed stop, named like the live feed's, reaching each timed stop a few minutes
+// after the one before
+function generatedTimetable(shortName) {
+  var points = pattern(shortName);
+  if(!points) return null;
+  var timed = points.filter(function(point) { return point.Stop && point.Stop.IsTimePoint; });
+  var rows = [];
+  for(var start = FIRST_TRIP_MIN; start <= LAST_TRIP_MIN; start += TRIP_EVERY_MIN) {
+    var row = {};
+    for(var i = 0; i < timed.length; i++) row[i + "-" + timed[i].Name] = clockTime(start + i * 4);
+    rows.push(row);
+  }
+  return rows;
+}
+
+// A route's buses at time now (ms): one per 200 points, at most 4, spread evenly along the pattern
+function vehicles(shortName, now) {
+  var points = pattern(shortName);
+  if(!points || !points.length) return null;
+  var count = Math.min(4, Math.max(1, Math.round(points.length / 200)));
+  var advanced = Math.floor(now / 1000 * VEHICLE_POINTS_PER_S);
+  var buses = [];
+  for(var i = 0; i < count; i++) {
+    var point = points[(advanced + Math.floor(i * points.length / count)) % points.length];
+    buses.push({
+      Key: shortName + "-" + (i + 1),
+      Name: "Bus " + (i + 1),
+      GPS: {Lat: point.Latitude, Long: point.Longtitude, Dir: 0, Speed: 20}
+    });
+  }
+  return buses;
+}
+
+function routes() {
+  return readFixture("Routes.json") || generatedRoutes();
+}
+
+function pattern(shortName) {
+  return readFixture("pattern-" + shortName + ".json") || generatedPattern(shortName);
+}
+
+function timetable(shortName) {
+  return readFixture("timetable-" + shortName + ".json") || generatedTimetable(shortName);
+}
+
+// Answer one GET for an API path at time now (ms, defaults to the wall clock). Returns {status, headers, body}, body
+// being a string. Responses carry an ETag and Last-Modified so conditional requests can be answered with 304
+function handle(urlPath, requestHeaders, now) {
+  requestHeaders = requestHeaders || {};
+  var apiPath = decodeURIComponent(urlPath.split("?")[0]);
+  if(apiPath.indexOf(API_PREFIX) === 0) apiPath = apiPath.substring(API_PREFIX.length);
+
+  var data = null;
+  var match;
+  if(apiPath == "Routes") data = routes();
+  else if((match = /^route\/([^\/]+)\/pattern\/\d{4}-\d{1,2}-\d{1,2}$/.exec(apiPath))) data = pattern(match[1]);
+  else if((match = /^route\/([^\/]+)\/TimeTable\/\d{4}-\d{1,2}-\d{1,2}$/.exec(apiPath))) data = timetable(match[1]);
+  else if((match = /^route\/([^\/]+)\/buses\/mentor$/.exec(apiPath))) data = vehicles(match[1], now === undefined ? Date.now() : now);
+  if(data === null) return {status: 404, headers: {}, body: "Not found"};
+
+  var body = JSON.stringify(data);
+  var etag = "\"" + crypto.createHash("sha1").update(body).digest("hex").substring(0, 16) + "\"";
+  var headers = {
+    "Content-Type": "application/json",
+    "ETag": etag,
+    "Last-Modified": new Date(0).toUTCString()
+  };
+  var inm = requestHeaders["if-none-match"] || requestHeaders["If-None-Match"];
+  if(inm && inm == etag) return {status: 304, headers: headers, body: ""};
+  return {status: 200, headers: headers, body: body};
+}
+
+module.exports = {
+  API_PREFIX: API_PREFIX,
+  FIXTURES_DIR: FIXTURES_DIR,
+  routes: routes,
+  pattern: pattern,
+  timetable: timetable,
+  vehicles: vehicles,
+  handle: handle
+};
@@ -0,0 +1,74 @@
+// A local stand-in for transport.tamu.edu/BusRoutesFeed, serving the fixtures in feed.js
+//
+// Usage: node sim/server.js [--port 8080] [--latency ms] [--record]
+//   --latency  delay every response, to mimic a slow feed
+//   --record   fetch anything missing from sim/fixtures from the live feed and save it there first
+// Point apiUrl in src/pkjs/app.js at http://<host>:<port>/BusRoutesFeed/api/ to use it from a phone or emulator.
+var http = require("http");
+var fs = require("fs");
+var path = require("path");
+var feed = require("./feed");
+
+var LIVE_URL = "http://transport.tamu.edu";
+
+function parseArgs(argv) {
+  var options = {port: 8080, latency: 0, record: false};
+  for(var i = 2; i < argv.length; i++) {
+    if(argv[i] == "--port") options.port = parseInt(argv[++i], 10);
+    else if(argv[i] == "--latency") options.latency = parseInt(argv[++i], 10);
+    else if(argv[i] == "--record") options.record = true;
+    else {
+      console.log("Unknown option: " + argv[i]);
+      process.exit(1);
+    }
+  }
+  return options;
+}
+
+// The fixture a request would be served from, so --record knows where to save it
+function fixtureName(urlPath) {
+  var apiPath = decodeURIComponent(urlPath.split("?")[0]).substring(feed.API_PREFIX.length);
+  if(apiPath == "Routes") return "Routes.json";
+  var match = /^route\/([^\/]+)\/(pattern|TimeTable)\//.exec(apiPath);
+  return match ? match[2].toLowerCase() + "-" + match[1] + ".json" : null;
+}
+
+function record(urlPath, done) {
+  var name = fixtureName(urlPath);
+  var file = name && path.join(feed.FIXTURES_DIR, name);
+  if(!file || fs.existsSync(file)) return done();
+  http.get(LIVE_URL + urlPath, {headers: {"Accept": "application/json"}}, function(res) {
+    var chunks = [];
+    res.on("data", function(chunk) { chunks.push(chunk); });
+    res.on("end", function() {
+      if(res.statusCode == 200) {
+        fs.mkdirSync(feed.FIXTURES_DIR, {recursive: true});
+        fs.writeFileSync(file, Buffer.concat(chunks));
+        console.log("Recorded " + name);
+      }
+      else {
+        console.log("Live feed answered " + res.statusCode + " for " + urlPath);
+      }
+      done();
+    });
+  }).on("error", function(e) {
+    console.log("Could not reach the live feed: " + e.message);
+    done();
+  });
+}
+
+var options = parseArgs(process.argv);
+http.createServer(function(req, res) {
+  var serve = function() {
+    var answer = feed.handle(req.url, req.headers);
+    setTimeout(function() {
+      res.writeHead(answer.status, answer.headers);
+      res.end(answer.body);
+      console.log(req.method + " " + req.url + " " + answer.status + " " + answer.body.length + " bytes");
+    }, options.latency);
+  };
+  if(options.record) record(req.url, serve);
+  else serve();
+}).listen(options.port, function() {
+  console.log("Mock BusRoutesFeed on http://localhost:" + options.port + feed.API_PREFIX);
+});
@@ -0,0 +1,740 @@
+// End-to-end transfer simulator: runs src/pkjs/app.js against the mock feed and a modelled watch
+//
+// Usage: node sim/simulate.js [options]
+//   --platform basalt|aplite|chalk  watch limits reported in SET_INBOX_SIZE (default basalt)
+//   --ack ms                  Bluetooth round trip for one AppMessage and its ACK (default 60)
+//   --bandwidth bytes/s       Bluetooth throughput (default 8000)
+//   --drop p                  chance an AppMessage is NACKed and has to be resent (default 0)
+//   --http ms                 feed response time (default 150)
+//   --routes a,b              only request these route short names (default every route)
+//   --leave ms                back out of a route window after this long if its pattern is still incomplete
+//   --view ms                 stay in a route window this long once its pattern is complete, watching its vehicles
+//   --reopen ms               come back to each route a moment after backing out of it once its pattern is complete,
+//                             and stay this long
+//   --dwell ms                rest on each menu row this long before opening it, giving the watch time to prefetch
+//   --runs n                  restart the phone JS n times, keeping its localStorage and the watch's catalog (default 1)
+//   --seed n                  seed for the drop pattern (default 1)
+//   --json                    print the report as JSON
+//   --verbose                 show app.js console output
+//
+// Time is simulated, so a run finishes immediately whatever the latencies are.
+// The watch asks for the catalog and then for each route's pattern in turn, like a user scrolling through the menu.
+var fs = require("fs");
+var path = require("path");
+var vm = require("vm");
+var feed = require("./feed");
+
+var APP_JS = path.join(__dirname, "..", "src", "pkjs", "app.js");
+var CSS_COLOR_PARSER = path.join(__dirname, "..", "src", "pkjs", "csscolorparser.js");
+
+// Mirrors the watch's MessageType
+var MessageType = {
+  STATUS: 0,
+  SET_INBOX_SIZE: 1,
+  ROUTES: 2,
+  ROUTE_PATTERN: 3,
+  ROUTE_PATTERN_STOPS: 5,
+  ROUTE_PATTERN_POINTS_FRAME: 6,
+  ROUTE_PATTERN_HEADER: 7,
+  ROUTES_CURRENT: 8,
+  ROUTE_CLOSED: 9,
+  ROUTE_PATTERN_PREFETCH: 10,
+  VEHICLES: 11,
+  STOP_TIMES: 12,
+  NEARBY: 13,
+  NEARBY_STOPS: 14,
+  NEARBY_POSITION: 15,
+  COUNTERS: 16,
+  ROUTE_PATTERN_NACK: 17
+};
+
+// What each watch reports in SET_INBOX_SIZE, matching INBOX_SIZE, PATTERN_MAX_ZOOM, PATTERN_LEN and PATTERN_PROJECTED
+// in tamu_buses.c
+var PLATFORMS = {
+  basalt: {inbox_size: 1024, screen_w: 144, screen_h: 168, zoom_max: 8, pattern_max_len: 512, screen_round: 0, projected: 1},
+  aplite: {inbox_size: 512, screen_w: 144, screen_h: 168, zoom_max: 8, pattern_max_len: 256, screen_round: 0, projected: 1},
+  chalk: {inbox_size: 1024, screen_w: 180, screen_h: 180, zoom_max: 8, pattern_max_len: 512, screen_round: 1, projected: 1}
+};
+var NEARBY_STOPS_LEN = {basalt: 512, aplite: 128, chalk: 512}; // Matches tamu_buses.c, the stop index capacity the watch asks for
+var USER_POSITION = {latitude: 30.6125, longitude: -96.3385}; // Where the phone reports the user to be, among the generated routes
+
+var PREFETCH_IDLE_MS = 1500; // Matches tamu_buses.c, how long the menu has to rest before the next row is prefetched
+var TRANSFER_NACK_MS = 1500; // Matches tamu_buses.c, how long a pattern transfer can go quiet before the watch asks again
+var REOPEN_AFTER_MS = 1000; // With --reopen, how long the user is out of a route window before coming back to it
+
+var DICT_HEADER_SIZE = 1;
+var TUPLE_HEADER_SIZE = 7;
+
+function parseArgs(argv) {
+  var options = {
+    platform: "basalt", ack: 60, bandwidth: 8000, drop: 0, http: 150,
+    routes: null, leave: 0, view: 0, reopen: 0, dwell: 0, nearby: false, runs: 1, seed: 1, json: false, verbose: false
+  };
+  for(var i = 2; i < argv.length; i++) {
+    var arg = argv[i];
+    if(arg == "--platform") options.platform = argv[++i];
+    else if(arg == "--ack") options.ack = parseFloat(argv[++i]);
+    else if(arg == "--bandwidth") options.bandwidth = parseFloat(argv[++i]);
+    else if(arg == "--drop") options.drop = parseFloat(argv[++i]);
+    else if(arg == "--http") options.http = parseFloat(argv[++i]);
+    else if(arg == "--routes") options.routes = argv[++i].split(",");
+    else if(arg == "--leave") options.leave = parseFloat(argv[++i]);
+    else if(arg == "--view") options.view = parseFloat(argv[++i]);
+    else if(arg == "--reopen") options.reopen = parseFloat(argv[++i]);
+    else if(arg == "--dwell") options.dwell = parseFloat(argv[++i]);
+    else if(arg == "--nearby") options.nearby = true;
+    else if(arg == "--runs") options.runs = parseInt(argv[++i], 10);
+    else if(arg == "--seed") options.seed = parseInt(argv[++i], 10);
+    else if(arg == "--json") options.json = true;
+    else if(arg == "--verbose") options.verbose = true;
+    else {
+      console.log("Unknown option: " + arg);
+      process.exit(1);
+    }
+  }
+  if(!PLATFORMS[options.platform]) {
+    console.log("Unknown platform: " + options.platform);
+    process.exit(1);
+  }
+  return options;
+}
+
+// Discrete event clock standing in for setTimeout, so latencies cost nothing to simulate
+function Clock() {
+  this.now = 0;
+  this.events = [];
+  this.nextId = 1;
+}
+
+Clock.prototype.schedule = function(delay, fn) {
+  var event = {at: this.now + Math.max(0, delay || 0), id: this.nextId++, fn: fn};
+  // Keep events ordered by time, and by scheduling order among equal times
+  var i = this.events.length;
+  while(i > 0 && this.events[i - 1].at > event.at) i--;
+  this.events.splice(i, 0, event);
+  return event.id;
+};
+
+Clock.prototype.cancel = function(id) {
+  this.events = this.events.filter(function(event) { return event.id !== id; });
+};
+
+Clock.prototype.run = function() {
+  while(this.events.length) {
+    var event = this.events.shift();
+    this.now = event.at;
+    event.fn();
+  }
+};
+
+// Same generator as the feed, so drops are repeatable for a given --seed
+function random(seed) {
+  var state = seed >>> 0;
+  return function() {
+    state = (Math.imul(state, 1103515245) + 12345) >>> 0;
+    return ((state >>> 8) & 0xFFFF) / 65536;
+  };
+}
+
+// Size of a message as the watch receives it: PebbleKit JS sends numbers as int32, strings null terminated
+// and arrays as byte arrays
+function messageSize(message) {
+  var bytes = DICT_HEADER_SIZE;
+  for(var key in message) {
+    var value = message[key];
+    bytes += TUPLE_HEADER_SIZE;
+    if(typeof value === "string") bytes += Buffer.byteLength(value, "utf8") + 1;
+    else if(Array.isArray(value)) bytes += value.length;
+    else bytes += 4;
+  }
+  return bytes;
+}
+
+// Appends an unsigned LEB128 varint, as the watch writes its NACK ranges
+function writeVarint(data, value) {
+  while(value >= 0x80) {
+    data.push((value & 0x7F) | 0x80);
+    value = Math.floor(value / 128);
+  }
+  data.push(value);
+}
+
+// Points in a frame, counting the varints which end (high bit clear). Each point is two
+function framePoints(frameData) {
+  var ends = 0;
+  for(var i = 0; i < frameData.length; i++) {
+    if(!(frameData[i] & 0x80)) ends++;
+  }
+  return ends / 2;
+}
+
+// The points of a frame, undoing the zig-zag varint deltas
+function framePointList(frameData) {
+  var values = [];
+  var value = 0, shift = 0;
+  for(var i = 0; i < frameData.length; i++) {
+    value += (frameData[i] & 0x7F) * Math.pow(2, shift);
+    shift += 7;
+    if(!(frameData[i] & 0x80)) {
+      values.push(value % 2 ? -(value + 1) / 2 : value / 2);
+      value = 0;
+      shift = 0;
+    }
+  }
+  var points = [];
+  var x = 0, y = 0;
+  for(var j = 0; j + 1 < values.length; j += 2) {
+    x += values[j];
+    y += values[j + 1];
+    points.push({x: x, y: y});
+  }
+  return points;
+}
+
+// Route short names by route ID from a catalog blob: a count per section, 8 byte records, then the string table
+function catalogRoutes(blob) {
+  var sections = 4;
+  var count = 0;
+  for(var i = 0; i < sections; i++) count += blob[i];
+  var strings = sections + count * 8;
+  var routes = [];
+  for(var i = 0; i < count; i++) {
+    var record = sections + i * 8;
+    var title = strings + (blob[record + 4] | blob[record + 5] << 8);
+    var name = "";
+    while(blob[title] !== 0) name += String.fromCharCode(blob[title++]);
+    routes[blob[record]] = name;
+  }
+  return routes;
+}
+
+// Departures in a STOP_TIMES message: records of a stop index, a count, then that many times
+function frameDepartures(frameData) {
+  var values = [];
+  var value = 0, shift = 0;
+  for(var i = 0; i < frameData.length; i++) {
+    value += (frameData[i] & 0x7F) * Math.pow(2, shift);
+    shift += 7;
+    if(!(frameData[i] & 0x80)) {
+      values.push(value);
+      value = 0;
+      shift = 0;
+    }
+  }
+  var departures = 0;
+  for(var j = 0; j + 1 < values.length; j += 2 + values[j + 1]) departures += values[j + 1];
+  return departures;
+}
+
+// Stops in a NEARBY_STOPS message: each record is four varints (cell, x, y, route count), its route IDs and a name
+function frameStops(frameData) {
+  var stops = 0;
+  for(var i = 0; i < frameData.length; stops++) {
+    var varints = 0;
+    while(varints < 4) if(!(frameData[i++] & 0x80)) varints++;
+    i += frameData[i - 1]; // The count is below 128, so a single byte
+    while(frameData[i++] !== 0);
+  }
+  return stops;
+}
+
+function MemoryStorage() {
+  this.items = {};
+}
+
+MemoryStorage.prototype.getItem = function(key) {
+  return Object.prototype.hasOwnProperty.call(this.items, key) ? this.items[key] : null;
+};
+
+MemoryStorage.prototype.setItem = function(key, value) {
+  this.items[key] = String(value);
+};
+
+MemoryStorage.prototype.removeItem = function(key) {
+  delete this.items[key];
+};
+
+// XMLHttpRequest answered in-process by the mock feed after the configured response time
+function makeXMLHttpRequest(clock, options, stats) {
+  function FakeXMLHttpRequest() {
+    this.listeners = {};
+    this.requestHeaders = {};
+    this.responseHeaders = {};
+    this.status = 0;
+    this.response = null;
+    this.responseText = "";
+    this.responseType = "";
+  }
+  FakeXMLHttpRequest.prototype.open = function(method, url) {
+    this.url = url;
+  };
+  FakeXMLHttpRequest.prototype.setRequestHeader = function(name, value) {
+    this.requestHeaders[name.toLowerCase()] = value;
+  };
+  FakeXMLHttpRequest.prototype.getResponseHeader = function(name) {
+    var value = this.responseHeaders[name];
+    return value === undefined ? null : value;
+  };
+  FakeXMLHttpRequest.prototype.addEventListener = function(type, fn) {
+    this.listeners[type] = fn;
+  };
+  FakeXMLHttpRequest.prototype.send = function() {
+    var self = this;
+    var answer = feed.handle(self.url.replace(/^https?:\/\/[^\/]+/, ""), self.requestHeaders, clock.now);
+    stats.httpRequests++;
+    if(answer.status == 304) stats.httpNotModified++;
+    stats.httpBytes += answer.body.length;
+    clock.schedule(options.http, function() {
+      self.status = answer.status;
+      self.responseHeaders = answer.headers;
+      self.responseText = answer.body;
+      if(answer.status == 200) self.response = self.responseType == "json" ? JSON.parse(answer.body) : answer.body;
+      if(self.listeners.load) self.listeners.load.call(self);
+    });
+  };
+  return FakeXMLHttpRequest;
+}
+
+// The watch side of a run: keeps the catalog across runs and tracks each pattern as it arrives
+function Watch(platform) {
+  this.limits = PLATFORMS[platform];
+  this.catalogHash = 0;
+  this.catalog = [];
+  this.nearbyHash = 0;
+}
+
+// One phone JS session against the watch. Returns the report for the run
+function simulateRun(run, watch, storage, options, rand) {
+  var clock = new Clock();
+  var stats = {httpRequests: 0, httpNotModified: 0, httpBytes: 0};
+  var link = {busyUntil: 0, messages: 0, bytes: 0, retries: 0};
+  var catalog = {requestedAt: -1, doneAt: -1, messages: 0, bytes: 0, retries: 0, current: false, received: 0, expected: -1, blob: []};
+  var patterns = {}; // Route ID -> pattern report
+  var nearby = {requestedAt: -1, doneAt: -1, messages: 0, bytes: 0, retries: 0, stops: 0, expected: -1, hash: 0, located: false};
+  var order = []; // Route IDs to request, in turn
+  var appListeners = {};
+
+  var log = options.verbose ? function() {
+    var args = Array.prototype.slice.call(arguments);
+    console.log.apply(console, ["[" + clock.now.toFixed(0) + " ms]"].concat(args));
+  } : function() {};
+
+  // The report a message's bytes, retries and round trips are charged to
+  var accountFor = function(message) {
+    var type = message.message_type;
+    if(type == MessageType.ROUTES || type == MessageType.ROUTES_CURRENT) return catalog;
+    if(type == MessageType.NEARBY || type == MessageType.NEARBY_STOPS || type == MessageType.NEARBY_POSITION) return nearby;
+    if(message.route_id !== undefined && patterns[message.route_id]) return patterns[message.route_id];
+    return null;
+  };
+
+  // Watch -> phone. Assumed to arrive, after half a round trip
+  var toPhone = function(payload) {
+    clock.schedule(options.ack / 2, function() {
+      if(appListeners.appmessage) appListeners.appmessage({payload: payload});
+    });
+  };
+
+  var patternRecord = function(routeId) {
+    if(!patterns[routeId]) {
+      patterns[routeId] = {
+        route: watch.catalog[routeId], openedAt: -1, prefetched: false, firstPointAt: -1, doneAt: -1, closedAt: -1,
+        messages: 0, bytes: 0, retries: 0, bytesAfterClose: 0, vehicleUpdates: 0, departures: 0,
+        pointsExpected: -1, pointsReceived: 0, stopsExpected: -1, stopsReceived: 0, projected: false, offScreen: 0,
+        transferId: -1, received: [], nacks: 0, nackTimer: null, timed: false, reopened: false
+      };
+    }
+    return patterns[routeId];
+  };
+
+  var transferActive = function() {
+    for(var id in patterns) {
+      var pattern = patterns[id];
+      if(pattern.doneAt < 0 && pattern.closedAt < 0) return true;
+    }
+    return false;
+  };
+
+  // The user scrolls to the next row and rests there for --dwell before opening it.
+  // Meanwhile the watch prefetches the row below once the menu has been idle for PREFETCH_IDLE_MS
+  var selectNext = function() {
+    if(!order.length) return;
+    var routeId = order.shift();
+    if(options.dwell > 0) {
+      clock.schedule(PREFETCH_IDLE_MS, function() {
+        var next = order[0];
+        if((patterns[routeId] && patterns[routeId].openedAt >= 0) || next === undefined || patterns[next] || transferActive()) return;
+        patternRecord(next).prefetched = true;
+        toPhone({message_type: MessageType.ROUTE_PATTERN_PREFETCH, route_id: next});
+      });
+    }
+    clock.schedule(options.dwell, function() { openRoute(routeId); });
+  };
+
+  // A resident pattern shows straight away, anything else is requested
+  // Like the watch, a pattern whose departures never arrived asks for them along with its vehicles
+  var openRoute = function(routeId) {
+    var pattern = patternRecord(routeId);
+    if(pattern.openedAt < 0) pattern.openedAt = clock.now;
+    pattern.closedAt = -1;
+    if(pattern.doneAt >= 0) {
+      var request = {message_type: MessageType.VEHICLES, route_id: routeId};
+      if(pattern.timed && pattern.departures === 0) request.transfer_id = pattern.transferId;
+      toPhone(request);
+      viewRoute(routeId);
+      return;
+    }
+    toPhone({message_type: MessageType.ROUTE_PATTERN, route_id: routeId});
+    if(options.leave > 0) {
+      clock.schedule(options.leave, function() {
+        if(pattern.doneAt < 0) closeRoute(routeId);
+      });
+    }
+  };
+
+  // The user looks at a complete pattern for --view (or --reopen, the second time), then backs out
+  var viewRoute = function(routeId) {
+    clock.schedule(patterns[routeId].reopened ? options.reopen : options.view, function() { closeRoute(routeId); });
+  };
+
+  // The user backs out of the route window and moves on to the next route, or with --reopen opens it again first
+  var closeRoute = function(routeId) {
+    var pattern = patterns[routeId];
+    pattern.closedAt = clock.now;
+    toPhone({message_type: MessageType.ROUTE_CLOSED, route_id: routeId});
+    if(options.reopen > 0 && pattern.doneAt >= 0 && !pattern.reopened) {
+      pattern.reopened = true;
+      clock.schedule(REOPEN_AFTER_MS, function() { openRoute(routeId); });
+      return;
+    }
+    selectNext();
+  };
+
+  // With --nearby the user opens the nearby window first, and moves on to the routes once it has a position
+  var catalogDone = function() {
+    catalog.doneAt = clock.now;
+    for(var i = 0; i < watch.catalog.length; i++) {
+      if(!options.routes || options.routes.indexOf(watch.catalog[i]) >= 0) order.push(i);
+    }
+    if(options.nearby) {
+      nearby.requestedAt = clock.now;
+      toPhone({message_type: MessageType.NEARBY, nearby_hash: watch.nearbyHash, list_len: NEARBY_STOPS_LEN[options.platform]});
+      return;
+    }
+    selectNext();
+  };
+
+  // Like the watch, ask for the runs of a transfer's indexes (its points, then its stops) which never arrived
+  var sendNack = function(routeId, pattern) {
+    var data = [];
+    var total = pattern.pointsExpected + pattern.stopsExpected;
+    for(var i = 0; i < total; i++) {
+      if(pattern.received[i]) continue;
+      var start = i;
+      while(i < total && !pattern.received[i]) i++;
+      writeVarint(data, start);
+      writeVarint(data, i - start);
+    }
+    pattern.nacks++;
+    log("NACK", routeId, JSON.stringify(data));
+    toPhone({message_type: MessageType.ROUTE_PATTERN_NACK, route_id: routeId, transfer_id: pattern.transferId, frame_data: data});
+  };
+
+  // Called for every frame and stop of a transfer, as on the watch
+  var transferProgress = function(routeId, pattern, reachedEnd) {
+    if(pattern.nackTimer !== null) clock.cancel(pattern.nackTimer);
+    pattern.nackTimer = null;
+    if(patternDone(pattern)) return;
+    if(reachedEnd) sendNack(routeId, pattern);
+    var watchQuiet = function() {
+      pattern.nackTimer = null;
+      if(patternDone(pattern) || pattern.closedAt >= 0) return;
+      sendNack(routeId, pattern);
+      pattern.nackTimer = clock.schedule(TRANSFER_NACK_MS, watchQuiet);
+    };
+    pattern.nackTimer = clock.schedule(TRANSFER_NACK_MS, watchQuiet);
+  };
+
+  var patternDone = function(pattern) {
+    return pattern.pointsExpected >= 0 && pattern.pointsReceived >= pattern.pointsExpected &&
+      pattern.stopsExpected >= 0 && pattern.stopsReceived >= pattern.stopsExpected;
+  };
+
+  // A message the watch accepted
+  var watchReceived = function(message) {
+    var type = message.message_type;
+    if(type == MessageType.STATUS) {
+      if(message.js_status == 1) {
+        var hello = {message_type: MessageType.SET_INBOX_SIZE};
+        for(var key in watch.limits) hello[key] = watch.limits[key];
+        toPhone(hello);
+      } else if(catalog.requestedAt < 0) {
+        catalog.requestedAt = clock.now;
+        toPhone({message_type: MessageType.ROUTES, catalog_hash: watch.catalogHash});
+      }
+    }
+    else if(type == MessageType.NEARBY) {
+      nearby.hash = message.nearby_hash >>> 0;
+      nearby.expected = message.list_len;
+      nearby.stops = 0;
+    }
+    else if(type == MessageType.NEARBY_STOPS) {
+      nearby.stops += frameStops(message.frame_data);
+      if(nearby.stops == nearby.expected) watch.nearbyHash = nearby.hash;
+    }
+    else if(type == MessageType.NEARBY_POSITION) {
+      nearby.located = message.position_x !== undefined;
+      nearby.doneAt = clock.now;
+      selectNext();
+    }
+    else if(type == MessageType.ROUTES_CURRENT) {
+      catalog.current = true;
+      catalogDone();
+    }
+    else if(type == MessageType.ROUTES) {
+      // Frames of the catalog blob, each at its byte offset. Like the watch, only the next expected frame is taken
+      if(message.list_index !== catalog.received) return;
+      if(catalog.received === 0) catalog.blob = [];
+      catalog.blob = catalog.blob.concat(message.frame_data);
+      catalog.received = catalog.blob.length;
+      catalog.expected = message.catalog_len;
+      if(catalog.received == catalog.expected) {
+        watch.catalog = catalogRoutes(catalog.blob);
+        watch.catalogHash = message.catalog_hash >>> 0;
+        catalogDone();
+      }
+    }
+    else {
+      var pattern = patterns[message.route_id];
+      if(!pattern || pattern.closedAt >= 0) return;
+      if(type == MessageType.VEHICLES) {
+        pattern.vehicleUpdates++;
+        return;
+      }
+      if(type == MessageType.STOP_TIMES) {
+        pattern.departures += frameDepartures(message.frame_data);
+        return;
+      }
+      if(pattern.doneAt >= 0) return;
+      if(type == MessageType.ROUTE_PATTERN_HEADER) {
+        pattern.pointsExpected = message.list_len;
+        pattern.stopsExpected = message.stops_len;
+        pattern.projected = !!message.projected;
+        pattern.transferId = message.transfer_id;
+        pattern.received = [];
+        pattern.pointsReceived = 0;
+        pattern.stopsReceived = 0;
+      }
+      else if(message.transfer_id !== pattern.transferId) {
+        return; // Not the transfer under way
+      }
+      else if(type == MessageType.ROUTE_PATTERN_POINTS_FRAME) {
+        if(pattern.firstPointAt < 0) pattern.firstPointAt = clock.now;
+        var end = message.list_index + framePoints(message.frame_data);
+        for(var i = message.list_index; i < end && i < pattern.pointsExpected; i++) {
+          if(!pattern.received[i]) pattern.pointsReceived++;
+          pattern.received[i] = true;
+        }
+        if(pattern.projected) {
+          // Projected points have to land on the screen, in pixels of the deepest zoom, or the watch would draw them off it
+          var width = watch.limits.screen_w * watch.limits.zoom_max, height = watch.limits.screen_h * watch.limits.zoom_max;
+          framePointList(message.frame_data).forEach(function(point) {
+            var dx = point.x - width / 2, dy = point.y - height / 2;
+            var outside = watch.limits.screen_round ? dx * dx + dy * dy > width * width / 4 : point.x < 0 || point.y < 0 || point.x > width || point.y > height;
+            if(outside) pattern.offScreen++;
+          });
+        }
+      }
+      else if(type == MessageType.ROUTE_PATTERN_STOPS) {
+        if(message.stop_is_timed) pattern.timed = true;
+        var index = pattern.pointsExpected + message.list_index;
+        if(!pattern.received[index]) pattern.stopsReceived++;
+        pattern.received[index] = true;
+      }
+      if(type == MessageType.ROUTE_PATTERN_POINTS_FRAME) {
+        transferProgress(message.route_id, pattern, end >= pattern.pointsExpected && pattern.stopsExpected == 0);
+      }
+      else if(type == MessageType.ROUTE_PATTERN_STOPS) {
+        transferProgress(message.route_id, pattern, message.list_index + 1 >= pattern.stopsExpected);
+      }
+      if(patternDone(pattern)) {
+        pattern.doneAt = clock.now;
+        if(pattern.openedAt >= 0) viewRoute(message.route_id);
+      }
+    }
+  };
+
+  // Phone -> watch. PebbleKit JS sends one message at a time, each waiting for its ACK or NACK
+  var sendAppMessage = function(message, success, failure) {
+    var copy = JSON.parse(JSON.stringify(message));
+    var bytes = messageSize(copy);
+    var start = Math.max(clock.now, link.busyUntil);
+    var done = start + options.ack + bytes * 1000 / options.bandwidth;
+    link.busyUntil = done;
+    clock.schedule(done - clock.now, function() {
+      var account = accountFor(copy);
+      var dropped = bytes > watch.limits.inbox_size || rand() < options.drop;
+      link.messages++;
+      link.bytes += bytes;
+      if(account) {
+        account.messages++;
+        account.bytes += bytes;
+        if(account.closedAt >= 0) account.bytesAfterClose += bytes;
+      }
+      if(dropped) {
+        link.retries++;
+        if(account) account.retries++;
+        log("NACK", JSON.stringify(copy).substring(0, 80));
+        if(failure) failure({data: message, error: {message: "NACK"}});
+        return;
+      }
+      watchReceived(copy);
+      if(success) success({data: message});
+    });
+    return 0;
+  };
+
+  var context = {
+    console: {log: log, warn: log, error: log},
+    setTimeout: function(fn, delay) { return clock.schedule(delay, fn); },
+    clearTimeout: function(id) { clock.cancel(id); },
+    localStorage: storage,
+    navigator: {
+      geolocation: {
+        getCurrentPosition: function(success) {
+          clock.schedule(options.http, function() { success({coords: USER_POSITION}); });
+        }
+      }
+    },
+    XMLHttpRequest: makeXMLHttpRequest(clock, options, stats),
+    Pebble: {
+      addEventListener: function(type, fn) { appListeners[type] = fn; },
+      sendAppMessage: sendAppMessage
+    },
+    require: function(name) {
+      if(name == "message_keys") return {};
+      if(name == "./csscolorparser") return loadModule(CSS_COLOR_PARSER);
+      throw new Error("Unexpected require: " + name);
+    }
+  };
+  vm.createContext(context);
+  vm.runInContext(fs.readFileSync(APP_JS, "utf8"), context, {filename: APP_JS});
+
+  clock.schedule(0, function() {
+    if(appListeners.ready) appListeners.ready({});
+  });
+  clock.run();
+
+  var routes = [];
+  for(var id in patterns) {
+    var pattern = patterns[id];
+    var since = function(at) {
+      return at < 0 || pattern.openedAt < 0 ? null : Math.max(0, at - pattern.openedAt);
+    };
+    routes.push({
+      route: pattern.route,
+      points: pattern.pointsReceived,
+      stops: pattern.stopsReceived,
+      messages: pattern.messages,
+      bytes: pattern.bytes,
+      retries: pattern.retries,
+      wasted: pattern.bytesAfterClose,
+      vehicleUpdates: pattern.vehicleUpdates,
+      departures: pattern.departures,
+      offScreen: pattern.offScreen,
+      prefetched: pattern.prefetched,
+      ttfp: since(pattern.firstPointAt),
+      ttc: since(pattern.doneAt)
+    });
+  }
+  return {
+    run: run,
+    catalog: {
+      current: catalog.current,
+      routes: watch.catalog.length,
+      messages: catalog.messages,
+      bytes: catalog.bytes,
+      retries: catalog.retries,
+      ttc: catalog.doneAt >= 0 ? catalog.doneAt - catalog.requestedAt : null
+    },
+    nearby: nearby.requestedAt < 0 ? null : {
+      stops: nearby.stops,
+      located: nearby.located,
+      messages: nearby.messages,
+      bytes: nearby.bytes,
+      retries: nearby.retries,
+      ttc: nearby.doneAt >= 0 ? nearby.doneAt - nearby.requestedAt : null
+    },
+    routes: routes,
+    total: {
+      messages: link.messages,
+      bytes: link.bytes,
+      retries: link.retries,
+      httpRequests: stats.httpRequests,
+      httpNotModified: stats.httpNotModified,
+      httpBytes: stats.httpBytes,
+      elapsed: clock.now
+    }
+  };
+}
+
+// Load a CommonJS file in its own context, for app.js's require
+function loadModule(file) {
+  var module = {exports: {}};
+  var sandbox = {module: module, exports: module.exports};
+  vm.createContext(sandbox);
+  vm.runInContext(fs.readFileSync(file, "utf8"), sandbox, {filename: file});
+  return module.exports;
+}
+
+function pad(value, width) {
+  var str = value === null ? "-" : String(value);
+  while(str.length < width) str = " " + str;
+  return str;
+}
+
+function ms(value) {
+  return value === null ? null : value.toFixed(0);
+}
+
+function printReport(report, options) {
+  console.log("Run " + report.run + ": " + options.platform + ", ack " + options.ack + " ms, " +
+    options.bandwidth + " B/s, drop " + options.drop + ", feed " + options.http + " ms");
+  console.log("  catalog " + (report.catalog.current ? "current on the watch" : report.catalog.routes + " routes") +
+    ", " + report.catalog.messages + " messages, " + report.catalog.bytes + " bytes, " + report.catalog.retries +
+    " retries, " + pad(ms(report.catalog.ttc), 0) + " ms");
+  if(report.nearby) {
+    console.log("  nearby " + (report.nearby.stops ? report.nearby.stops + " stops" : "index current on the watch") +
+      (report.nearby.located ? "" : ", no position") + ", " + report.nearby.messages + " messages, " + report.nearby.bytes +
+      " bytes, " + report.nearby.retries + " retries, " + pad(ms(report.nearby.ttc), 0) + " ms");
+  }
+  console.log("  " + ["route", "points", "stops", "msgs", "bytes", "retries", "wasted", "vehicle", "departs", "ttfp ms", "ttc ms"].map(function(title, i) {
+    return i === 0 ? (title + "      ").substring(0, 6) : pad(title, 8);
+  }).join(""));
+  report.routes.forEach(function(route) {
+    console.log("  " + (route.route + (route.prefetched ? "*" : "") + "      ").substring(0, 6) + [route.points, route.stops, route.messages, route.bytes,
+      route.retries, route.wasted, route.vehicleUpdates, route.departures, ms(route.ttfp), ms(route.ttc)].map(function(value) { return pad(value, 8); }).join(""));
+  });
+  var total = report.total;
+  if(report.routes.some(function(route) { return route.prefetched; })) console.log("  * prefetched");
+  report.routes.forEach(function(route) {
+    if(route.offScreen) console.log("  " + route.route + ": " + route.offScreen + " projected points off screen");
+  });
+  console.log("  total " + total.messages + " messages, " + total.bytes + " bytes, " + total.retries + " retries, " +
+    total.httpRequests + " feed requests (" + total.httpNotModified + " not modified, " + total.httpBytes +
+    " bytes), " + ms(total.elapsed) + " ms");
+}
+
+var options = parseArgs(process.argv);
+var rand = random(options.seed);
+var watch = new Watch(options.platform);
+var storage = new MemoryStorage();
+var reports = [];
+for(var run = 1; run <= options.runs; run++) {
+  reports.push(simulateRun(run, watch, storage, options, rand));
+}
+if(options.json) {
+  console.log(JSON.stringify(reports, null, 2));
+} else {
+  reports.forEach(function(report) { printReport(report, options); });
+}
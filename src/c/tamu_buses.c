@@ -1,12 +1,93 @@
 #include <pebble.h>
 
-#define PATTERN_LEN 256
+#define PATTERN_ZOOM_LEVELS 4 // Zoom levels of the route window, each doubling the scale of the one before
+#define PATTERN_MAX_ZOOM_SHIFT (PATTERN_ZOOM_LEVELS - 1)
+#define PATTERN_MAX_ZOOM (1 << PATTERN_MAX_ZOOM_SHIFT) // Deepest zoom the route window draws at, so the phone knows how much detail is visible
+#define PATTERN_PROJECTED 1 // Ask the phone to project patterns to the screen, so drawing the whole route needs no hull or scale
+#define PATTERN_STROKE_WIDTH 2
+#define LOD_TOLERANCE_PX 1 // A level of detail drops points closer than this to the last point it kept, at its zoom
 #define STOPS_LEN 32
 #define SECTIONS_LEN 4
+#define NEARBY_SECTION 0 // The menu opens with a row for the nearby stops, above the sections of routes
+#define ROUTES_LEN 64
 #define PATTERN_FRAME_PADDING 20
-#define INBOX_SIZE APP_MESSAGE_INBOX_SIZE_MINIMUM
+#define REDRAW_INTERVAL_MS 200 // At most 5 pattern redraws a second while points are streaming in
+#define TRANSFER_NACK_MS 1500 // A pattern transfer quiet this long with anything missing asks the phone for it again
+#define TRANSFER_NACK_TRIES 5 // Asks without anything arriving in between before the transfer is given up on
+#define TRANSFER_NACK_LEN 64 // Bytes of missing ranges in one request, the rest are asked for once these arrive
+#define TRANSFER_NACK_GAP_MS 250 // Between requests for different transfers, so each finds the outbox free
+#define ARENA_BLOCK_SIZE 512 // Smallest block an arena takes from the heap
+#define STOP_NAME_ESTIMATE 16 // Bytes reserved per stop name when a pattern's arena is sized up front
+#define PREFETCH_IDLE_MS 1500 // How long the menu selection has to rest before the patterns next to it are fetched
+#define PREFETCH_ROWS 1 // Rows either side of the selection whose patterns are prefetched
+#define VEHICLES_LEN 16 // Most vehicles shown on a route, the phone numbers them below this
+#define VEHICLE_MARKER_RADIUS 4
+#define DEPARTURES_SHOWN 3 // Next departures listed for each timed stop
+#define SERVICE_DAY_ROLLOVER_MIN 180 // Before 3 am it is still yesterday's service day, whose times run past midnight
+#define NEARBY_CELLS_MAX 512 // Most cells the phone may split the stop index into, so the cell table stays small
+#define NEARBY_RADIUS_M 500 // Stops this close are listed nearest first. With none, only the nearest stop is
+#define NEARBY_SHOWN 8
+#define DEBUG_REFRESH_MS 1000 // The debug window's counters refresh this often, and go to the phone each time
+#define DEBUG_TEXT_LEN 192
+
+// Loaded patterns are evicted to stay under the budget and to keep the reserve of heap free for everything else
+#ifdef PBL_PLATFORM_APLITE
+#define PATTERN_LEN 256 // Most points the phone should send for one pattern after simplifying it
+#define PATTERN_HEAP_BUDGET 4096
+#define HEAP_FREE_RESERVE 2048
+#define NEARBY_STOPS_LEN 128 // Most stops in the index. The phone keeps the ones closest to the user
+#else
+#define PATTERN_LEN 512
+#define PATTERN_HEAP_BUDGET 16384
+#define HEAP_FREE_RESERVE 4096
+#define NEARBY_STOPS_LEN 512
+#endif
+
+// Persistent storage layout. Blobs are stored as their length at a base key followed by chunks of
+// PERSIST_DATA_MAX_LENGTH bytes at the keys after it
+#define PERSIST_VERSION 4
+#define PERSIST_KEY_VERSION 1
+#define PERSIST_KEY_PATTERN_INDEX 2
+#define PERSIST_KEY_CATALOG 0x100
+#define PERSIST_KEY_PATTERN_SLOT(slot) (0x200 + (slot) * 0x20)
+#define PATTERN_CACHE_SLOTS 2 // Watch storage is 4 KB, enough for the catalog and a couple of patterns
 #define OUTBOX_SIZE APP_MESSAGE_OUTBOX_SIZE_MINIMUM
 
+// Logs above LOG_LEVEL are compiled out, format strings and all. The default keeps one-off events and drops the
+// logs of every message received, which cost time per message. Build with -DLOG_LEVEL=LOG_LEVEL_TRACE to see those
+#define LOG_LEVEL_OFF 0
+#define LOG_LEVEL_WARNING 1
+#define LOG_LEVEL_DEBUG 2
+#define LOG_LEVEL_TRACE 3
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// A log compiled out still type checks its arguments, so a variable only logged is still used
+#define LOG_DISCARD(...) do{ if(0) APP_LOG(APP_LOG_LEVEL_DEBUG, __VA_ARGS__); }while(0)
+#if LOG_LEVEL >= LOG_LEVEL_WARNING
+#define LOG_WARNING(...) APP_LOG(APP_LOG_LEVEL_WARNING, __VA_ARGS__)
+#else
+#define LOG_WARNING(...) LOG_DISCARD(__VA_ARGS__)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) APP_LOG(APP_LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) LOG_DISCARD(__VA_ARGS__)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_TRACE
+#define LOG_TRACE(...) APP_LOG(APP_LOG_LEVEL_DEBUG_VERBOSE, __VA_ARGS__)
+#else
+#define LOG_TRACE(...) LOG_DISCARD(__VA_ARGS__)
+#endif
+
+// The inbox size is reported to the phone, which packs as many pattern points into each frame as will fit
+#ifdef PBL_PLATFORM_APLITE
+#define INBOX_SIZE 512
+#else
+#define INBOX_SIZE 1024
+#endif
+
 enum {
   ROUTE_ON_CAMPUS = 0,
   ROUTE_OFF_CAMPUS = 1,
@@ -19,13 +100,52 @@ enum {
   MESSAGE_SET_INBOX_SIZE = 1,
   MESSAGE_ROUTES = 2,
   MESSAGE_ROUTE_PATTERN = 3,
-  MESSAGE_ROUTE_PATTERN_POINTS = 4,
-  MESSAGE_ROUTE_PATTERN_STOPS = 5
+  MESSAGE_ROUTE_PATTERN_STOPS = 5,
+  MESSAGE_ROUTE_PATTERN_POINTS_FRAME = 6,
+  MESSAGE_ROUTE_PATTERN_HEADER = 7,
+  MESSAGE_ROUTES_CURRENT = 8,
+  MESSAGE_ROUTE_CLOSED = 9,
+  MESSAGE_ROUTE_PATTERN_PREFETCH = 10,
+  MESSAGE_VEHICLES = 11,
+  MESSAGE_STOP_TIMES = 12,
+  MESSAGE_NEARBY = 13,
+  MESSAGE_NEARBY_STOPS = 14,
+  MESSAGE_NEARBY_POSITION = 15,
+  MESSAGE_COUNTERS = 16,
+  MESSAGE_ROUTE_PATTERN_NACK = 17
+};
+
+// What changed for a vehicle, in the low two bits of each vehicle update record
+enum {
+  VEHICLE_ADDED = 1,
+  VEHICLE_MOVED = 2,
+  VEHICLE_REMOVED = 3
 };
 
+// Fixed point values with 16 fractional bits
+#define Q16_SHIFT 16
+#define Q16_ONE (1 << Q16_SHIFT)
+
+// One heap block of an arena. Allocations are bumped off the end of the newest block
+typedef struct ArenaBlock {
+  struct ArenaBlock *next;
+  uint32_t size;
+  uint32_t used;
+  uint8_t data[];
+} ArenaBlock;
+
+// A bump allocator. Everything in it is freed at once by arena_reset
+typedef struct {
+  ArenaBlock *blocks; // Newest first
+  uint32_t bytes; // Heap taken by all of the blocks, headers included
+} Arena;
+
+// Hull vertices in counter-clockwise order. The buffer grows in the arena as vertices are added
 typedef struct {
-  GPoint **points;
+  GPoint *points;
   uint16_t points_len;
+  uint16_t points_cap;
+  Arena *arena;
 } ConvexHull;
 
 // A doubly linked list of bus stops
@@ -33,24 +153,115 @@ typedef struct{
   char *name;
   bool is_timed;
   uint16_t point_index;
+  uint16_t *times; // Departures in minutes from the start of the service day, ascending. In the pattern's arena
+  uint16_t times_len;
+  uint16_t times_cap; // Room in times, so departures sent again are written over the ones there
 } Stop;
 
+// The geographic box a pattern's points were quantized in
+// Points arrive as signed 16 bit offsets from the center of the box, with one step size shared by both axes.
+// A projected pattern's points arrive in pixels of the deepest zoom instead, already fit to the screen by the phone
+typedef struct {
+  int32_t min_lat; // Microdegrees
+  int32_t min_lon;
+  int32_t max_lat;
+  int32_t max_lon;
+  int32_t aspect; // cos(latitude) in Q16, scales longitude offsets to the same ground distance as latitude
+  bool projected;
+} PatternBounds;
+
 // An array of points and a linked list of stops
 typedef struct {
-  uint16_t points_len;
+  uint16_t points_len; // Points in from the start with none missing, which is as far as the pattern is drawn
+  uint16_t points_total; // Number of points the current transmission will deliver
   uint16_t stops_len;
+  uint16_t stops_total;
   GPoint *points;
   Stop *stops;
   ConvexHull *convex_hull;
+  PatternBounds bounds;
+  GPoint diameter[2]; // Farthest pair of hull vertices, only recomputed when the hull changes
+  bool diameter_valid;
+  uint16_t *lod[PATTERN_ZOOM_LEVELS - 1]; // Indexes of the points drawn at each zoom short of the deepest, which draws every point
+  uint16_t lod_len[PATTERN_ZOOM_LEVELS - 1];
+  bool lod_valid; // Built once the pattern is complete
+  bool persisted; // Already in the persistent cache, so completing it again does not rewrite storage
+  uint16_t transfer_id; // Session of the transmission the header began. Frames and stops of any other are stale
+  uint8_t *received; // A bit per point, then per stop, set as they arrive
+  uint32_t nack_at; // clock_ms() when the transfer is asked about again if nothing more arrives
+  uint8_t nack_tries; // Asks since anything arrived. Past TRANSFER_NACK_TRIES the transfer is no longer watched
+  Arena arena; // Holds the points, stops, stop names and hull, so a pattern is dropped with one reset
+  uint32_t last_viewed; // s_view_clock when the route window last showed it, for eviction
 } Pattern;
 
+// One route of the catalog blob, exactly as the phone lays it out. The menu points straight into the blob
 typedef struct{
-  char *title;
-  char *subtitle;
-  uint8_t color_rgb[3];
-  Pattern *pattern;
+  uint8_t id; // Compact route ID assigned by the phone, used on the wire instead of the short name
+  uint8_t section;
+  uint8_t color; // GColor8
+  uint8_t reserved; // Keeps the string offsets aligned
+  uint16_t title; // Offsets into the catalog's string table
+  uint16_t subtitle;
 } MenuItem;
 
+// A bus on the selected route, at a position quantized like the pattern's points before they are decoded
+typedef struct {
+  GPoint position;
+  bool active;
+} Vehicle;
+
+// What the route line in the cache was drawn from. A redraw with the same key looks the same
+typedef struct {
+  const Pattern *pattern;
+  uint16_t points_len;
+  bool lod_valid;
+  int32_t scale;
+  GPoint center;
+} PatternCacheKey;
+
+// A stop in the nearby index, placed in meters east and north of the grid's south west corner
+typedef struct {
+  GPoint position;
+  char *name;
+  uint8_t *routes; // IDs of the routes that serve it
+  uint8_t routes_len;
+} NearbyStop;
+
+// Every stop on every route, bucketed into a uniform grid of square cells by the phone
+// Stops arrive sorted by cell, so a cell's stops are the run from its start to the next cell's start
+typedef struct {
+  uint32_t hash; // Identifies the index to the phone, so it is only resent when it changed
+  uint16_t cols;
+  uint16_t rows;
+  uint16_t cell; // Meters
+  uint16_t *cell_starts; // Index of the first stop in each cell, then the number of stops
+  uint16_t cells_filled; // Cells whose start is known so far
+  NearbyStop *stops;
+  uint16_t stops_len;
+  uint16_t stops_total;
+  Arena arena;
+} StopIndex;
+
+typedef struct {
+  NearbyStop *stop;
+  uint32_t distance; // Meters
+} NearbyResult;
+
+// Link and render counters since launch. They go to the phone as this struct, so new counters are added at the end
+// and the phone's WATCH_COUNTERS names are kept in the same order
+typedef struct {
+  uint32_t messages_in;
+  uint32_t bytes_in;
+  uint32_t dropped; // Messages the inbox had no room for
+  uint32_t out_failed; // Messages the phone did not acknowledge
+  uint32_t decode_ms; // Decoding and handling every message received, in total
+  uint32_t decode_ms_max;
+  uint32_t frames_drawn; // Route layer redraws
+  uint32_t render_ms; // In total
+  uint32_t render_ms_max;
+  uint32_t heap_peak; // Most heap in use, sampled after each message and frame
+} Counters;
+
 // Menu variables
 static Window *s_menu_window = NULL;
 static MenuLayer *s_menu_layer = NULL;
@@ -60,6 +271,18 @@ static int s_section_lens[SECTIONS_LEN] = {0, 0, 0, 0};
 static char *s_section_titles[SECTIONS_LEN] = {"On Campus", "Off Campus", "Game Day", "Other"};
 static MenuItem *s_menu_items[SECTIONS_LEN] = {NULL, NULL, NULL, NULL};
 static bool s_menu_loading = S_FALSE;
+static MenuItem *s_routes[ROUTES_LEN]; // Direct index from route ID to its menu item
+static uint32_t s_catalog_hash = 0; // Identifies the catalog on screen so the phone only resends it when it changed
+static uint8_t *s_catalog = NULL; // The catalog blob: a route count per section, the menu items by section, then their strings
+static uint16_t s_catalog_len = 0;
+static uint16_t s_catalog_received = 0; // Bytes of the blob in so far
+static const char *s_catalog_strings = NULL;
+static Pattern *s_patterns = NULL; // Indexed by route ID
+static uint16_t s_patterns_len = 0;
+static Arena s_catalog_arena; // Holds the catalog blob and the pattern records
+static AppTimer* s_prefetch_timer = NULL;
+static MenuItem *s_prefetch_route = NULL; // Route whose pattern was prefetched and has not finished arriving
+static AppTimer* s_nack_timer = NULL; // Fires for whichever watched transfer is due first
 
 // Route variables
 static Window *s_route_window = NULL;
@@ -68,19 +291,120 @@ static Layer *s_route_pattern = NULL;
 static GRect s_route_name_frame;
 static MenuItem *s_selected_route = NULL;
 static bool s_pattern_loading = S_FALSE;
-static GPathInfo* s_pattern_gpath_info = NULL;
-static GPath* s_pattern_gpath = NULL;
-static bool s_pattern_updated = S_FALSE;
+static AppTimer* s_redraw_timer = NULL;
+static uint32_t s_view_clock = 0; // Counts route window loads
+static bool s_redraw_pending = S_FALSE;
+static uint8_t s_view_zoom = 0; // Zoom level. At 0 the route is fit to the screen
+static GPoint s_view_center; // Pattern point in the middle of the screen when zoomed in
+static uint16_t s_view_stop = 0; // Stop Select pans to next
+
+// The route line copied out of the framebuffer after it was drawn, so redraws that only move vehicles blit it
+static GBitmap *s_pattern_cache = NULL;
+static PatternCacheKey s_pattern_cache_key;
+
+static Window *s_departures_window = NULL;
+static MenuLayer *s_departures_layer = NULL;
+
+static Vehicle s_vehicles[VEHICLES_LEN]; // Vehicles of the selected route, indexed by the number the phone gave them
+
+// Nearby window variables
+static Window *s_nearby_window = NULL;
+static MenuLayer *s_nearby_layer = NULL;
+static StopIndex s_stop_index; // Kept once it arrives, so reopening the window only needs a new position
+static GPoint s_nearby_position; // The user, in the same meters as the index
+static bool s_nearby_located = S_FALSE;
+static bool s_nearby_lost = S_FALSE; // The phone could not get a position
+static NearbyResult s_nearby_results[NEARBY_SHOWN];
+static uint16_t s_nearby_results_len = 0;
+
+// Debug window variables
+static Window *s_debug_window = NULL;
+static TextLayer *s_debug_text = NULL;
+static AppTimer* s_debug_timer = NULL;
+static char s_debug_buffer[DEBUG_TEXT_LEN];
+static Counters s_counters;
+
+//========================================= ARENAS ======================================================
+// Each route loads into its own arena and the catalog has one too. A few large blocks instead of a malloc per
+// string keeps the heap from fragmenting, and what a route costs is just the size of its blocks
+
+#define ARENA_ALIGN(size) (((size) + sizeof(void*) - 1) & ~(sizeof(void*) - 1)) // Pointer sized, 4 bytes on the watch
+
+static ArenaBlock* arena_add_block(Arena *arena, uint32_t size){
+  if(size < ARENA_BLOCK_SIZE) size = ARENA_BLOCK_SIZE;
+  ArenaBlock *block = (ArenaBlock*)malloc(sizeof(ArenaBlock) + size);
+  if(block == NULL){
+    LOG_WARNING("Out of memory for a %d byte arena block", (int)size);
+    return NULL;
+  }
+  block->next = arena->blocks;
+  block->size = size;
+  block->used = 0;
+  arena->blocks = block;
+  arena->bytes += sizeof(ArenaBlock) + size;
+  return block;
+}
+
+// Make sure the next size bytes of allocations come out of one block
+static bool arena_reserve(Arena *arena, uint32_t size){
+  size = ARENA_ALIGN(size);
+  if(arena->blocks != NULL && arena->blocks->size - arena->blocks->used >= size) return true;
+  return arena_add_block(arena, size) != NULL;
+}
+
+static void* arena_alloc(Arena *arena, uint32_t size){
+  size = ARENA_ALIGN(size);
+  if(!arena_reserve(arena, size)) return NULL;
+  ArenaBlock *block = arena->blocks;
+  void *ptr = &block->data[block->used];
+  block->used += size;
+  return ptr;
+}
+
+// The newest allocation grows in place when its block has room, anything else is copied to a new spot
+static void* arena_grow(Arena *arena, void *ptr, uint32_t old_size, uint32_t new_size){
+  old_size = ARENA_ALIGN(old_size);
+  new_size = ARENA_ALIGN(new_size);
+  ArenaBlock *block = arena->blocks;
+  if(ptr != NULL && block != NULL && (uint8_t*)ptr + old_size == &block->data[block->used] && block->used - old_size + new_size <= block->size){
+    block->used = block->used - old_size + new_size;
+    return ptr;
+  }
+  void *grown = arena_alloc(arena, new_size);
+  if(grown != NULL && ptr != NULL){
+    memcpy(grown, ptr, old_size < new_size ? old_size : new_size);
+  }
+  return grown;
+}
+
+// Copies a string into the arena. Falls back to an empty literal when there is no room
+static char* arena_strdup(Arena *arena, const char *string){
+  size_t len = strlen(string);
+  char *copy = (char*)arena_alloc(arena, len + 1);
+  if(copy == NULL) return "";
+  memcpy(copy, string, len + 1);
+  return copy;
+}
+
+static void arena_reset(Arena *arena){
+  while(arena->blocks != NULL){
+    ArenaBlock *next = arena->blocks->next;
+    free(arena->blocks);
+    arena->blocks = next;
+  }
+  arena->bytes = 0;
+}
 
 //========================================= COMPUTATIONAL GEOMETRY :D ======================================================
 
 // Taken from StackOverflow user @Craig McQueen 
 // http://stackoverflow.com/questions/1100090/looking-for-an-efficient-integer-square-root-algorithm-for-arm-thumb2
-uint32_t pebble_sqrt(uint32_t a_nInput)
+// Widened to 64 bits since squared distances between 16 bit points overflow 32
+uint32_t pebble_sqrt(uint64_t a_nInput)
 {
-    uint32_t op  = a_nInput;
-    uint32_t res = 0;
-    uint32_t one = 1uL << 30; // The second-to-top bit is set: use 1u << 14 for uint16_t type; use 1uL<<30 for uint32_t type
+    uint64_t op  = a_nInput;
+    uint64_t res = 0;
+    uint64_t one = 1uLL << 62; // The second-to-top bit is set: use 1u << 14 for uint16_t type; use 1uL<<30 for uint32_t type; use 1uLL<<62 for uint64_t type
   
     // "one" starts at the highest power of four <= than the argument.
     while (one > op)
@@ -102,174 +426,620 @@ uint32_t pebble_sqrt(uint32_t a_nInput)
 }
 
 static GPoint center(GPoint* p, GPoint* q){
-  uint16_t avg_x = (p->x + q->x)/2;
-  uint16_t avg_y = (p->y + q->y)/2;
+  int16_t avg_x = ((int32_t)p->x + q->x)/2;
+  int16_t avg_y = ((int32_t)p->y + q->y)/2;
   return GPoint(avg_x, avg_y);
 }
 
-static uint32_t distance(GPoint* p, GPoint* q){
-  return pebble_sqrt((p->x - q->x) * (p->x - q->x) + (p->y - q->y) *(p->y - q->y));
+static uint64_t squared_distance(const GPoint* p, const GPoint* q){
+  int32_t dx = p->x - q->x;
+  int32_t dy = p->y - q->y;
+  return (uint64_t)((int64_t)dx * dx) + (uint64_t)((int64_t)dy * dy);
 }
 
-// Finds the left tangent of the line through a point against a counter-clockwise sorted convex hull
-static GPoint* left_tangent(GPoint* p, ConvexHull* chull){
-  return NULL;
+static uint32_t distance(GPoint* p, GPoint* q){
+  return pebble_sqrt(squared_distance(p, q));
 }
 
-// Finds the right tangent of the line through a point against a counter-clockwise sorted convex hull
-static GPoint* right_tangent(GPoint* p, ConvexHull* chull){
-  return NULL;
+// Cohen-Sutherland outcodes: which sides of a rectangle a point is beyond
+enum {
+  OUT_LEFT = 1,
+  OUT_RIGHT = 2,
+  OUT_ABOVE = 4,
+  OUT_BELOW = 8
+};
+
+typedef struct {
+  int32_t min_x;
+  int32_t min_y;
+  int32_t max_x;
+  int32_t max_y;
+} ClipRect;
+
+static uint8_t outcode(const ClipRect *rect, int32_t x, int32_t y){
+  uint8_t code = 0;
+  if(x < rect->min_x) code |= OUT_LEFT;
+  else if(x > rect->max_x) code |= OUT_RIGHT;
+  if(y < rect->min_y) code |= OUT_ABOVE;
+  else if(y > rect->max_y) code |= OUT_BELOW;
+  return code;
 }
 
-// If the point is external, make it part of the convex hull. If it is internal, do nothing
-static void integrate_point(GPoint* p, ConvexHull* chull){
-  // Be stupid and assume all points are in the convex hull
-  if(p != NULL){
-    chull->points[chull->points_len] = p;
-    chull->points_len++;
+// Clip the segment (x0, y0)-(x1, y1) to the rectangle in place, given the outcodes of its ends
+// Returns false if no part of it is inside
+static bool clip_segment(const ClipRect *rect, int32_t *x0, int32_t *y0, int32_t *x1, int32_t *y1, uint8_t code0, uint8_t code1){
+  while(code0 | code1){
+    if(code0 & code1) return false; // Both ends beyond the same side
+    
+    // Move an end that is outside onto the edge it is beyond
+    uint8_t code = code0 ? code0 : code1;
+    int32_t x, y;
+    int32_t dx = *x1 - *x0;
+    int32_t dy = *y1 - *y0;
+    if(code & OUT_ABOVE){
+      y = rect->min_y;
+      x = *x0 + (int64_t)dx * (y - *y0) / dy;
+    }
+    else if(code & OUT_BELOW){
+      y = rect->max_y;
+      x = *x0 + (int64_t)dx * (y - *y0) / dy;
+    }
+    else if(code & OUT_LEFT){
+      x = rect->min_x;
+      y = *y0 + (int64_t)dy * (x - *x0) / dx;
+    }
+    else{
+      x = rect->max_x;
+      y = *y0 + (int64_t)dy * (x - *x0) / dx;
+    }
+    
+    if(code == code0){
+      *x0 = x;
+      *y0 = y;
+      code0 = outcode(rect, x, y);
+    }
+    else{
+      *x1 = x;
+      *y1 = y;
+      code1 = outcode(rect, x, y);
+    }
   }
+  return true;
 }
 
-// Returns an array of two points, being the points which are farthest from each other
-// Currently O(n^2); Can be reduced to O(n) with rotating calipers algorithm
-// Extremes needs to be a GPoint* pair to be filled
-static void extreme_points(ConvexHull* chull, GPoint** extremes){
-  extremes[0] = NULL;
-  extremes[1] = NULL;
-  
-  if(chull->points_len >= 1){
-    extremes[0] = chull->points[0];
+// Twice the signed area of the triangle formed by o, a and the point o + (dx, dy)
+// Positive when the turn is counter-clockwise
+static int64_t cross_dir(const GPoint* o, const GPoint* a, int32_t dx, int32_t dy){
+  return (int64_t)(a->x - o->x) * dy - (int64_t)(a->y - o->y) * dx;
+}
+
+static int64_t cross(const GPoint* o, const GPoint* a, const GPoint* b){
+  return cross_dir(o, a, b->x - o->x, b->y - o->y);
+}
+
+static int64_t dot(const GPoint* o, const GPoint* a, const GPoint* b){
+  return (int64_t)(a->x - o->x) * (b->x - o->x) + (int64_t)(a->y - o->y) * (b->y - o->y);
+}
+
+// An edge of the hull is visible from p if p is to its right, or on its line but past either end
+// The edges visible from an outside point form one contiguous run. Indexes wrap around the hull
+static bool edge_visible(const GPoint* p, ConvexHull* chull, uint16_t edge){
+  GPoint* a = &chull->points[edge % chull->points_len];
+  GPoint* b = &chull->points[(edge + 1) % chull->points_len];
+  int64_t turn = cross(a, b, p);
+  if(turn != 0) return turn < 0;
+  return dot(a, b, p) < 0 || dot(b, a, p) < 0;
+}
+
+// Binary search over edges (hidden, visible] for the first one visible from p
+// Edge indexes may run past the end of the hull and wrap. Returns the index of the right tangent vertex
+static uint16_t right_tangent(const GPoint* p, ConvexHull* chull, uint16_t hidden, uint16_t visible){
+  while(visible - hidden > 1){
+    uint16_t mid = hidden + (visible - hidden)/2;
+    if(edge_visible(p, chull, mid)) visible = mid;
+    else hidden = mid;
   }
-  if(chull->points_len >= 2){
-    extremes[1] = chull->points[1];
+  return visible % chull->points_len;
+}
+
+// Binary search over edges (visible, hidden] for the first one hidden from p
+// Edge indexes may run past the end of the hull and wrap. Returns the index of the left tangent vertex
+static uint16_t left_tangent(const GPoint* p, ConvexHull* chull, uint16_t visible, uint16_t hidden){
+  while(hidden - visible > 1){
+    uint16_t mid = visible + (hidden - visible)/2;
+    if(edge_visible(p, chull, mid)) visible = mid;
+    else hidden = mid;
   }
-  
-  if(chull->points_len > 2){
-    uint16_t max_dist = 0;
-    for(int i=0; i<chull->points_len; ++i){
-      for(int j=i+1; j<chull->points_len; ++j){
-        uint32_t dist = distance(chull->points[i], chull->points[j]);
-        if(dist > max_dist){
-          extremes[0] = chull->points[i];
-          extremes[1] = chull->points[j];
-          max_dist = dist;
-        }
-      }
-    }
-    //APP_LOG(APP_LOG_LEVEL_DEBUG, "Found extreme points to be (%d, %d) and (%d, %d) with a dist of %d", extremes[0]->x, extremes[0]->y, extremes[1]->x, extremes[1]->y, max_dist);
+  return hidden % chull->points_len;
+}
+
+// Finds the last vertex k in [1, points_len-1] where (dx, dy) from vertex 0 is counter-clockwise of or on the ray to k
+// The vertices fan out counter-clockwise around vertex 0, so this is a binary search
+static uint16_t fan_wedge(ConvexHull* chull, int32_t dx, int32_t dy){
+  uint16_t lo = 1;
+  uint16_t hi = chull->points_len - 1;
+  while(lo < hi){
+    uint16_t mid = (lo + hi + 1)/2;
+    if(cross_dir(&chull->points[0], &chull->points[mid], dx, dy) >= 0) lo = mid;
+    else hi = mid - 1;
   }
+  return lo;
 }
 
-//========================================= CLEAN UP FUNCTIONS ======================================================
+// Make room for one more hull vertex, doubling the buffer when it is full
+static bool reserve_hull_point(ConvexHull* chull){
+  if(chull->points_len < chull->points_cap) return true;
+  uint16_t cap = chull->points_cap > 0 ? chull->points_cap * 2 : 8;
+  GPoint* points = (GPoint*)arena_grow(chull->arena, chull->points, sizeof(GPoint) * chull->points_cap, sizeof(GPoint) * cap);
+  if(points == NULL) return false;
+  chull->points = points;
+  chull->points_cap = cap;
+  return true;
+}
+
+// Replace the vertices strictly between the right and left tangents with p
+static void replace_chain(GPoint* p, ConvexHull* chull, uint16_t right, uint16_t left){
+  uint16_t len = chull->points_len;
+  if(right < left){
+    // Vertices right+1 .. left-1 go, p takes their place
+    memmove(&chull->points[right + 2], &chull->points[left], sizeof(GPoint) * (len - left));
+    chull->points[right + 1] = *p;
+    chull->points_len = len - (left - right - 1) + 1;
+  }
+  else{
+    // The removed chain wraps past the end, so keep left .. right and put p after them
+    uint16_t kept = right - left + 1;
+    memmove(&chull->points[0], &chull->points[left], sizeof(GPoint) * kept);
+    chull->points[kept] = *p;
+    chull->points_len = kept + 1;
+  }
+}
 
-static void destroy_convex_hull(ConvexHull* chull){
-  if(chull != NULL){
-    if(chull->points != NULL){
-      free(chull->points);
-      chull->points = NULL;
+// Handles hulls of fewer than three vertices, which are a point or a segment
+static bool integrate_point_degenerate(GPoint* p, ConvexHull* chull){
+  GPoint* points = chull->points;
+  if(chull->points_len == 1 && points[0].x == p->x && points[0].y == p->y) return false;
+  if(chull->points_len == 2){
+    int64_t turn = cross(&points[0], &points[1], p);
+    if(turn == 0){
+      // Still a segment, only keep the farthest ends
+      if(dot(&points[0], &points[1], p) < 0) points[0] = *p;
+      else if(dot(&points[1], &points[0], p) < 0) points[1] = *p;
+      else return false;
+      return true;
     }
-    chull->points_len = 0;
-  } 
+    if(turn < 0){
+      // Keep counter-clockwise order
+      points[2] = points[1];
+      points[1] = *p;
+      chull->points_len = 3;
+      return true;
+    }
+  }
+  points[chull->points_len] = *p;
+  chull->points_len++;
+  return true;
 }
 
-static void destroy_pattern_points(Pattern* pattern){
-  if(pattern != NULL){
-    free(pattern->points);
-    pattern->points = NULL;
-  } 
-  pattern->points_len = 0;
+// If the point is external, make it part of the convex hull. If it is internal, do nothing
+// Returns true when the hull changed. The inside test and both tangent searches are O(log h)
+static bool integrate_point(GPoint* p, ConvexHull* chull){
+  if(p == NULL || !reserve_hull_point(chull)) return false;
+  if(chull->points_len < 3) return integrate_point_degenerate(p, chull);
+  
+  // Find one edge visible from p and one hidden from it
+  uint16_t len = chull->points_len;
+  bool first_visible = edge_visible(p, chull, 0);
+  bool last_visible = edge_visible(p, chull, len - 1);
+  uint16_t visible, hidden;
+  if(first_visible != last_visible){
+    visible = first_visible ? 0 : len - 1;
+    hidden = first_visible ? len - 1 : 0;
+  }
+  else if(!first_visible){
+    // p lies in the fan around vertex 0; it is outside only if the edge closing its wedge faces it
+    uint16_t wedge = fan_wedge(chull, p->x - chull->points[0].x, p->y - chull->points[0].y);
+    if(wedge == len - 1 || !edge_visible(p, chull, wedge)) return false;
+    visible = wedge;
+    hidden = 0;
+  }
+  else{
+    // Vertex 0 will be removed. The ray from p through it leaves the hull across a hidden edge
+    // When that ray runs along the closing edge, the edge before it is the hidden one
+    visible = 0;
+    hidden = fan_wedge(chull, chull->points[0].x - p->x, chull->points[0].y - p->y);
+    if(hidden == len - 1) hidden = len - 2;
+  }
+  
+  uint16_t right = right_tangent(p, chull, hidden, visible > hidden ? visible : visible + len);
+  uint16_t left = left_tangent(p, chull, visible, hidden > visible ? hidden : hidden + len);
+  replace_chain(p, chull, right, left);
+  return true;
 }
 
-static void destroy_pattern_stops(Pattern* pattern){
-  if(pattern != NULL){
-    if(pattern->stops != NULL){
-      for(int i=0; i<pattern->stops_len; i++){
-        if(strlen(pattern->stops[i].name) > 0){ 
-		      free(pattern->stops[i].name);
-		      pattern->stops[i].name = NULL;	
-        }
+// Fills extremes with the two hull vertices farthest from each other. Returns false if the hull is empty
+// or not started yet, as between a pattern's header and its first frame
+// Rotating calipers: for each edge, advance the antipodal vertex while it gets farther from the edge. O(h)
+static bool extreme_points(ConvexHull* chull, GPoint* extremes){
+  if(chull == NULL || chull->points_len == 0) return false;
+  uint16_t len = chull->points_len;
+  GPoint* points = chull->points;
+  
+  extremes[0] = points[0];
+  extremes[1] = points[len > 1 ? 1 : 0];
+  if(len > 2){
+    uint64_t max_dist = 0;
+    uint16_t j = 1;
+    for(uint16_t i=0; i<len; ++i){
+      uint16_t next = (i + 1) % len;
+      while(cross(&points[i], &points[next], &points[(j + 1) % len]) > cross(&points[i], &points[next], &points[j])){
+        j = (j + 1) % len;
+      }
+      uint64_t dist = squared_distance(&points[i], &points[j]);
+      if(dist > max_dist){
+        extremes[0] = points[i];
+        extremes[1] = points[j];
+        max_dist = dist;
+      }
+      dist = squared_distance(&points[next], &points[j]);
+      if(dist > max_dist){
+        extremes[0] = points[next];
+        extremes[1] = points[j];
+        max_dist = dist;
       }
-      free(pattern->stops);
-      pattern->stops = NULL;
     }
-    pattern->stops_len = 0;
-  } 
+  }
+  return true;
 }
 
-static void destroy_pattern(Pattern* pattern){
-  destroy_pattern_points(pattern);
-  destroy_pattern_stops(pattern);
-  destroy_convex_hull(pattern->convex_hull);
-  pattern->convex_hull = NULL;
-  free(pattern);
+//========================================= CATALOG ======================================================
+// Patterns are kept beside the catalog blob rather than in it, since the blob is the phone's layout
+static Pattern* route_pattern(const MenuItem *route){
+  return &s_patterns[route->id];
+}
+
+static const char* catalog_string(uint16_t offset){
+  return &s_catalog_strings[offset];
 }
 
-static void destroy_menu_item(MenuItem *item){
-  if(strlen(item->title) > 0) {
-    free(item->title);
-    item->title = NULL;
+// Point the menu into a complete catalog blob, checking every offset in it first. Returns false if it is damaged
+// The string table ends in a NUL, so every string in it does too
+static bool attach_catalog(){
+  if(s_catalog == NULL || s_catalog_len < SECTIONS_LEN) return false;
+  uint16_t items_len = 0;
+  for(int i=0; i<SECTIONS_LEN; i++){
+    items_len += s_catalog[i];
+  }
+  uint32_t strings_start = SECTIONS_LEN + sizeof(MenuItem) * items_len;
+  if(strings_start > s_catalog_len) return false;
+  uint16_t strings_len = s_catalog_len - strings_start;
+  if(items_len > 0 && (strings_len == 0 || s_catalog[s_catalog_len - 1] != '\0')) return false;
+  
+  MenuItem *items = (MenuItem*)&s_catalog[SECTIONS_LEN];
+  uint16_t patterns_len = 0;
+  uint16_t item = 0;
+  for(int i=0; i<SECTIONS_LEN; i++){
+    for(int j=0; j<s_catalog[i]; j++, item++){
+      if(items[item].id >= ROUTES_LEN || items[item].section != i) return false;
+      if(items[item].title >= strings_len || items[item].subtitle >= strings_len) return false;
+      if(items[item].id >= patterns_len) patterns_len = items[item].id + 1;
+    }
+  }
+  
+  s_patterns = (Pattern*)arena_alloc(&s_catalog_arena, sizeof(Pattern) * patterns_len);
+  if(s_patterns == NULL && patterns_len > 0) return false;
+  memset(s_patterns, 0, sizeof(Pattern) * patterns_len);
+  for(uint16_t i=0; i<patterns_len; i++){
+    s_patterns[i].bounds = (PatternBounds){ .aspect = Q16_ONE };
   }
-  if(strlen(item->subtitle) > 0){ 
-    free(item->subtitle);
-    item->subtitle = NULL;
+  s_patterns_len = patterns_len;
+  
+  s_catalog_strings = (const char*)&s_catalog[strings_start];
+  for(int i=0; i<SECTIONS_LEN; i++){
+    s_menu_items[i] = s_catalog[i] > 0 ? items : NULL;
+    s_section_lens[i] = s_catalog[i];
+    for(int j=0; j<s_catalog[i]; j++){
+      s_routes[items[j].id] = &items[j];
+    }
+    items += s_catalog[i];
   }
-  destroy_pattern(item->pattern);
-  free(item->pattern);
-  item->pattern = NULL;
+  return true;
+}
+
+//========================================= CLEAN UP FUNCTIONS ======================================================
+
+// Everything a pattern loaded lives in its arena, so it all goes at once
+static void reset_pattern(Pattern* pattern){
+  arena_reset(&pattern->arena);
+  pattern->points = NULL;
+  pattern->points_len = 0;
+  pattern->stops = NULL;
+  pattern->stops_len = 0;
+  pattern->convex_hull = NULL;
+  pattern->received = NULL;
+  pattern->nack_tries = 0;
+  pattern->diameter_valid = false;
+  pattern->lod_valid = false;
+  if(s_pattern_cache_key.pattern == pattern) s_pattern_cache_key.pattern = NULL;
 }
 
-// Free up the heap memory used by menu item titles and patterns
+// Free up the heap memory used by the catalog and the patterns
+// The prefetch points into the catalog, so it is dropped too. A new catalog schedules the next once it is shown
 static void destroy_menu_items(){
+  if(s_prefetch_timer != NULL){
+    app_timer_cancel(s_prefetch_timer);
+    s_prefetch_timer = NULL;
+  }
+  s_prefetch_route = NULL;
+  for(uint16_t i=0; i<s_patterns_len; i++){
+    reset_pattern(&s_patterns[i]);
+  }
   for(int i=0; i<SECTIONS_LEN; i++){
-    for(int j=0; j<s_section_lens[i]; j++){
-      MenuItem *item = &s_menu_items[i][j];
-      destroy_menu_item(item);
-    }
     s_section_lens[i] = 0;
-    free(s_menu_items[i]);
     s_menu_items[i] = NULL;
   }
+  s_patterns = NULL;
+  s_patterns_len = 0;
+  s_catalog = NULL;
+  s_catalog_len = 0;
+  s_catalog_received = 0;
+  s_catalog_strings = NULL;
+  arena_reset(&s_catalog_arena);
+  memset(s_routes, 0, sizeof(s_routes));
+}
+
+//========================================= MEMORY BUDGET ======================================================
+static uint32_t patterns_bytes(){
+  uint32_t bytes = 0;
+  for(int i=0; i<ROUTES_LEN; i++){
+    if(s_routes[i] != NULL) bytes += route_pattern(s_routes[i])->arena.bytes;
+  }
+  return bytes;
+}
+
+// Free the route line cache. The route layer draws the line again and captures a new one when it next needs it
+static void destroy_pattern_cache(){
+  if(s_pattern_cache != NULL) gbitmap_destroy(s_pattern_cache);
+  s_pattern_cache = NULL;
+  s_pattern_cache_key.pattern = NULL;
+}
+
+// Evict loaded patterns, least recently viewed first, until another needed bytes fit in the budget
+// The selected route and patterns still streaming in are kept. An evicted route is loaded again when it is next viewed
+static void enforce_pattern_budget(uint32_t needed){
+  // The route line cache is only a copy of the screen, so it goes before any pattern does
+  if(heap_bytes_free() < HEAP_FREE_RESERVE + needed) destroy_pattern_cache();
+  uint32_t bytes = patterns_bytes();
+  while(bytes + needed > PATTERN_HEAP_BUDGET || heap_bytes_free() < HEAP_FREE_RESERVE + needed){
+    MenuItem *victim = NULL;
+    for(int i=0; i<ROUTES_LEN; i++){
+      MenuItem *route = s_routes[i];
+      if(route == NULL || route == s_selected_route) continue;
+      Pattern *pattern = route_pattern(route);
+      if(pattern->arena.bytes == 0 || pattern->points_len < pattern->points_total || pattern->stops_len < pattern->stops_total) continue;
+      if(victim == NULL || pattern->last_viewed < route_pattern(victim)->last_viewed) victim = route;
+    }
+    if(victim == NULL) break;
+    LOG_DEBUG("Evicting pattern: route %d : %d bytes : %d bytes of heap free", victim->id, (int)route_pattern(victim)->arena.bytes, (int)heap_bytes_free());
+    bytes -= route_pattern(victim)->arena.bytes;
+    reset_pattern(route_pattern(victim));
+  }
+}
+
+//========================================= COUNTERS ======================================================
+// Milliseconds on the watch's clock, only good for timing against itself
+static uint32_t clock_ms(){
+  time_t seconds;
+  uint16_t ms;
+  time_ms(&seconds, &ms);
+  return (uint32_t)seconds * 1000 + ms;
+}
+
+static void counters_sample_heap(){
+  uint32_t used = heap_bytes_used();
+  if(used > s_counters.heap_peak) s_counters.heap_peak = used;
+}
+
+// A message of this many bytes was received, and decoding and handling it took from start until now
+static void counters_add_message(uint16_t bytes, uint32_t start){
+  uint32_t elapsed = clock_ms() - start;
+  s_counters.messages_in++;
+  s_counters.bytes_in += bytes;
+  s_counters.decode_ms += elapsed;
+  if(elapsed > s_counters.decode_ms_max) s_counters.decode_ms_max = elapsed;
+  counters_sample_heap();
+}
+
+// The route layer was drawn, from start until now
+static void counters_add_frame(uint32_t start){
+  uint32_t elapsed = clock_ms() - start;
+  s_counters.frames_drawn++;
+  s_counters.render_ms += elapsed;
+  if(elapsed > s_counters.render_ms_max) s_counters.render_ms_max = elapsed;
+  counters_sample_heap();
 }
 
 //========================================= CLICK HANDLING ======================================================
-void down_single_click_handler(ClickRecognizerRef recognizer, void *context) {
+static int32_t fit_pattern(Pattern *pattern, GRect pattern_frame, GPoint *fit_center); // Defined in route window functions
+
+// Up and Down zoom the route window in and out. Zooming in from the fitted view keeps its center
+static void up_single_click_handler(ClickRecognizerRef recognizer, void *context) {
+  if(s_view_zoom + 1 >= PATTERN_ZOOM_LEVELS || s_selected_route == NULL || route_pattern(s_selected_route)->points == NULL) return;
+  GPoint fit_center;
+  if(fit_pattern(route_pattern(s_selected_route), layer_get_frame(s_route_pattern), &fit_center) == 0) return;
+  if(s_view_zoom == 0) s_view_center = fit_center;
+  s_view_zoom++;
+  layer_mark_dirty(s_route_pattern);
+}
+
+static void down_single_click_handler(ClickRecognizerRef recognizer, void *context) {
+  if(s_view_zoom == 0) return;
+  s_view_zoom--;
+  layer_mark_dirty(s_route_pattern);
+}
+
+// Select pans to the next stop along the route, zooming in first if the whole route is showing
+static void select_single_click_handler(ClickRecognizerRef recognizer, void *context) {
+  Pattern *pattern = s_selected_route != NULL ? route_pattern(s_selected_route) : NULL;
+  if(pattern == NULL || pattern->stops == NULL) return;
+  for(uint16_t tries=0; tries<pattern->stops_total; tries++){
+    Stop *stop = &pattern->stops[s_view_stop];
+    s_view_stop = (s_view_stop + 1) % pattern->stops_total;
+    if(stop->name == NULL || stop->point_index >= pattern->points_len) continue; // Not here yet
+    s_view_center = pattern->points[stop->point_index];
+    if(s_view_zoom == 0) s_view_zoom = 1;
+    layer_mark_dirty(s_route_pattern);
+    return;
+  }
 }
 
-void config_provider(Window *window) {
-  window_single_click_subscribe(BUTTON_ID_SELECT, down_single_click_handler);
+static void enter_debug_window(); // Defined in debug window functions
+
+// Holding Select opens the counters, which are otherwise hidden
+static void select_long_click_handler(ClickRecognizerRef recognizer, void *context) {
+  enter_debug_window();
+}
+
+static void config_provider(Window *window) {
+  window_single_click_subscribe(BUTTON_ID_UP, up_single_click_handler);
+  window_single_click_subscribe(BUTTON_ID_DOWN, down_single_click_handler);
+  window_single_click_subscribe(BUTTON_ID_SELECT, select_single_click_handler);
+  window_long_click_subscribe(BUTTON_ID_SELECT, 0, select_long_click_handler, NULL);
 }
 
 //========================================= OUTBOX HANDLING ======================================================
 // Write message to buffer & send
+// Along with the inbox size the phone learns how much detail the screen can show, so it can simplify patterns
 static void send_inbox_size(){
 	DictionaryIterator *iter;
+	GRect screen = layer_get_bounds(window_get_root_layer(s_menu_window));
 	
 	app_message_outbox_begin(&iter);
 	dict_write_uint8(iter, MESSAGE_KEY_message_type, MESSAGE_SET_INBOX_SIZE);
   dict_write_uint16(iter, MESSAGE_KEY_inbox_size, INBOX_SIZE);
+  dict_write_uint16(iter, MESSAGE_KEY_screen_w, screen.size.w);
+  dict_write_uint16(iter, MESSAGE_KEY_screen_h, screen.size.h);
+  dict_write_uint8(iter, MESSAGE_KEY_zoom_max, PATTERN_MAX_ZOOM);
+  dict_write_uint16(iter, MESSAGE_KEY_pattern_max_len, PATTERN_LEN);
+  dict_write_uint8(iter, MESSAGE_KEY_screen_round, PBL_IF_ROUND_ELSE(1, 0));
+  dict_write_uint8(iter, MESSAGE_KEY_projected, PATTERN_PROJECTED);
 	
 	dict_write_end(iter);
   app_message_outbox_send();
 }
 
 // Write message to buffer & send
+// The hash of the cached catalog lets the phone answer with MESSAGE_ROUTES_CURRENT instead of every route
 static void request_routes(){
 	DictionaryIterator *iter;
 	
 	app_message_outbox_begin(&iter);
 	dict_write_uint8(iter, MESSAGE_KEY_message_type, MESSAGE_ROUTES);
+  dict_write_uint32(iter, MESSAGE_KEY_catalog_hash, s_catalog_hash);
 	
 	dict_write_end(iter);
   app_message_outbox_send();
 }
 
 // Request the info to populate the route menu
-static void request_route_pattern(const char *short_name){
+static void request_route_pattern(uint8_t route_id){
 	DictionaryIterator *iter;
 	
 	app_message_outbox_begin(&iter);
 	dict_write_uint8(iter, MESSAGE_KEY_message_type, MESSAGE_ROUTE_PATTERN);
-  dict_write_cstring(iter, MESSAGE_KEY_route_short_name, short_name);
+  dict_write_uint8(iter, MESSAGE_KEY_route_id, route_id);
+	
+	dict_write_end(iter);
+  app_message_outbox_send();
+}
+
+// Ask for a pattern the user may open next. The phone only sends it when the link has nothing more urgent
+static void request_route_prefetch(uint8_t route_id){
+	DictionaryIterator *iter;
+	
+	if(app_message_outbox_begin(&iter) != APP_MSG_OK) return;
+	dict_write_uint8(iter, MESSAGE_KEY_message_type, MESSAGE_ROUTE_PATTERN_PREFETCH);
+  dict_write_uint8(iter, MESSAGE_KEY_route_id, route_id);
+	
+	dict_write_end(iter);
+  app_message_outbox_send();
+}
+
+// Ask for the vehicles of a route whose pattern is already here. Requesting a pattern asks for them too
+// with_times asks for the departures of the pattern's transfer as well, which the outbox has no room to ask for apart
+static void request_vehicles(uint8_t route_id, bool with_times, uint16_t transfer_id){
+	DictionaryIterator *iter;
+	
+	if(app_message_outbox_begin(&iter) != APP_MSG_OK) return;
+	dict_write_uint8(iter, MESSAGE_KEY_message_type, MESSAGE_VEHICLES);
+  dict_write_uint8(iter, MESSAGE_KEY_route_id, route_id);
+  if(with_times) dict_write_uint16(iter, MESSAGE_KEY_transfer_id, transfer_id);
+	
+	dict_write_end(iter);
+  app_message_outbox_send();
+}
+
+// Ask for the departures of a pattern that is here without them, as when its window closed before they arrived
+static void request_stop_times(uint8_t route_id, uint16_t transfer_id){
+	DictionaryIterator *iter;
+	
+	if(app_message_outbox_begin(&iter) != APP_MSG_OK) return;
+	dict_write_uint8(iter, MESSAGE_KEY_message_type, MESSAGE_STOP_TIMES);
+  dict_write_uint8(iter, MESSAGE_KEY_route_id, route_id);
+  dict_write_uint16(iter, MESSAGE_KEY_transfer_id, transfer_id);
+	
+	dict_write_end(iter);
+  app_message_outbox_send();
+}
+
+// Let the phone know the route window closed, so it drops whatever it still had queued for the route
+static void send_route_closed(uint8_t route_id){
+	DictionaryIterator *iter;
+	
+	if(app_message_outbox_begin(&iter) != APP_MSG_OK) return;
+	dict_write_uint8(iter, MESSAGE_KEY_message_type, MESSAGE_ROUTE_CLOSED);
+  dict_write_uint8(iter, MESSAGE_KEY_route_id, route_id);
+	
+	dict_write_end(iter);
+  app_message_outbox_send();
+}
+
+// Ask for the user's position, and the stop index unless the one here (by hash) is current
+// The capacity lets the phone drop the stops farthest from the user when there are too many
+static void request_nearby(){
+	DictionaryIterator *iter;
+	
+	if(app_message_outbox_begin(&iter) != APP_MSG_OK) return;
+	dict_write_uint8(iter, MESSAGE_KEY_message_type, MESSAGE_NEARBY);
+  dict_write_uint32(iter, MESSAGE_KEY_nearby_hash, s_stop_index.stops_len == s_stop_index.stops_total ? s_stop_index.hash : 0);
+  dict_write_uint16(iter, MESSAGE_KEY_list_len, NEARBY_STOPS_LEN);
+	
+	dict_write_end(iter);
+  app_message_outbox_send();
+}
+
+// Ask the phone for the parts of a pattern transfer that never arrived, as varint (start, count) ranges of the
+// transfer's indexes: its points, then its stops
+static void send_pattern_nack(uint8_t route_id, uint16_t transfer_id, const uint8_t *ranges, uint16_t ranges_len){
+	DictionaryIterator *iter;
+	
+	if(app_message_outbox_begin(&iter) != APP_MSG_OK) return;
+	dict_write_uint8(iter, MESSAGE_KEY_message_type, MESSAGE_ROUTE_PATTERN_NACK);
+  dict_write_uint8(iter, MESSAGE_KEY_route_id, route_id);
+  dict_write_uint16(iter, MESSAGE_KEY_transfer_id, transfer_id);
+  dict_write_data(iter, MESSAGE_KEY_frame_data, ranges, ranges_len);
+	
+	dict_write_end(iter);
+  app_message_outbox_send();
+}
+
+// The counters for the phone, as the Counters struct
+static void send_counters(){
+	DictionaryIterator *iter;
+	
+	if(app_message_outbox_begin(&iter) != APP_MSG_OK) return;
+	dict_write_uint8(iter, MESSAGE_KEY_message_type, MESSAGE_COUNTERS);
+  dict_write_data(iter, MESSAGE_KEY_frame_data, (const uint8_t*)&s_counters, sizeof(Counters));
 	
 	dict_write_end(iter);
   app_message_outbox_send();
@@ -277,96 +1047,218 @@ static void request_route_pattern(const char *short_name){
 
 // Called when PebbleKitJS does not acknowledge receipt of a message
 static void out_failed_handler(DictionaryIterator *failed, AppMessageResult reason, void *context) {
+  s_counters.out_failed++;
+  LOG_WARNING("Outbox message failed: reason %d", (int)reason);
 }
 
-//========================================= INBOX HANDLING ======================================================
-static void status_msg_handler(DictionaryIterator *received, void *context) {
-  Tuple *tuple;
-  
-  tuple = dict_find(received, MESSAGE_KEY_js_status);
-  if(tuple) {
-    uint32_t js_status = (int)tuple->value->uint32;
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Received status notification: %d", (int)js_status); 
-    if(js_status == 1) send_inbox_size();
-    else if(js_status == 0) request_routes();
-  }
-}
+//========================================= INBOX DECODING ======================================================
+// Every key a message can carry, decoded into one struct in a single pass over the dictionary
+// A field the message did not carry keeps its default, and its bit in present stays clear
+// It is one flat struct rather than one per message type because tuples come in any order, so the type is only known
+// once the pass is over, and most keys (route_id, list_index, list_len, transfer_id, frame_data) are shared between
+// types. Each handler reads only the fields its type carries. The struct is about 110 bytes on the stack, once per
+// message
+typedef struct {
+  uint32_t present; // One bit per InboxField
+  uint32_t message_type;
+  uint32_t js_status;
+  uint32_t route_id;
+  uint32_t list_index;
+  uint32_t list_len;
+  uint32_t stops_len;
+  uint32_t transfer_id;
+  int32_t bbox_min_lat;
+  int32_t bbox_min_lon;
+  int32_t bbox_max_lat;
+  int32_t bbox_max_lon;
+  int32_t aspect;
+  uint32_t projected;
+  const char *stop_name;
+  uint32_t stop_is_timed;
+  uint32_t stop_point_index;
+  uint32_t catalog_hash;
+  uint32_t catalog_len;
+  uint32_t nearby_hash;
+  uint32_t grid_cols;
+  uint32_t grid_rows;
+  uint32_t grid_cell;
+  int32_t position_x;
+  int32_t position_y;
+  const uint8_t *frame_data;
+  uint16_t frame_len;
+} InboxMessage;
 
-static void routes_msg_handler(DictionaryIterator *received, void *context){
-  Tuple *tuple;
-  
-  // Save the route name on the heap for use in the menu
-  char *name = "\0"; 
-  tuple = dict_find(received, MESSAGE_KEY_route_name);
-  if(tuple){
-    name = (char*)malloc(strlen(tuple->value->cstring)+1);
-    strcpy(name, tuple->value->cstring);
-  }
+// In the same order as s_inbox_fields
+typedef enum {
+  INBOX_MESSAGE_TYPE,
+  INBOX_JS_STATUS,
+  INBOX_ROUTE_ID,
+  INBOX_LIST_INDEX,
+  INBOX_LIST_LEN,
+  INBOX_STOPS_LEN,
+  INBOX_TRANSFER_ID,
+  INBOX_BBOX_MIN_LAT,
+  INBOX_BBOX_MIN_LON,
+  INBOX_BBOX_MAX_LAT,
+  INBOX_BBOX_MAX_LON,
+  INBOX_ASPECT,
+  INBOX_PROJECTED,
+  INBOX_STOP_NAME,
+  INBOX_STOP_IS_TIMED,
+  INBOX_STOP_POINT_INDEX,
+  INBOX_CATALOG_HASH,
+  INBOX_CATALOG_LEN,
+  INBOX_NEARBY_HASH,
+  INBOX_GRID_COLS,
+  INBOX_GRID_ROWS,
+  INBOX_GRID_CELL,
+  INBOX_POSITION_X,
+  INBOX_POSITION_Y,
+  INBOX_FRAME_DATA,
+  INBOX_FIELDS_LEN
+} InboxField;
 
-  char *short_name = "\0"; 
-  tuple = dict_find(received, MESSAGE_KEY_route_short_name);
-  if(tuple){
-    short_name = (char*)malloc(strlen(tuple->value->cstring)+1);
-    strcpy(short_name, tuple->value->cstring);
-  }
+#define INBOX_HAS(message, field) (((message)->present & (1u << (field))) != 0)
 
-  uint8_t color_r = 0;
-  tuple = dict_find(received, MESSAGE_KEY_route_color_r);
-  if(tuple){
-    color_r = tuple->value->uint8;
-  }
+typedef enum {
+  FIELD_INT, // Any integer tuple, widened to 32 bits
+  FIELD_CSTRING,
+  FIELD_DATA // The pointer goes in the field and the length in frame_len
+} InboxFieldKind;
 
-  uint8_t color_g = 0;
-  tuple = dict_find(received, MESSAGE_KEY_route_color_g);
-  if(tuple){
-    color_g = tuple->value->uint8;
-  }
+typedef struct {
+  const uint32_t *key; // Message keys are only known at link time
+  uint8_t offset;
+  uint8_t kind;
+} InboxFieldSpec;
+
+#define INBOX_FIELD(name, kind) { &MESSAGE_KEY_##name, offsetof(InboxMessage, name), kind }
 
-  uint8_t color_b = 0;
-  tuple = dict_find(received, MESSAGE_KEY_route_color_b);
-  if(tuple){
-    color_b = tuple->value->uint8;
+static const InboxFieldSpec s_inbox_fields[INBOX_FIELDS_LEN] = {
+  INBOX_FIELD(message_type, FIELD_INT),
+  INBOX_FIELD(js_status, FIELD_INT),
+  INBOX_FIELD(route_id, FIELD_INT),
+  INBOX_FIELD(list_index, FIELD_INT),
+  INBOX_FIELD(list_len, FIELD_INT),
+  INBOX_FIELD(stops_len, FIELD_INT),
+  INBOX_FIELD(transfer_id, FIELD_INT),
+  INBOX_FIELD(bbox_min_lat, FIELD_INT),
+  INBOX_FIELD(bbox_min_lon, FIELD_INT),
+  INBOX_FIELD(bbox_max_lat, FIELD_INT),
+  INBOX_FIELD(bbox_max_lon, FIELD_INT),
+  INBOX_FIELD(aspect, FIELD_INT),
+  INBOX_FIELD(projected, FIELD_INT),
+  INBOX_FIELD(stop_name, FIELD_CSTRING),
+  INBOX_FIELD(stop_is_timed, FIELD_INT),
+  INBOX_FIELD(stop_point_index, FIELD_INT),
+  INBOX_FIELD(catalog_hash, FIELD_INT),
+  INBOX_FIELD(catalog_len, FIELD_INT),
+  INBOX_FIELD(nearby_hash, FIELD_INT),
+  INBOX_FIELD(grid_cols, FIELD_INT),
+  INBOX_FIELD(grid_rows, FIELD_INT),
+  INBOX_FIELD(grid_cell, FIELD_INT),
+  INBOX_FIELD(position_x, FIELD_INT),
+  INBOX_FIELD(position_y, FIELD_INT),
+  INBOX_FIELD(frame_data, FIELD_DATA)
+};
+
+// Message keys are handed out in a run, so a key's field is found by indexing from the lowest key
+// Each entry is the field plus one, so 0 marks a key no message is decoded from
+#define INBOX_KEY_SPAN 64
+static uint8_t s_inbox_key_fields[INBOX_KEY_SPAN];
+static uint32_t s_inbox_key_base;
+static bool s_inbox_keys_dense;
+
+static void inbox_decoder_init(){
+  s_inbox_key_base = UINT32_MAX;
+  uint32_t last_key = 0;
+  for(uint8_t i=0; i<INBOX_FIELDS_LEN; i++){
+    if(*s_inbox_fields[i].key < s_inbox_key_base) s_inbox_key_base = *s_inbox_fields[i].key;
+    if(*s_inbox_fields[i].key > last_key) last_key = *s_inbox_fields[i].key;
+  }
+  memset(s_inbox_key_fields, 0, sizeof(s_inbox_key_fields));
+  s_inbox_keys_dense = last_key - s_inbox_key_base < INBOX_KEY_SPAN;
+  if(!s_inbox_keys_dense) return; // Keys too far apart fall back to searching the table
+  for(uint8_t i=0; i<INBOX_FIELDS_LEN; i++){
+    s_inbox_key_fields[*s_inbox_fields[i].key - s_inbox_key_base] = i + 1;
   }
+}
 
-  int group = ROUTE_OTHER;
-  tuple = dict_find(received, MESSAGE_KEY_route_type);
-  if(tuple){
-    group = tuple->value->uint8;
+// Returns the field a key is decoded into, or INBOX_FIELDS_LEN for a key no message is decoded from
+static uint8_t inbox_field(uint32_t key){
+  if(s_inbox_keys_dense){
+    uint32_t slot = key - s_inbox_key_base;
+    return slot < INBOX_KEY_SPAN && s_inbox_key_fields[slot] > 0 ? s_inbox_key_fields[slot] - 1 : INBOX_FIELDS_LEN;
   }
-  
-  uint32_t index = 0;
-  tuple = dict_find(received, MESSAGE_KEY_list_index);
-  if(tuple){
-    index = tuple->value->uint32;
+  for(uint8_t i=0; i<INBOX_FIELDS_LEN; i++){
+    if(*s_inbox_fields[i].key == key) return i;
+  }
+  return INBOX_FIELDS_LEN;
+}
+
+// The phone sends every number as an int32, but any integer width reads right
+static int32_t tuple_int(const Tuple *tuple){
+  bool is_signed = tuple->type == TUPLE_INT;
+  switch(tuple->length){
+    case 1 : return is_signed ? tuple->value->int8 : tuple->value->uint8;
+    case 2 : return is_signed ? tuple->value->int16 : tuple->value->uint16;
+    case 4 : return tuple->value->int32;
   }
+  return 0;
+}
+
+// Walks the dictionary once, writing each known tuple into its field. Returns the size of the dictionary in bytes
+static uint16_t decode_inbox(DictionaryIterator *received, InboxMessage *message){
+  memset(message, 0, sizeof(InboxMessage));
+  message->route_id = ROUTES_LEN;
+  message->aspect = Q16_ONE;
+  message->stop_name = "";
   
-  uint32_t list_len = 0;
-  tuple = dict_find(received, MESSAGE_KEY_list_len);
-  if(tuple){
-    list_len = tuple->value->uint32;
+  uint16_t bytes = 1; // The tuple count
+  for(Tuple *tuple = dict_read_first(received); tuple != NULL; tuple = dict_read_next(received)){
+    bytes += sizeof(Tuple) + tuple->length;
+    uint8_t field = inbox_field(tuple->key);
+    if(field >= INBOX_FIELDS_LEN) continue;
+    
+    const InboxFieldSpec *spec = &s_inbox_fields[field];
+    void *value = (uint8_t*)message + spec->offset;
+    switch(spec->kind){
+      case FIELD_INT :
+        if(tuple->type != TUPLE_INT && tuple->type != TUPLE_UINT) continue;
+        *(int32_t*)value = tuple_int(tuple);
+      break;
+      
+      case FIELD_CSTRING :
+        if(tuple->type != TUPLE_CSTRING) continue;
+        *(const char**)value = tuple->value->cstring;
+      break;
+      
+      case FIELD_DATA :
+        *(const uint8_t**)value = tuple->value->data;
+        message->frame_len = tuple->length;
+      break;
+    }
+    message->present |= 1u << field;
   }
-  APP_LOG(APP_LOG_LEVEL_DEBUG, "Received route: %s - %s : group %d : rgb(%d, %d, %d) : %d of %d", short_name, name, group, color_r, color_g, color_b, (int)index+1, (int)list_len);
+  return bytes;
+}
 
-  if(list_len > 0){
-    // This must be new list
-    s_menu_items[group] = (MenuItem*)malloc(sizeof(MenuItem) * list_len);
+//========================================= INBOX HANDLING ======================================================
+static void status_msg_handler(const InboxMessage *message) {
+  if(INBOX_HAS(message, INBOX_JS_STATUS)) {
+    LOG_DEBUG("Received status notification: %d", (int)message->js_status); 
+    if(message->js_status == 1) send_inbox_size();
+    else if(message->js_status == 0) request_routes();
   }
-  
-  MenuItem *new_item = &s_menu_items[group][index];
-  new_item->title = short_name;
-  new_item->subtitle = name;
-  new_item->color_rgb[0] = color_r;
-  new_item->color_rgb[1] = color_g;
-  new_item->color_rgb[2] = color_b;
-  new_item->pattern = (Pattern*)malloc(sizeof(Pattern));
-  new_item->pattern->points_len = 0;
-  new_item->pattern->points = NULL;
-  new_item->pattern->stops_len = 0;
-  new_item->pattern->stops = NULL;
-  new_item->pattern->convex_hull = NULL;
-  s_section_lens[group]++;
+}
 
-  // Show the route menu/hide the loading message
+static bool persist_save_catalog(); // Defined in persistent cache functions
+static bool persist_save_pattern(MenuItem *route); // Defined in persistent cache functions
+static void persist_clear_patterns(); // Defined in persistent cache functions
+static void schedule_prefetch(); // Defined in menu callback functions
+
+// Show the route menu/hide the loading message
+static void show_route_menu(){
   if(s_menu_loading){
     s_menu_loading = S_FALSE;
     layer_set_hidden(menu_layer_get_layer(s_menu_layer), false);
@@ -374,240 +1266,1135 @@ static void routes_msg_handler(DictionaryIterator *received, void *context){
     
     // Fix the selection so it points properly to the first item
     menu_layer_set_selected_index(s_menu_layer, MenuIndex(0,0), MenuRowAlignCenter, true);
-    menu_layer_reload_data(s_menu_layer);
   }
+  menu_layer_reload_data(s_menu_layer);
+  schedule_prefetch();
+}
 
-  layer_mark_dirty(menu_layer_get_layer(s_menu_layer));
+// Throw away the routes on screen (and the patterns cached for them) to make way for a new catalog
+static void replace_catalog(uint32_t catalog_hash){
+  if(s_route_window != NULL && window_stack_contains_window(s_route_window)){
+    window_stack_remove(s_route_window, false);
+  }
+  if(s_departures_window != NULL && window_stack_contains_window(s_departures_window)){
+    window_stack_remove(s_departures_window, false);
+  }
+  s_selected_route = NULL;
+  destroy_menu_items();
+  persist_clear_patterns();
+  s_catalog_hash = catalog_hash;
+  menu_layer_reload_data(s_menu_layer);
 }
 
-static void route_pattern_points_msg_handler(DictionaryIterator *received, void *context) {
-  Tuple *tuple;
-  
-  int32_t point_x = 0; 
-  tuple = dict_find(received, MESSAGE_KEY_point_x);
-  if(tuple){
-    point_x = tuple->value->int32;
+// The catalog arrives as one blob split over a few frames, each copied in at its byte offset (list_index)
+// Frames are sent in order, so one that is repeated or out of place is ignored. Once the last byte is in, the menu is
+// pointed straight into the blob and reloaded once
+static void routes_msg_handler(const InboxMessage *message){
+  uint32_t offset = message->list_index;
+  uint32_t catalog_hash = message->catalog_hash;
+  uint32_t catalog_len = message->catalog_len;
+  if(!INBOX_HAS(message, INBOX_FRAME_DATA)){
+    LOG_DEBUG("Catalog frame without data");
+    return;
   }
-  
-  int32_t point_y = 0; 
-  tuple = dict_find(received, MESSAGE_KEY_point_y);
-  if(tuple){
-    point_y = tuple->value->int32;
+  LOG_TRACE("Received catalog frame: %d bytes : at %d of %d", message->frame_len, (int)offset, (int)catalog_len);
+
+  if(catalog_hash != s_catalog_hash){
+    // The phone has a different catalog than the one on screen, so start over with the new one
+    replace_catalog(catalog_hash);
   }
-  
-  uint32_t index = 0; 
-  tuple = dict_find(received, MESSAGE_KEY_list_index);
-  if(tuple){
-    index = tuple->value->uint32;
+  if(s_catalog == NULL && offset == 0 && catalog_len <= UINT16_MAX){
+    s_catalog = (uint8_t*)arena_alloc(&s_catalog_arena, catalog_len);
+    s_catalog_len = s_catalog != NULL ? catalog_len : 0;
   }
+  if(s_catalog == NULL || offset != s_catalog_received || offset + message->frame_len > s_catalog_len) return;
   
-  uint32_t list_len = 0; 
-  tuple = dict_find(received, MESSAGE_KEY_list_len);
-  if(tuple){
-    list_len = tuple->value->uint32;
-  }
+  memcpy(&s_catalog[offset], message->frame_data, message->frame_len);
+  s_catalog_received += message->frame_len;
+  if(s_catalog_received < s_catalog_len) return;
   
-  // Dont store short name on heap here
-  char *route_name = "ERROR"; 
-  tuple = dict_find(received, MESSAGE_KEY_route_short_name);
-  if(tuple){
-    route_name = tuple->value->cstring;
+  if(!attach_catalog()){
+    LOG_WARNING("Route catalog is damaged");
+    destroy_menu_items();
+    s_catalog_hash = 0;
+    return;
   }
+  show_route_menu();
   
-  APP_LOG(APP_LOG_LEVEL_DEBUG, "Received pattern point: (%d, %d) : route %s : %d of %d", (int)point_x, (int)point_y, route_name, (int)index+1, (int)list_len);
+  // Keep it for the next launch
+  persist_save_catalog();
+}
+
+// Finds the menu item for a route by its ID
+static MenuItem* find_route(uint32_t route_id){
+  return route_id < ROUTES_LEN ? s_routes[route_id] : NULL;
+}
+
+// Reads one LEB128 varint starting at *pos and advances *pos past it
+// Returns false if the data ends in the middle of the value
+static bool read_varint(const uint8_t *data, uint16_t length, uint16_t *pos, uint32_t *value){
+  uint32_t result = 0;
+  for(uint8_t shift = 0; *pos < length && shift < 32; shift += 7){
+    uint8_t byte = data[(*pos)++];
+    result |= (uint32_t)(byte & 0x7F) << shift;
+    if((byte & 0x80) == 0){
+      *value = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Writes one LEB128 varint at *pos and advances *pos past it
+// Returns false, writing nothing, if it would not fit
+static bool write_varint(uint8_t *data, uint16_t length, uint16_t *pos, uint32_t value){
+  uint16_t end = *pos;
+  for(uint32_t rest = value; rest >= 0x80; rest >>= 7) end++;
+  if(end >= length) return false;
+  for(; value >= 0x80; value >>= 7) data[(*pos)++] = (value & 0x7F) | 0x80;
+  data[(*pos)++] = value;
+  return true;
+}
+
+// Undoes the zig-zag mapping the phone uses to keep small negative deltas small
+static int32_t zigzag_decode(uint32_t value){
+  return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+static uint32_t zigzag_encode(int32_t value){
+  return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static void schedule_pattern_redraw(bool complete); // Defined in route window functions
+static void departures_changed(MenuItem *route); // Defined in departures window functions
+
+// Any points and stops from an earlier transmission are replaced
+// The arena is sized up front so the points, stops and their names usually share one block
+static void begin_pattern(Pattern *pattern, const PatternBounds *bounds, uint16_t points_total, uint16_t stops_total){
+  reset_pattern(pattern);
+  pattern->persisted = false;
+  pattern->bounds = *bounds;
+  pattern->points_total = points_total;
+  pattern->stops_total = stops_total;
+  if(points_total > 0){
+    uint16_t received_bytes = (points_total + stops_total + 7) / 8;
+    uint32_t needed = sizeof(GPoint) * points_total + received_bytes + sizeof(ConvexHull) + (sizeof(Stop) + STOP_NAME_ESTIMATE) * stops_total;
+    enforce_pattern_budget(needed);
+    arena_reserve(&pattern->arena, needed);
+    pattern->points = (GPoint*)arena_alloc(&pattern->arena, sizeof(GPoint) * points_total);
+    pattern->received = (uint8_t*)arena_alloc(&pattern->arena, received_bytes);
+    if(pattern->points == NULL || pattern->received == NULL){
+      reset_pattern(pattern);
+      pattern->points_total = 0;
+      return;
+    }
+    memset(pattern->received, 0, received_bytes);
+  }
+}
+
+static bool transfer_received(const Pattern *pattern, uint16_t index){
+  return (pattern->received[index >> 3] & (1 << (index & 7))) != 0;
+}
+
+// Marks an index of the transfer (a point, or a stop after the points) as in. Returns false if it already was
+static bool transfer_mark(Pattern *pattern, uint16_t index){
+  if(transfer_received(pattern, index)) return false;
+  pattern->received[index >> 3] |= 1 << (index & 7);
+  return true;
+}
+
+// Writes the runs of the transfer still missing as varint (start, count) pairs, as many as fit. Returns the bytes written
+static uint16_t transfer_missing(const Pattern *pattern, uint8_t *data, uint16_t length){
+  uint16_t total = pattern->points_total + pattern->stops_total;
+  uint16_t pos = 0;
+  uint16_t i = 0;
+  while(i < total){
+    if(transfer_received(pattern, i)){
+      i++;
+      continue;
+    }
+    uint16_t start = i;
+    while(i < total && !transfer_received(pattern, i)) i++;
+    uint16_t before = pos;
+    if(!write_varint(data, length, &pos, start) || !write_varint(data, length, &pos, i - start)){
+      pos = before;
+      break;
+    }
+  }
+  return pos;
+}
+
+// Stops often share a name, like a loop that starts and ends at the same stop, so an earlier copy is reused
+static char* intern_stop_name(Pattern *pattern, const char *name){
+  for(uint16_t i=0; i<pattern->stops_total; i++){
+    if(pattern->stops[i].name != NULL && strcmp(pattern->stops[i].name, name) == 0){
+      return pattern->stops[i].name;
+    }
+  }
+  return arena_strdup(&pattern->arena, name);
+}
+
+// Stops can arrive in any order, so unfilled entries are zeroed for intern_stop_name
+static bool alloc_pattern_stops(Pattern *pattern){
+  pattern->stops = (Stop*)arena_alloc(&pattern->arena, sizeof(Stop) * pattern->stops_total);
+  if(pattern->stops == NULL) return false;
+  memset(pattern->stops, 0, sizeof(Stop) * pattern->stops_total);
+  pattern->stops_len = 0;
+  return true;
+}
+
+// Decode a run of zig-zag varint (dx, dy) points into the pattern starting at index, in one pass
+// Points off the wire are quantized, so they get the aspect correction and the latitude flip. Cached points already had both
+// Projected points are fit to the screen by the phone, so they need neither and are kept out of the hull
+static uint32_t decode_points(Pattern *pattern, uint32_t index, const uint8_t *data, uint16_t length, bool from_wire){
+  bool projected = pattern->bounds.projected;
+  if(pattern->convex_hull == NULL && !projected){
+    pattern->convex_hull = (ConvexHull*)arena_alloc(&pattern->arena, sizeof(ConvexHull));
+    if(pattern->convex_hull == NULL) return index;
+    pattern->convex_hull->points = NULL;
+    pattern->convex_hull->points_len = 0;
+    pattern->convex_hull->points_cap = 0;
+    pattern->convex_hull->arena = &pattern->arena;
+  }
   
-  // A quick search for the route index. Easier than passing it over the wire 
-  // TODO: On second thought this sucks. :P
-  MenuItem *route = NULL;
-  for(int i=0; i<SECTIONS_LEN; i++){
-    bool broke = false;
-    for(int j=0; j<s_section_lens[i]; j++){
-      if(strcmp(route_name, s_menu_items[i][j].title) == 0){
-        route = &s_menu_items[i][j];
-        broke = true;
-        break;
-      }
-      if(broke) break;
+  int32_t point_x = 0;
+  int32_t point_y = 0;
+  uint16_t pos = 0;
+  uint32_t dx, dy;
+  int32_t aspect = from_wire && !projected ? pattern->bounds.aspect : Q16_ONE;
+  int32_t flip = from_wire && !projected ? -1 : 1;
+  while(index < pattern->points_total && read_varint(data, length, &pos, &dx) && read_varint(data, length, &pos, &dy)){
+    point_x += zigzag_decode(dx);
+    point_y += zigzag_decode(dy);
+    if(!transfer_mark(pattern, index)){
+      index++; // Sent again, and already here
+      continue;
     }
+    // Correct the longitude aspect, and flip latitude so north is up on screen
+    pattern->points[index] = GPoint((point_x * aspect) >> Q16_SHIFT, flip * point_y);
+    if(!projected && integrate_point(&pattern->points[index], pattern->convex_hull)){
+      pattern->diameter_valid = false;
+    }
+    index++;
+  }
+  // A frame after a gap waits to be drawn until the gap is filled
+  while(pattern->points_len < pattern->points_total && transfer_received(pattern, pattern->points_len)) pattern->points_len++;
+  return index;
+}
+
+static bool pattern_complete(const Pattern *pattern){
+  return pattern->points_total > 0 && pattern->points_len >= pattern->points_total && pattern->stops_len >= pattern->stops_total;
+}
+
+// Timed stops but no departures for any of them, as in a pattern whose window closed before its departures arrived
+// A timetable with nothing left for the day looks the same, so such a pattern asks again whenever it is opened
+static bool pattern_missing_times(const Pattern *pattern){
+  bool timed = false;
+  for(uint16_t i=0; i<pattern->stops_len && pattern->stops != NULL; i++){
+    if(pattern->stops[i].times_len > 0) return false;
+    timed = timed || pattern->stops[i].is_timed;
+  }
+  return timed;
+}
+
+// A transfer is watched from its header until it is complete or has been asked about too often
+static bool transfer_watched(const Pattern *pattern){
+  return pattern->received != NULL && !pattern_complete(pattern) && pattern->nack_tries <= TRANSFER_NACK_TRIES;
+}
+
+static void send_transfer_nack(MenuItem *route){
+  Pattern *pattern = route_pattern(route);
+  uint8_t ranges[TRANSFER_NACK_LEN];
+  uint16_t ranges_len = transfer_missing(pattern, ranges, sizeof(ranges));
+  LOG_DEBUG("Pattern transfer has gaps: route %d : try %d : asking for %d bytes of ranges", route->id, (int)pattern->nack_tries, (int)ranges_len);
+  send_pattern_nack(route->id, pattern->transfer_id, ranges, ranges_len);
+}
+
+static void nack_timer_callback(void *data);
+
+// A transfer asked about too often is dropped and the phone told, as for a closed route, so its memory is free
+// again and prefetching carries on. The route on screen keeps what it has until its window closes
+static void abandon_transfer(MenuItem *route){
+  LOG_DEBUG("Pattern transfer given up on: route %d", route->id);
+  if(route == s_selected_route && s_route_pattern != NULL) return;
+  send_route_closed(route->id);
+  reset_pattern(route_pattern(route));
+  if(route == s_prefetch_route){
+    s_prefetch_route = NULL;
+    schedule_prefetch();
+  }
+}
+
+// One timer serves every watched transfer, set for the one due first but no sooner than min_ms
+static void schedule_nack_timer(uint32_t min_ms){
+  uint32_t now = clock_ms();
+  bool watching = false;
+  int32_t wait = 0;
+  for(int i=0; i<ROUTES_LEN; i++){
+    if(s_routes[i] == NULL || !transfer_watched(route_pattern(s_routes[i]))) continue;
+    int32_t due = (int32_t)(route_pattern(s_routes[i])->nack_at - now);
+    if(!watching || due < wait) wait = due;
+    watching = true;
+  }
+  if(!watching){
+    if(s_nack_timer != NULL) app_timer_cancel(s_nack_timer);
+    s_nack_timer = NULL;
+    return;
+  }
+  if(wait < (int32_t)min_ms) wait = min_ms;
+  if(s_nack_timer == NULL || !app_timer_reschedule(s_nack_timer, wait)){
+    s_nack_timer = app_timer_register(wait, nack_timer_callback, NULL);
+  }
+}
+
+// Ask about the transfer overdue the longest. The outbox takes one message at a time, so any other waits its turn
+static void nack_timer_callback(void *data){
+  s_nack_timer = NULL;
+  uint32_t now = clock_ms();
+  MenuItem *route = NULL;
+  for(int i=0; i<ROUTES_LEN; i++){
+    if(s_routes[i] == NULL || !transfer_watched(route_pattern(s_routes[i]))) continue;
+    if((int32_t)(route_pattern(s_routes[i])->nack_at - now) > 0) continue;
+    if(route == NULL || (int32_t)(route_pattern(s_routes[i])->nack_at - route_pattern(route)->nack_at) < 0) route = s_routes[i];
   }
   if(route != NULL){
-    if(route->pattern->points == NULL){
-      // This is a new list transmission
-      route->pattern->points = (GPoint*)malloc(sizeof(GPoint) * list_len);
-      route->pattern->points_len = 0;
+    Pattern *pattern = route_pattern(route);
+    pattern->nack_at = now + TRANSFER_NACK_MS;
+    if(++pattern->nack_tries > TRANSFER_NACK_TRIES){
+      abandon_transfer(route);
     }
-    
-    if(route->pattern->convex_hull == NULL){
-      route->pattern->convex_hull = (ConvexHull*)malloc(sizeof(ConvexHull));
-      route->pattern->convex_hull->points = (GPoint**)malloc(sizeof(GPoint*) * list_len); //Worst case convex hull contains all points
-      route->pattern->convex_hull->points_len = 0;
+    else{
+      send_transfer_nack(route);
+    }
+  }
+  schedule_nack_timer(TRANSFER_NACK_GAP_MS);
+}
+
+// Start watching a transfer, so one whose frames are all lost is asked about too
+static void transfer_begin(MenuItem *route){
+  route_pattern(route)->nack_at = clock_ms() + TRANSFER_NACK_MS;
+  if(s_nack_timer == NULL) schedule_nack_timer(0);
+}
+
+// Called for every point frame and stop that arrives. Whatever is missing once the last of the transfer is in is asked
+// for straight away. Otherwise the transfer is asked about again if it goes quiet before it is complete
+// Every other deadline was set before this one, so a timer already running fires in time for it
+static void transfer_progress(MenuItem *route, bool reached_end){
+  Pattern *pattern = route_pattern(route);
+  pattern->nack_tries = 0;
+  if(pattern_complete(pattern)) return;
+  if(reached_end) send_transfer_nack(route);
+  pattern->nack_at = clock_ms() + TRANSFER_NACK_MS;
+  if(s_nack_timer == NULL) schedule_nack_timer(0);
+}
+
+// Decode a stop's departures: a varint count, then the first departure and the gaps after it as varints
+// The times replace any the stop had, in place when they fit, otherwise in new room in the pattern's arena
+static bool decode_stop_times(Pattern *pattern, Stop *stop, const uint8_t *data, uint16_t length, uint16_t *pos){
+  uint32_t count, minutes;
+  if(!read_varint(data, length, pos, &count)) return false;
+  stop->times_len = 0;
+  if(count > stop->times_cap){
+    stop->times = (uint16_t*)arena_alloc(&pattern->arena, sizeof(uint16_t) * count);
+    stop->times_cap = stop->times != NULL ? count : 0;
+  }
+  uint32_t time = 0;
+  for(uint32_t i=0; i<count; i++){
+    if(!read_varint(data, length, pos, &minutes)) return false;
+    time += minutes;
+    if(i < stop->times_cap) stop->times[stop->times_len++] = time;
+  }
+  return true;
+}
+
+// Once every point and stop of a transmission is in, keep the pattern for later sessions
+// A prefetched pattern is only kept once it has been viewed, so it cannot push a viewed one out of the cache
+static void finish_pattern(MenuItem *route){
+  Pattern *pattern = route_pattern(route);
+  if(!pattern->persisted && pattern_complete(pattern)){
+    LOG_DEBUG("Pattern complete: route %d : %d bytes", route->id, (int)pattern->arena.bytes);
+    if(pattern->last_viewed > 0) pattern->persisted = persist_save_pattern(route);
+    enforce_pattern_budget(0);
+    if(route == s_prefetch_route){
+      s_prefetch_route = NULL;
+      schedule_prefetch();
     }
-    route->pattern->points[index] = GPoint(point_x, point_y);
-    route->pattern->points_len++;
-    
-    integrate_point(&route->pattern->points[index], route->pattern->convex_hull);
-    s_pattern_updated = S_TRUE;
-    layer_mark_dirty(s_route_pattern);
+  }
+}
+
+// The header opens a pattern transmission with the point count and the box the points were quantized in
+static void route_pattern_header_msg_handler(const InboxMessage *message) {
+  uint32_t route_id = message->route_id;
+  PatternBounds bounds = {
+    .min_lat = message->bbox_min_lat,
+    .min_lon = message->bbox_min_lon,
+    .max_lat = message->bbox_max_lat,
+    .max_lon = message->bbox_max_lon,
+    .aspect = message->aspect,
+    .projected = message->projected != 0
+  };
+  LOG_DEBUG("Received pattern header: route %d : %d points : aspect %d : projected %d", (int)route_id, (int)message->list_len, (int)bounds.aspect, (int)bounds.projected);
+  
+  MenuItem *route = find_route(route_id);
+  if(route != NULL){
+    begin_pattern(route_pattern(route), &bounds, message->list_len, message->stops_len);
+    route_pattern(route)->transfer_id = message->transfer_id;
+    transfer_begin(route);
   }
   else{
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Pattern references non-existance route: %s", route_name);
+    LOG_TRACE("Pattern references non-existance route: %d", (int)route_id);
+  }
+}
+
+// A frame is a run of points starting at list_index, each a zig-zag varint (dx, dy) from the one before it
+// The first point in every frame is relative to (0, 0)
+static void route_pattern_points_frame_msg_handler(const InboxMessage *message) {
+  uint32_t index = message->list_index;
+  uint32_t list_len = message->list_len;
+  uint32_t route_id = message->route_id;
+  if(!INBOX_HAS(message, INBOX_FRAME_DATA)){
+    LOG_DEBUG("Pattern frame without data : route %d", (int)route_id);
+    return;
+  }
+  
+  LOG_TRACE("Received pattern frame: %d bytes : route %d : from %d of %d", message->frame_len, (int)route_id, (int)index+1, (int)list_len);
+  
+  MenuItem *route = find_route(route_id);
+  if(route == NULL){
+    LOG_TRACE("Pattern references non-existance route: %d", (int)route_id);
+    return;
+  }
+  Pattern *pattern = route_pattern(route);
+  if(pattern->received == NULL || message->transfer_id != pattern->transfer_id) return; // Not the transfer under way
+  
+  uint32_t end = decode_points(pattern, index, message->frame_data, message->frame_len, true);
+  finish_pattern(route);
+  transfer_progress(route, end >= pattern->points_total && pattern->stops_total == 0);
+  if(route == s_selected_route){
+    schedule_pattern_redraw(pattern->points_len >= pattern->points_total);
   }
   
-  if(s_pattern_loading){
+  // Frames for a prefetched route leave the route on screen alone
+  if(s_pattern_loading && route == s_selected_route){
     s_pattern_loading = S_FALSE;
     layer_set_hidden(s_route_pattern, false);
     layer_set_hidden(text_layer_get_layer(s_route_name_text), true);
   }
 }
 
-static void route_pattern_stops_msg_handler(DictionaryIterator *received, void *context) {
-  Tuple *tuple;
+static void route_pattern_stops_msg_handler(const InboxMessage *message) {
+  // The name is interned into the route's arena once the route is found
+  const char *stop_name = message->stop_name;
+  bool is_timed = message->stop_is_timed != 0;
+  uint32_t stop_point_index = message->stop_point_index;
+  uint32_t index = message->list_index;
+  uint32_t list_len = message->list_len;
+  uint32_t route_id = message->route_id;
   
-  // Save the route name on the heap for use in the menu
-  char *stop_name = "\0"; 
-  tuple = dict_find(received, MESSAGE_KEY_stop_name);
-  if(tuple){
-    stop_name = (char*)malloc(strlen(tuple->value->cstring)+1);
-    strcpy(stop_name, tuple->value->cstring);
-  }
+  LOG_TRACE("Received pattern stop: %s : timed %d : ->%d : route %d : %d of %d", stop_name, (int)is_timed, (int)stop_point_index, (int)route_id, (int)index+1, (int)list_len);
   
-  bool is_timed = false; 
-  tuple = dict_find(received, MESSAGE_KEY_stop_is_timed);
-  if(tuple){
-    is_timed = tuple->value->uint8;
+  MenuItem *route = find_route(route_id);
+  if(route == NULL){
+    LOG_TRACE("Pattern references non-existance route: %d", (int)route_id);
+    return;
+  }
+  Pattern *pattern = route_pattern(route);
+  if(pattern->received == NULL || message->transfer_id != pattern->transfer_id || index >= pattern->stops_total) return;
+  if(pattern->stops == NULL){
+    // This is a new list transmission
+    if(!alloc_pattern_stops(pattern)) return;
   }
+  if(transfer_mark(pattern, pattern->points_total + index)){
+    pattern->stops[index].is_timed = is_timed;
+    pattern->stops[index].name = intern_stop_name(pattern, stop_name);
+    pattern->stops[index].point_index = stop_point_index;
+    pattern->stops_len++;
+    finish_pattern(route);
+    departures_changed(route);
+  }
+  transfer_progress(route, index + 1 >= pattern->stops_total);
+}
   
-  uint32_t stop_point_index = 0;
-  tuple = dict_find(received, MESSAGE_KEY_stop_point_index);
-  if(tuple){
-    stop_point_index = tuple->value->uint32;
+// The timetable of a pattern's timed stops, as records of a varint stop index followed by the stop's departures
+// It can take a few messages. Once the last is in the pattern is saved again, so the times work offline all day
+static void stop_times_msg_handler(const InboxMessage *message) {
+  uint32_t route_id = message->route_id;
+  uint32_t index = message->list_index;
+  uint32_t list_len = message->list_len;
+  
+  MenuItem *route = find_route(route_id);
+  if(!INBOX_HAS(message, INBOX_FRAME_DATA) || route == NULL || route_pattern(route)->stops == NULL) return;
+  
+  Pattern *pattern = route_pattern(route);
+  if(message->transfer_id != pattern->transfer_id) return; // The times of a pattern since replaced
+  const uint8_t *records = message->frame_data;
+  uint16_t pos = 0;
+  uint32_t stop_index;
+  while(read_varint(records, message->frame_len, &pos, &stop_index) && stop_index < pattern->stops_total){
+    if(!decode_stop_times(pattern, &pattern->stops[stop_index], records, message->frame_len, &pos)) break;
   }
+  LOG_TRACE("Received stop times: route %d : %d of %d", (int)route_id, (int)index+1, (int)list_len);
   
-  uint32_t index = 0; 
-  tuple = dict_find(received, MESSAGE_KEY_list_index);
-  if(tuple){
-    index = tuple->value->uint32;
+  if(index + 1 >= list_len){
+    pattern->persisted = false;
+    finish_pattern(route);
   }
+  departures_changed(route);
+}
+
+// Vehicle updates only carry what changed: records of a varint (number << 2 | op), followed by zig-zag varints of the
+// position for an added vehicle or of the change in position for a moved one
+static void vehicles_msg_handler(const InboxMessage *message) {
+  if(!INBOX_HAS(message, INBOX_FRAME_DATA) || s_selected_route == NULL || s_selected_route->id != message->route_id) return;
   
-  uint32_t list_len = 0; 
-  tuple = dict_find(received, MESSAGE_KEY_list_len);
-  if(tuple){
-    list_len = tuple->value->uint32;
+  const uint8_t *updates = message->frame_data;
+  uint16_t length = message->frame_len;
+  uint16_t pos = 0;
+  uint32_t record, x, y;
+  while(read_varint(updates, length, &pos, &record)){
+    uint32_t number = record >> 2;
+    uint32_t op = record & 3;
+    if(number >= VEHICLES_LEN) break;
+    Vehicle *vehicle = &s_vehicles[number];
+    if(op == VEHICLE_REMOVED){
+      vehicle->active = false;
+      continue;
+    }
+    if(!read_varint(updates, length, &pos, &x) || !read_varint(updates, length, &pos, &y)) break;
+    if(op == VEHICLE_ADDED){
+      vehicle->position = GPoint(zigzag_decode(x), zigzag_decode(y));
+      vehicle->active = true;
+    }
+    else if(op == VEHICLE_MOVED){
+      vehicle->position.x += zigzag_decode(x);
+      vehicle->position.y += zigzag_decode(y);
+    }
   }
+  if(s_route_pattern != NULL) layer_mark_dirty(s_route_pattern);
+}
+
+static void nearby_changed(); // Defined in nearby window functions
+
+// A new stop index replaces the old one. Its cell table and stops are allocated here and filled by the stops that follow
+static void nearby_index_msg_handler(const InboxMessage *message) {
+  uint32_t hash = message->nearby_hash;
+  uint32_t list_len = message->list_len;
+  uint32_t cols = message->grid_cols;
+  uint32_t rows = message->grid_rows;
+  uint32_t cell = message->grid_cell;
+  LOG_DEBUG("Received stop index: %d stops : %d x %d cells of %d m", (int)list_len, (int)cols, (int)rows, (int)cell);
   
-  // Dont store short name on heap here
-  char *route_name = "ERROR"; 
-  tuple = dict_find(received, MESSAGE_KEY_route_short_name);
-  if(tuple){
-    route_name = tuple->value->cstring;
+  StopIndex *index = &s_stop_index;
+  arena_reset(&index->arena);
+  memset(index, 0, sizeof(StopIndex));
+  if(cols * rows == 0 || cols * rows > NEARBY_CELLS_MAX || cell == 0 || list_len > NEARBY_STOPS_LEN) return;
+  
+  uint32_t needed = sizeof(uint16_t) * (cols * rows + 1) + (sizeof(NearbyStop) + STOP_NAME_ESTIMATE) * list_len;
+  if(heap_bytes_free() < HEAP_FREE_RESERVE + needed){
+    LOG_DEBUG("No room for the stop index: %d bytes : %d bytes of heap free", (int)needed, (int)heap_bytes_free());
+    return;
+  }
+  arena_reserve(&index->arena, needed);
+  index->cell_starts = (uint16_t*)arena_alloc(&index->arena, sizeof(uint16_t) * (cols * rows + 1));
+  index->stops = (NearbyStop*)arena_alloc(&index->arena, sizeof(NearbyStop) * list_len);
+  if(index->cell_starts == NULL || index->stops == NULL){
+    arena_reset(&index->arena);
+    memset(index, 0, sizeof(StopIndex));
+    return;
   }
+  index->hash = hash;
+  index->cols = cols;
+  index->rows = rows;
+  index->cell = cell;
+  index->stops_total = list_len;
+  nearby_changed();
+}
+
+// Stops come in cell order as records of a varint cell (the change from the record before, except for the first in a
+// message), varint offsets east and north of the cell's corner, a count and that many route IDs, then the name
+static void nearby_stops_msg_handler(const InboxMessage *message) {
+  StopIndex *index = &s_stop_index;
+  if(!INBOX_HAS(message, INBOX_FRAME_DATA) || index->stops == NULL || message->list_index != index->stops_len) return;
   
-  APP_LOG(APP_LOG_LEVEL_DEBUG, "Received pattern stop: %s : timed %d : ->%d : route %s : %d of %d", stop_name, (int)is_timed, (int)stop_point_index, route_name, (int)index+1, (int)list_len);
+  const uint8_t *data = message->frame_data;
+  uint16_t length = message->frame_len;
+  uint16_t pos = 0;
+  uint32_t cells = index->cols * index->rows;
+  uint32_t cell = 0, delta, x, y, routes_len;
+  bool first = true;
+  while(index->stops_len < index->stops_total && read_varint(data, length, &pos, &delta)){
+    cell = first ? delta : cell + delta;
+    first = false;
+    if(cell >= cells || cell + 1 < index->cells_filled) break; // Out of the grid or out of order
+    if(!read_varint(data, length, &pos, &x) || !read_varint(data, length, &pos, &y)) break;
+    if(!read_varint(data, length, &pos, &routes_len) || pos + routes_len >= length) break;
+    
+    NearbyStop *stop = &index->stops[index->stops_len];
+    stop->position = GPoint((cell % index->cols) * index->cell + x, (cell / index->cols) * index->cell + y);
+    stop->routes_len = routes_len;
+    stop->routes = routes_len > 0 ? (uint8_t*)arena_alloc(&index->arena, routes_len) : NULL;
+    if(routes_len > 0 && stop->routes == NULL){
+      LOG_WARNING("No room for the stop index: stop %d of %d", (int)index->stops_len, (int)index->stops_total);
+      break;
+    }
+    memcpy(stop->routes, &data[pos], routes_len);
+    pos += routes_len;
+    
+    const uint8_t *end = memchr(&data[pos], '\0', length - pos);
+    if(end == NULL) break;
+    // arena_strdup gives the empty string when there is no room, so only an empty copy of a name is a failure
+    stop->name = arena_strdup(&index->arena, (const char*)&data[pos]);
+    if(stop->name[0] == '\0' && data[pos] != '\0'){
+      LOG_WARNING("No room for the stop index: stop %d of %d", (int)index->stops_len, (int)index->stops_total);
+      break;
+    }
+    pos = end - data + 1;
+    
+    while(index->cells_filled <= cell) index->cell_starts[index->cells_filled++] = index->stops_len;
+    index->stops_len++;
+  }
+  if(index->stops_len == index->stops_total){
+    while(index->cells_filled <= cells) index->cell_starts[index->cells_filled++] = index->stops_total;
+    LOG_DEBUG("Stop index complete: %d stops : %d bytes", (int)index->stops_total, (int)index->arena.bytes);
+  }
+  nearby_changed();
+}
+
+// The user's position in the stop index's meters, or no position at all if the phone could not get one
+static void nearby_position_msg_handler(const InboxMessage *message) {
+  s_nearby_located = INBOX_HAS(message, INBOX_POSITION_X) && INBOX_HAS(message, INBOX_POSITION_Y) ? S_TRUE : S_FALSE;
+  if(s_nearby_located){
+    s_nearby_position = GPoint(message->position_x, message->position_y);
+  }
+  s_nearby_lost = !s_nearby_located;
+  LOG_TRACE("Received position: %d, %d : located %d", s_nearby_position.x, s_nearby_position.y, (int)s_nearby_located);
+  nearby_changed();
+}
+
+static void routes_current_msg_handler(const InboxMessage *message) {
+  LOG_DEBUG("Cached route catalog is current");
+}
+
+typedef void (*InboxHandler)(const InboxMessage *message);
+
+// Handlers by message type. Types only the watch sends are left empty
+static const InboxHandler s_inbox_handlers[] = {
+  [MESSAGE_STATUS] = status_msg_handler,
+  [MESSAGE_ROUTES] = routes_msg_handler,
+  [MESSAGE_ROUTES_CURRENT] = routes_current_msg_handler,
+  [MESSAGE_ROUTE_PATTERN_HEADER] = route_pattern_header_msg_handler,
+  [MESSAGE_ROUTE_PATTERN_POINTS_FRAME] = route_pattern_points_frame_msg_handler,
+  [MESSAGE_ROUTE_PATTERN_STOPS] = route_pattern_stops_msg_handler,
+  [MESSAGE_VEHICLES] = vehicles_msg_handler,
+  [MESSAGE_STOP_TIMES] = stop_times_msg_handler,
+  [MESSAGE_NEARBY] = nearby_index_msg_handler,
+  [MESSAGE_NEARBY_STOPS] = nearby_stops_msg_handler,
+  [MESSAGE_NEARBY_POSITION] = nearby_position_msg_handler
+};
+
+// Called when a message is received from PebbleKitJS
+static void in_received_handler(DictionaryIterator *received, void *context) {
+  uint32_t start = clock_ms();
+  InboxMessage message;
+  uint16_t bytes = decode_inbox(received, &message);
   
-  // A quick search for the route index. Easier than passing it over the wire 
-  // TODO: On second thought this sucks. :P
-  MenuItem *route = NULL;
-  for(int i=0; i<SECTIONS_LEN; i++){
-    bool broke = false;
-    for(int j=0; j<s_section_lens[i]; j++){
-      if(strcmp(route_name, s_menu_items[i][j].title) == 0){
-        route = &s_menu_items[i][j];
-        broke = true;
-        break;
+  uint32_t msg_type = message.message_type;
+  if(INBOX_HAS(&message, INBOX_MESSAGE_TYPE) && msg_type < ARRAY_LENGTH(s_inbox_handlers) && s_inbox_handlers[msg_type] != NULL){
+    s_inbox_handlers[msg_type](&message);
+  }
+  else{
+    LOG_DEBUG("Recieved a message of unexpected type: %d", (int)msg_type);
+  }
+  counters_add_message(bytes, start);
+}
+
+// Called when an incoming message from PebbleKitJS is dropped
+static void in_dropped_handler(AppMessageResult reason, void *context) {	
+  s_counters.dropped++;
+  LOG_WARNING("Inbox dropped a message: reason %d", (int)reason);
+}
+
+//========================================= PERSISTENT CACHE ======================================================
+// A cursor over a blob being written or read. With no data it only counts, so a blob can be sized before it is
+// allocated. Reads past the end clear ok instead of overrunning
+typedef struct {
+  uint8_t *data;
+  uint16_t length;
+  uint16_t pos;
+  bool ok;
+} BlobCursor;
+
+// A pattern cache slot, kept in a small index so finding a route's pattern does not read every slot
+typedef struct {
+  uint8_t route_id;
+  uint32_t service_date; // yyyymmdd, 0 when the slot is empty
+  uint32_t last_used;
+} PatternCacheEntry;
+
+static void blob_put_bytes(BlobCursor *cursor, const void *bytes, uint16_t size){
+  if(cursor->data != NULL && cursor->pos + size <= cursor->length){
+    memcpy(&cursor->data[cursor->pos], bytes, size);
+  }
+  cursor->pos += size;
+}
+
+static void blob_put_u8(BlobCursor *cursor, uint8_t value){
+  blob_put_bytes(cursor, &value, sizeof(value));
+}
+
+static void blob_put_u16(BlobCursor *cursor, uint16_t value){
+  blob_put_bytes(cursor, &value, sizeof(value));
+}
+
+static void blob_put_u32(BlobCursor *cursor, uint32_t value){
+  blob_put_bytes(cursor, &value, sizeof(value));
+}
+
+#define BLOB_STRING_MAX UINT8_MAX
+
+static void blob_put_string(BlobCursor *cursor, const char *string){
+  uint8_t len = strlen(string) < BLOB_STRING_MAX ? strlen(string) : BLOB_STRING_MAX;
+  blob_put_u8(cursor, len);
+  blob_put_bytes(cursor, string, len);
+}
+
+static void blob_put_varint(BlobCursor *cursor, uint32_t value){
+  while(value >= 0x80){
+    blob_put_u8(cursor, (value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  blob_put_u8(cursor, value);
+}
+
+static bool blob_get_bytes(BlobCursor *cursor, void *bytes, uint16_t size){
+  if(!cursor->ok || cursor->pos + size > cursor->length){
+    cursor->ok = false;
+    memset(bytes, 0, size);
+    return false;
+  }
+  memcpy(bytes, &cursor->data[cursor->pos], size);
+  cursor->pos += size;
+  return true;
+}
+
+static uint8_t blob_get_u8(BlobCursor *cursor){
+  uint8_t value;
+  blob_get_bytes(cursor, &value, sizeof(value));
+  return value;
+}
+
+static uint16_t blob_get_u16(BlobCursor *cursor){
+  uint16_t value;
+  blob_get_bytes(cursor, &value, sizeof(value));
+  return value;
+}
+
+static uint32_t blob_get_u32(BlobCursor *cursor){
+  uint32_t value;
+  blob_get_bytes(cursor, &value, sizeof(value));
+  return value;
+}
+
+// Reads a string into a buffer of at least BLOB_STRING_MAX + 1 bytes. It is left empty if there is nothing to read
+static void blob_get_string(BlobCursor *cursor, char *string){
+  uint8_t len = blob_get_u8(cursor);
+  if(!blob_get_bytes(cursor, string, len)) len = 0;
+  string[len] = '\0';
+}
+
+static uint16_t blob_chunks(int length){
+  return length <= 0 ? 0 : (length + PERSIST_DATA_MAX_LENGTH - 1) / PERSIST_DATA_MAX_LENGTH;
+}
+
+static void persist_delete_blob(uint32_t base_key){
+  if(persist_exists(base_key)){
+    uint16_t chunks = blob_chunks(persist_read_int(base_key));
+    persist_delete(base_key);
+    for(uint16_t i=0; i<chunks; i++){
+      persist_delete(base_key + 1 + i);
+    }
+  }
+}
+
+// The length is written last, so a blob cut off part way through is never read back
+static bool persist_write_blob(uint32_t base_key, const uint8_t *data, uint16_t length){
+  persist_delete_blob(base_key);
+  for(uint16_t i=0; i<blob_chunks(length); i++){
+    uint16_t offset = i * PERSIST_DATA_MAX_LENGTH;
+    uint16_t size = length - offset < PERSIST_DATA_MAX_LENGTH ? length - offset : PERSIST_DATA_MAX_LENGTH;
+    if(persist_write_data(base_key + 1 + i, &data[offset], size) != size){
+      LOG_WARNING("Ran out of storage writing blob %d", (int)base_key);
+      for(uint16_t j=0; j<=i; j++){
+        persist_delete(base_key + 1 + j);
       }
-      if(broke) break;
+      return false;
     }
   }
-  if(route != NULL){
-    if(route->pattern->stops == NULL){
-      // This is a new list transmission
-      route->pattern->stops = (Stop*)malloc(sizeof(Stop) * list_len);
-      route->pattern->stops_len = 0;
+  return persist_write_int(base_key, length) >= 0;
+}
+
+// Read a blob back into a new heap buffer. Returns NULL if it is missing or damaged
+static uint8_t* persist_read_blob(uint32_t base_key, uint16_t *length){
+  if(!persist_exists(base_key)) return NULL;
+  *length = persist_read_int(base_key);
+  uint8_t *data = (uint8_t*)malloc(*length);
+  if(data == NULL) return NULL;
+  for(uint16_t i=0; i<blob_chunks(*length); i++){
+    uint16_t offset = i * PERSIST_DATA_MAX_LENGTH;
+    uint16_t size = *length - offset < PERSIST_DATA_MAX_LENGTH ? *length - offset : PERSIST_DATA_MAX_LENGTH;
+    if(persist_read_data(base_key + 1 + i, &data[offset], size) != size){
+      free(data);
+      return NULL;
     }
-    route->pattern->stops[index].is_timed = is_timed;
-    route->pattern->stops[index].name = stop_name;
-    route->pattern->stops[index].point_index = stop_point_index;
-    route->pattern->stops_len++;
   }
-  else{
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Pattern references non-existance route: %s", route_name);
+  return data;
+}
+
+// The service day as yyyymmdd. Patterns are only good for the service day they were fetched for
+// Like service_minute, the day before lasts until the rollover
+static uint32_t service_date(){
+  time_t now = time(NULL) - SERVICE_DAY_ROLLOVER_MIN * 60;
+  struct tm *local = localtime(&now);
+  return (local->tm_year + 1900) * 10000 + (local->tm_mon + 1) * 100 + local->tm_mday;
+}
+
+// Drop everything cached by an older layout of the storage
+static void persist_check_version(){
+  if(persist_exists(PERSIST_KEY_VERSION) && persist_read_int(PERSIST_KEY_VERSION) == PERSIST_VERSION) return;
+  persist_delete_blob(PERSIST_KEY_CATALOG);
+  persist_clear_patterns();
+  persist_write_int(PERSIST_KEY_VERSION, PERSIST_VERSION);
+}
+
+// Catalog layout: hash, then the catalog blob as the phone sent it
+static bool persist_save_catalog(){
+  BlobCursor cursor = { NULL, sizeof(uint32_t) + s_catalog_len, 0, true };
+  cursor.data = (uint8_t*)malloc(cursor.length);
+  if(cursor.data == NULL) return false;
+  blob_put_u32(&cursor, s_catalog_hash);
+  blob_put_bytes(&cursor, s_catalog, s_catalog_len);
+  bool saved = persist_write_blob(PERSIST_KEY_CATALOG, cursor.data, cursor.length);
+  free(cursor.data);
+  LOG_DEBUG("Saved route catalog: %d bytes : %s", cursor.length, saved ? "ok" : "failed");
+  return saved;
+}
+
+// Fill the menu from the cached catalog. The phone is still asked for routes, but only to revalidate this
+static bool persist_load_catalog(){
+  BlobCursor cursor = { NULL, 0, 0, true };
+  cursor.data = persist_read_blob(PERSIST_KEY_CATALOG, &cursor.length);
+  if(cursor.data == NULL) return false;
+  
+  s_catalog_hash = blob_get_u32(&cursor);
+  if(cursor.ok){
+    s_catalog_len = cursor.length - cursor.pos;
+    s_catalog = (uint8_t*)arena_alloc(&s_catalog_arena, s_catalog_len);
+    cursor.ok = s_catalog != NULL && blob_get_bytes(&cursor, s_catalog, s_catalog_len) && attach_catalog();
+    s_catalog_received = s_catalog_len;
+  }
+  free(cursor.data);
+  
+  if(!cursor.ok){
+    // Damaged, so forget it and wait for the phone
+    LOG_WARNING("Cached route catalog is damaged");
+    destroy_menu_items();
+    s_catalog_hash = 0;
+    persist_delete_blob(PERSIST_KEY_CATALOG);
+    return false;
+  }
+  return true;
+}
+
+static void persist_read_pattern_index(PatternCacheEntry *entries){
+  memset(entries, 0, sizeof(PatternCacheEntry) * PATTERN_CACHE_SLOTS);
+  if(persist_exists(PERSIST_KEY_PATTERN_INDEX)){
+    persist_read_data(PERSIST_KEY_PATTERN_INDEX, entries, sizeof(PatternCacheEntry) * PATTERN_CACHE_SLOTS);
   }
 }
+
+static void persist_clear_patterns(){
+  for(int i=0; i<PATTERN_CACHE_SLOTS; i++){
+    persist_delete_blob(PERSIST_KEY_PATTERN_SLOT(i));
+  }
+  persist_delete(PERSIST_KEY_PATTERN_INDEX);
+}
+
+// Pattern layout: bounds, point count, byte length and zig-zag varint deltas of the points, then the stops
+static void write_pattern(BlobCursor *cursor, Pattern *pattern){
+  blob_put_bytes(cursor, &pattern->bounds, sizeof(pattern->bounds));
+  blob_put_u16(cursor, pattern->points_len);
   
-// Called when a message is received from PebbleKitJS
-static void in_received_handler(DictionaryIterator *received, void *context) {
-	Tuple *tuple;
-  
-	tuple = dict_find(received, MESSAGE_KEY_message_type);
-	if(tuple) {
-    uint8_t msg_type = tuple->value->uint8;
-    switch(msg_type){
-      case MESSAGE_STATUS : 
-        status_msg_handler(received, context);
-      break;
-      
-      case MESSAGE_ROUTES :
-        routes_msg_handler(received, context);
-      break;
-      
-      case MESSAGE_ROUTE_PATTERN_POINTS :
-        route_pattern_points_msg_handler(received, context);
-      break;
-      
-      case MESSAGE_ROUTE_PATTERN_STOPS :
-        route_pattern_stops_msg_handler(received, context);
-      break;
-      
-      default :
-        APP_LOG(APP_LOG_LEVEL_DEBUG, "Recieved a message of unexpected type: %d", msg_type);
+  // The points are written twice, first only to count their bytes
+  BlobCursor counter = { NULL, 0, 0, true };
+  for(int pass=0; pass<2; pass++){
+    BlobCursor *out = pass == 0 ? &counter : cursor;
+    if(pass == 1) blob_put_u16(cursor, counter.pos);
+    GPoint prev = GPointZero;
+    for(uint16_t i=0; i<pattern->points_len; i++){
+      int32_t dx = pattern->points[i].x - prev.x;
+      int32_t dy = pattern->points[i].y - prev.y;
+      blob_put_varint(out, zigzag_encode(dx));
+      blob_put_varint(out, zigzag_encode(dy));
+      prev = pattern->points[i];
+    }
+  }
+  
+  blob_put_u16(cursor, pattern->stops_len);
+  for(uint16_t i=0; i<pattern->stops_len; i++){
+    blob_put_u16(cursor, pattern->stops[i].point_index);
+    blob_put_u8(cursor, pattern->stops[i].is_timed);
+    blob_put_string(cursor, pattern->stops[i].name);
+    // Departures are kept like they came off the wire
+    blob_put_varint(cursor, pattern->stops[i].times_len);
+    uint16_t prev = 0;
+    for(uint16_t j=0; j<pattern->stops[i].times_len; j++){
+      blob_put_varint(cursor, pattern->stops[i].times[j] - prev);
+      prev = pattern->stops[i].times[j];
+    }
+  }
+}
+
+// Keep a fully received pattern, replacing this route's slot or else the least recently used one
+static bool persist_save_pattern(MenuItem *route){
+  PatternCacheEntry entries[PATTERN_CACHE_SLOTS];
+  persist_read_pattern_index(entries);
+  int slot = 0;
+  for(int i=0; i<PATTERN_CACHE_SLOTS; i++){
+    if(entries[i].service_date != 0 && entries[i].route_id == route->id){
+      slot = i;
       break;
     }
-	}
+    if(entries[i].last_used < entries[slot].last_used) slot = i;
+  }
+  
+  BlobCursor cursor = { NULL, 0, 0, true };
+  write_pattern(&cursor, route_pattern(route));
+  cursor.length = cursor.pos;
+  cursor.pos = 0;
+  cursor.data = (uint8_t*)malloc(cursor.length);
+  if(cursor.data == NULL) return false;
+  write_pattern(&cursor, route_pattern(route));
+  
+  // Free the slot first so a failed write cannot leave the index pointing at a stale pattern
+  entries[slot].service_date = 0;
+  persist_write_data(PERSIST_KEY_PATTERN_INDEX, entries, sizeof(entries));
+  bool saved = persist_write_blob(PERSIST_KEY_PATTERN_SLOT(slot), cursor.data, cursor.length);
+  free(cursor.data);
+  if(saved){
+    entries[slot].route_id = route->id;
+    entries[slot].service_date = service_date();
+    entries[slot].last_used = time(NULL);
+    persist_write_data(PERSIST_KEY_PATTERN_INDEX, entries, sizeof(entries));
+  }
+  LOG_DEBUG("Saved pattern: route %d : slot %d : %d bytes : %s", route->id, slot, cursor.length, saved ? "ok" : "failed");
+  return saved;
 }
 
-// Called when an incoming message from PebbleKitJS is dropped
-static void in_dropped_handler(AppMessageResult reason, void *context) {	
+// Load today's pattern for a route from the cache. Returns false if there is none
+static bool persist_load_pattern(MenuItem *route){
+  PatternCacheEntry entries[PATTERN_CACHE_SLOTS];
+  persist_read_pattern_index(entries);
+  uint32_t today = service_date();
+  int slot = -1;
+  for(int i=0; i<PATTERN_CACHE_SLOTS; i++){
+    if(entries[i].route_id == route->id && entries[i].service_date == today){
+      slot = i;
+      break;
+    }
+  }
+  if(slot < 0) return false;
+  
+  BlobCursor cursor = { NULL, 0, 0, true };
+  cursor.data = persist_read_blob(PERSIST_KEY_PATTERN_SLOT(slot), &cursor.length);
+  if(cursor.data == NULL) return false;
+  
+  Pattern *pattern = route_pattern(route);
+  PatternBounds bounds;
+  blob_get_bytes(&cursor, &bounds, sizeof(bounds));
+  uint16_t points_len = blob_get_u16(&cursor);
+  uint16_t points_bytes = blob_get_u16(&cursor);
+  if(cursor.ok && cursor.pos + points_bytes <= cursor.length){
+    // The stop count follows the points. The pattern is begun with it, so the received bitmap has room for every stop
+    BlobCursor stops_cursor = cursor;
+    stops_cursor.pos += points_bytes;
+    uint16_t stops_total = blob_get_u16(&stops_cursor);
+    begin_pattern(pattern, &bounds, points_len, stops_total);
+    pattern->transfer_id = 0; // The phone numbers its transfers from 1, so only departures asked for with 0 belong here
+    decode_points(pattern, 0, &cursor.data[cursor.pos], points_bytes, false);
+    cursor.pos += points_bytes;
+    blob_get_u16(&cursor); // stops_total, read above
+    
+    if(pattern->stops_total > 0 && !alloc_pattern_stops(pattern)){
+      cursor.ok = false;
+    }
+    for(uint16_t i=0; i<pattern->stops_total && cursor.ok; i++){
+      char name[BLOB_STRING_MAX + 1];
+      pattern->stops[i].point_index = blob_get_u16(&cursor);
+      pattern->stops[i].is_timed = blob_get_u8(&cursor);
+      blob_get_string(&cursor, name);
+      pattern->stops[i].name = intern_stop_name(pattern, name);
+      if(!decode_stop_times(pattern, &pattern->stops[i], cursor.data, cursor.length, &cursor.pos)) cursor.ok = false;
+      if(pattern->received != NULL) transfer_mark(pattern, pattern->points_total + i);
+      pattern->stops_len++;
+    }
+  }
+  else{
+    cursor.ok = false;
+  }
+  free(cursor.data);
+  
+  if(!cursor.ok || pattern->points_len != pattern->points_total){
+    LOG_WARNING("Cached pattern for route %d is damaged", route->id);
+    begin_pattern(pattern, &bounds, 0, 0);
+    persist_delete_blob(PERSIST_KEY_PATTERN_SLOT(slot));
+    return false;
+  }
+  pattern->persisted = true;
+  entries[slot].last_used = time(NULL);
+  persist_write_data(PERSIST_KEY_PATTERN_INDEX, entries, sizeof(entries));
+  return true;
 }
 
 //========================================= MENU CALLBACKS ======================================================
+// Menu sections after NEARBY_SECTION are the route sections, one down
 static uint16_t menu_get_num_sections_callback(MenuLayer *menu_layer, void *context){
-  return SECTIONS_LEN;
+  return SECTIONS_LEN + 1;
 }
 
 static uint16_t menu_get_num_rows_callback(MenuLayer *menu_layer, uint16_t section_index, void *context) {
-  return s_section_lens[section_index];
+  if(section_index == NEARBY_SECTION) return 1;
+  return s_section_lens[section_index - 1];
 }
 
 static int16_t menu_get_header_height_callback(MenuLayer *menu_layer, uint16_t section_index, void *context) {
-  return MENU_CELL_BASIC_HEADER_HEIGHT;
+  return section_index == NEARBY_SECTION ? 0 : MENU_CELL_BASIC_HEADER_HEIGHT;
 }
 
 static void menu_draw_header_callback(GContext* gctx, const Layer *cell_layer, uint16_t section_index, void *context) {
-  if(s_section_lens[section_index] > 0){
-    menu_cell_basic_header_draw(gctx, cell_layer, s_section_titles[section_index]);
+  if(section_index != NEARBY_SECTION && s_section_lens[section_index - 1] > 0){
+    menu_cell_basic_header_draw(gctx, cell_layer, s_section_titles[section_index - 1]);
   }
 }
 
 static void menu_draw_row_callback(GContext* gctx, const Layer *cell_layer, MenuIndex *cell_index, void *context) {
-  uint16_t i = cell_index->section;
+  if(cell_index->section == NEARBY_SECTION){
+    #ifdef PBL_COLOR
+    if (menu_layer_is_index_selected(s_menu_layer, cell_index)) {
+      menu_layer_set_highlight_colors(s_menu_layer, GColorBlack, GColorWhite);
+    }
+    #endif
+    menu_cell_basic_draw(gctx, cell_layer, "Nearby", "Stops closest to you", NULL);
+    return;
+  }
+  uint16_t i = cell_index->section - 1;
   uint16_t j = cell_index->row;
   MenuItem *item = &s_menu_items[i][j];
   #ifdef PBL_COLOR
   if (menu_layer_is_index_selected(s_menu_layer, cell_index)) {
-    menu_layer_set_highlight_colors(s_menu_layer, GColorFromRGB(item->color_rgb[0], item->color_rgb[1], item->color_rgb[2]), GColorWhite);
+    menu_layer_set_highlight_colors(s_menu_layer, (GColor8){ .argb = item->color }, GColorWhite);
   }
   #endif
-  menu_cell_basic_draw(gctx, cell_layer, item->title, item->subtitle, NULL);
+  menu_cell_basic_draw(gctx, cell_layer, catalog_string(item->title), catalog_string(item->subtitle), NULL);
 }
 
 static void enter_route_window(); // Defined in route window functions
+static void enter_nearby_window(); // Defined in nearby window functions
 static void menu_select_callback(MenuLayer *menu_layer, MenuIndex *cell_index, void *context) {
-  uint16_t i = cell_index->section;
+  if(cell_index->section == NEARBY_SECTION){
+    enter_nearby_window();
+    return;
+  }
+  uint16_t i = cell_index->section - 1;
   uint16_t j = cell_index->row;
   s_selected_route = &s_menu_items[i][j];
   enter_route_window();
 }
 
+static void enter_departures_window(); // Defined in departures window functions
+static void menu_select_long_callback(MenuLayer *menu_layer, MenuIndex *cell_index, void *context) {
+  if(cell_index->section == NEARBY_SECTION) return;
+  uint16_t i = cell_index->section - 1;
+  uint16_t j = cell_index->row;
+  s_selected_route = &s_menu_items[i][j];
+  enter_departures_window();
+}
+
+// The menu item offset rows from index, counting across sections. NULL past either end of the menu
+// The nearby row counts as the row just before the first route
+static MenuItem* menu_item_offset(MenuIndex index, int offset){
+  int section = index.section - 1;
+  int row = index.row + offset;
+  if(index.section == NEARBY_SECTION){
+    section = 0;
+    row = offset - 1;
+  }
+  while(section >= 0 && section < SECTIONS_LEN){
+    if(row < 0){
+      section--;
+      if(section >= 0) row += s_section_lens[section];
+    }
+    else if(row >= s_section_lens[section]){
+      row -= s_section_lens[section];
+      section++;
+    }
+    else{
+      return &s_menu_items[section][row];
+    }
+  }
+  return NULL;
+}
+
+// A pattern is still arriving, so a prefetch would only compete with it for the link
+// One given up on is not arriving any more, whether or not it was dropped
+static bool pattern_transfer_active(){
+  if(s_pattern_loading || s_prefetch_route != NULL) return true;
+  for(int i=0; i<ROUTES_LEN; i++){
+    if(s_routes[i] != NULL && transfer_watched(route_pattern(s_routes[i]))) return true;
+  }
+  return false;
+}
+
+// Make the pattern of one row next to the selection resident, nearest rows first
+// A cached pattern is loaded from storage, otherwise one is requested from the phone and the next waits for it to finish
+static void prefetch_neighbours(){
+  if(s_menu_loading || window_stack_get_top_window() != s_menu_window || pattern_transfer_active()) return;
+  
+  MenuIndex selected = menu_layer_get_selected_index(s_menu_layer);
+  uint32_t needed = sizeof(GPoint) * PATTERN_LEN + (sizeof(Stop) + STOP_NAME_ESTIMATE) * STOPS_LEN;
+  for(int offset=1; offset<=PREFETCH_ROWS; offset++){
+    for(int side=-1; side<=1; side+=2){
+      MenuItem *route = menu_item_offset(selected, side * offset);
+      if(route == NULL || pattern_complete(route_pattern(route))) continue;
+      // Prefetching never evicts, it only uses room the budget has left
+      if(patterns_bytes() + needed > PATTERN_HEAP_BUDGET || heap_bytes_free() < HEAP_FREE_RESERVE + needed) return;
+      if(persist_load_pattern(route)) continue;
+      
+      LOG_DEBUG("Prefetching pattern: route %d", route->id);
+      s_prefetch_route = route;
+      request_route_prefetch(route->id);
+      return;
+    }
+  }
+}
+
+static void prefetch_timer_callback(void *data){
+  s_prefetch_timer = NULL;
+  prefetch_neighbours();
+}
+
+// Prefetch once the menu has been left alone for a while
+static void schedule_prefetch(){
+  if(s_prefetch_timer == NULL || !app_timer_reschedule(s_prefetch_timer, PREFETCH_IDLE_MS)){
+    s_prefetch_timer = app_timer_register(PREFETCH_IDLE_MS, prefetch_timer_callback, NULL);
+  }
+}
+
+// A new selection starts a new idle period. A prefetch the phone never answered is given up on here
+static void menu_selection_changed_callback(MenuLayer *menu_layer, MenuIndex new_index, MenuIndex old_index, void *context) {
+  s_prefetch_route = NULL;
+  schedule_prefetch();
+}
+
 #ifdef PBL_ROUND 
 static int16_t get_cell_height_callback(MenuLayer *menu_layer, MenuIndex *cell_index, void *callback_context) {
   if (menu_layer_is_index_selected(menu_layer, cell_index)) {
@@ -649,6 +2436,8 @@ static void menu_window_load(Window *window) {
     .draw_header = menu_draw_header_callback,
     .draw_row = menu_draw_row_callback,
     .select_click = menu_select_callback,
+    .select_long_click = menu_select_long_callback,
+    .selection_changed = menu_selection_changed_callback,
     .get_cell_height = PBL_IF_ROUND_ELSE(get_cell_height_callback, NULL),
   });
   
@@ -657,86 +2446,301 @@ static void menu_window_load(Window *window) {
   s_menu_loading = S_TRUE;
   layer_set_hidden(menu_layer_get_layer(s_menu_layer), true);
   layer_add_child(window_layer, menu_layer_get_layer(s_menu_layer));
+  
+  // Show the cached catalog right away, the phone will only revalidate it
+  if(persist_load_catalog()){
+    show_route_menu();
+  }
 }
 
 static void menu_window_unload(Window *window) {
+  if(s_prefetch_timer != NULL){
+    app_timer_cancel(s_prefetch_timer);
+    s_prefetch_timer = NULL;
+  }
   menu_layer_destroy(s_menu_layer);
   text_layer_destroy(s_menu_loading_text);
 }
 
 //========================================= ROUTE WINDOW ======================================================
-static void pattern_layer_update_proc(Layer *my_layer, GContext* ctx){
-  if(s_pattern_updated && s_selected_route != NULL){
-    if(s_selected_route->pattern != NULL && s_selected_route->pattern->points != NULL){
-      if(s_pattern_gpath_info == NULL){
-          s_pattern_gpath_info = malloc(sizeof(GPathInfo));
-      }
-      if(s_pattern_gpath_info->num_points != s_selected_route->pattern->points_len){
-        s_pattern_gpath_info->num_points = s_selected_route->pattern->points_len;
-        if(s_pattern_gpath_info->points != NULL) free(s_pattern_gpath_info->points);
-        s_pattern_gpath_info->points = malloc(sizeof(GPoint)*s_pattern_gpath_info->num_points);
-      }
-      
-      // Create extremes of the convex hull
-      GPoint* hull_extremes[2];
-      extreme_points(s_selected_route->pattern->convex_hull, hull_extremes);
-      
-      if(hull_extremes[0] != NULL && hull_extremes[1] != NULL){         
-        
-        // Get the scale
-        GRect pattern_frame = layer_get_frame(my_layer);
-        uint32_t extreme_dist = distance(hull_extremes[0], hull_extremes[1]);
-        double scale_factor = ((double)pattern_frame.size.w - PATTERN_FRAME_PADDING) / extreme_dist;
-        
-        // Get the center offset
-        GPoint hull_center = center(hull_extremes[0], hull_extremes[1]);
-        GPoint frame_center = grect_center_point(&pattern_frame);
-        //APP_LOG(APP_LOG_LEVEL_DEBUG, "Frame Center: (%d, %d)", frame_center.x, frame_center.y);
-        //APP_LOG(APP_LOG_LEVEL_DEBUG, "Hull Center: (%d, %d)", hull_center.x, hull_center.y);
-        
-        for(uint16_t i=0; i<s_pattern_gpath_info->num_points; ++i){
-          GPoint scaled_point = s_selected_route->pattern->points[i];
-          //APP_LOG(APP_LOG_LEVEL_DEBUG, "Precaled Point: (%d, %d)", scaled_point.x, scaled_point.y);
-          scaled_point.x -= hull_center.x;
-          scaled_point.y -= hull_center.y;
-          scaled_point.x *= scale_factor;
-          scaled_point.y *= scale_factor;
-          scaled_point.x += frame_center.x;
-          scaled_point.y += frame_center.y;
-        
-          s_pattern_gpath_info->points[i] = scaled_point;
-          //APP_LOG(APP_LOG_LEVEL_DEBUG, "Scaled Point: (%d, %d)", scaled_point.x, scaled_point.y);
-        }  
-        if(s_pattern_gpath != NULL){
-          gpath_destroy(s_pattern_gpath);
-          s_pattern_gpath = NULL;
-        }
-        s_pattern_gpath = gpath_create(s_pattern_gpath_info);
-      }
+static void redraw_timer_callback(void *data){
+  s_redraw_timer = NULL;
+  if(s_redraw_pending){
+    s_redraw_pending = S_FALSE;
+    layer_mark_dirty(s_route_pattern);
+    s_redraw_timer = app_timer_register(REDRAW_INTERVAL_MS, redraw_timer_callback, NULL);
+  }
+}
+
+// Coalesce redraws while a pattern streams in. The first update draws right away, later ones wait for the
+// next frame slot, and the update that completes the transfer always draws immediately
+static void schedule_pattern_redraw(bool complete){
+  if(s_route_pattern == NULL) return;
+  if(complete){
+    if(s_redraw_timer != NULL){
+      app_timer_cancel(s_redraw_timer);
+      s_redraw_timer = NULL;
+    }
+    s_redraw_pending = S_FALSE;
+    layer_mark_dirty(s_route_pattern);
+  }
+  else if(s_redraw_timer == NULL){
+    layer_mark_dirty(s_route_pattern);
+    s_redraw_timer = app_timer_register(REDRAW_INTERVAL_MS, redraw_timer_callback, NULL);
+  }
+  else{
+    s_redraw_pending = S_TRUE;
+  }
+}
+
+// Keep every point no closer than tolerance (in pattern units) to the last one kept, and the last point
+// Returns how many are kept, writing their indexes to indexes unless it is NULL
+static uint16_t radial_simplify(const Pattern *pattern, uint32_t tolerance, uint16_t *indexes){
+  uint64_t tolerance_squared = (uint64_t)tolerance * tolerance;
+  uint16_t len = 0;
+  uint16_t last = 0;
+  for(uint16_t i=0; i<pattern->points_len; i++){
+    bool keep = i == 0 || i == pattern->points_len - 1 || squared_distance(&pattern->points[i], &pattern->points[last]) >= tolerance_squared;
+    if(!keep) continue;
+    if(indexes != NULL) indexes[len] = i;
+    len++;
+    last = i;
+  }
+  return len;
+}
+
+// The points drawn at each zoom short of the deepest, so a level draws about as many vertices as its line has pixels
+// Levels live in the pattern's arena. If there is no room the pattern is drawn from every point
+static void build_pattern_lod(Pattern *pattern, int32_t fit_scale){
+  for(int level=0; level<PATTERN_ZOOM_LEVELS - 1; level++){
+    uint32_t tolerance = ((uint32_t)LOD_TOLERANCE_PX << Q16_SHIFT) / (fit_scale << level);
+    uint16_t len = radial_simplify(pattern, tolerance, NULL);
+    pattern->lod[level] = (uint16_t*)arena_alloc(&pattern->arena, sizeof(uint16_t) * len);
+    if(pattern->lod[level] == NULL) return;
+    pattern->lod_len[level] = radial_simplify(pattern, tolerance, pattern->lod[level]);
+  }
+  pattern->lod_valid = true;
+}
+
+// Draw the segments of the pattern that cross the viewport, from the level of detail for the zoom
+// Each point's outcode is worked out once and shared by the two segments it ends, and only segments that reach
+// the viewport are clipped and projected
+static void draw_pattern(GContext* ctx, Pattern *pattern, GRect pattern_frame, GPoint view_center, int32_t scale){
+  const uint16_t *indexes = NULL;
+  uint16_t count = pattern->points_len;
+  if(pattern->lod_valid && s_view_zoom < PATTERN_ZOOM_LEVELS - 1){
+    indexes = pattern->lod[s_view_zoom];
+    count = pattern->lod_len[s_view_zoom];
+  }
+  
+  // The viewport in pattern units, a stroke wider than the frame so lines leaving it are not cut short
+  int32_t half_w = (((int32_t)pattern_frame.size.w / 2 + PATTERN_STROKE_WIDTH) << Q16_SHIFT) / scale;
+  int32_t half_h = (((int32_t)pattern_frame.size.h / 2 + PATTERN_STROKE_WIDTH) << Q16_SHIFT) / scale;
+  ClipRect viewport = { view_center.x - half_w, view_center.y - half_h, view_center.x + half_w, view_center.y + half_h };
+  GPoint frame_center = grect_center_point(&pattern_frame);
+  
+  GPoint prev = pattern->points[indexes != NULL ? indexes[0] : 0];
+  uint8_t prev_code = outcode(&viewport, prev.x, prev.y);
+  for(uint16_t i=1; i<count; i++){
+    GPoint point = pattern->points[indexes != NULL ? indexes[i] : i];
+    uint8_t code = outcode(&viewport, point.x, point.y);
+    int32_t x0 = prev.x, y0 = prev.y, x1 = point.x, y1 = point.y;
+    if((prev_code & code) == 0 && clip_segment(&viewport, &x0, &y0, &x1, &y1, prev_code, code)){
+      // Clipped ends are within the viewport, so their products stay in 32 bits
+      GPoint start = GPoint((((x0 - view_center.x) * scale) >> Q16_SHIFT) + frame_center.x, (((y0 - view_center.y) * scale) >> Q16_SHIFT) + frame_center.y);
+      GPoint end = GPoint((((x1 - view_center.x) * scale) >> Q16_SHIFT) + frame_center.x, (((y1 - view_center.y) * scale) >> Q16_SHIFT) + frame_center.y);
+      graphics_draw_line(ctx, start, end);
     }
-    s_pattern_updated = S_FALSE;
+    prev = point;
+    prev_code = code;
+  }
+}
+
+// A projected pattern at zoom 0 is already fit to the frame, so no segment needs clipping and each point only
+// needs a shift from pixels of the deepest zoom to pixels
+static void draw_projected_pattern(GContext* ctx, Pattern *pattern){
+  const uint16_t *indexes = NULL;
+  uint16_t count = pattern->points_len;
+  if(pattern->lod_valid){
+    indexes = pattern->lod[0];
+    count = pattern->lod_len[0];
+  }
+  
+  GPoint prev = pattern->points[indexes != NULL ? indexes[0] : 0];
+  prev = GPoint(prev.x >> PATTERN_MAX_ZOOM_SHIFT, prev.y >> PATTERN_MAX_ZOOM_SHIFT);
+  for(uint16_t i=1; i<count; i++){
+    GPoint point = pattern->points[indexes != NULL ? indexes[i] : i];
+    point = GPoint(point.x >> PATTERN_MAX_ZOOM_SHIFT, point.y >> PATTERN_MAX_ZOOM_SHIFT);
+    graphics_draw_line(ctx, prev, point);
+    prev = point;
+  }
+}
+
+// Vehicles are projected on their own with the view the pattern was drawn with, so they can move without the
+// route being drawn differently. Those off screen are skipped
+static void draw_vehicles(GContext* ctx, GRect pattern_frame, GPoint view_center, int32_t scale){
+  int32_t aspect = route_pattern(s_selected_route)->bounds.aspect;
+  GPoint frame_center = grect_center_point(&pattern_frame);
+  int32_t half_w = ((int32_t)pattern_frame.size.w / 2 + VEHICLE_MARKER_RADIUS) << Q16_SHIFT;
+  int32_t half_h = ((int32_t)pattern_frame.size.h / 2 + VEHICLE_MARKER_RADIUS) << Q16_SHIFT;
+  for(int i=0; i<VEHICLES_LEN; i++){
+    if(!s_vehicles[i].active) continue;
+    // Like decode_points: correct the longitude aspect and flip latitude, unless the phone projected them
+    int32_t x = s_vehicles[i].position.x;
+    int32_t y = s_vehicles[i].position.y;
+    if(!route_pattern(s_selected_route)->bounds.projected){
+      x = (x * aspect) >> Q16_SHIFT;
+      y = -y;
+    }
+    int64_t dx = (int64_t)(x - view_center.x) * scale;
+    int64_t dy = (int64_t)(y - view_center.y) * scale;
+    if(dx < -half_w || dx > half_w || dy < -half_h || dy > half_h) continue;
+    GPoint marker = GPoint((dx >> Q16_SHIFT) + frame_center.x, (dy >> Q16_SHIFT) + frame_center.y);
+    graphics_context_set_fill_color(ctx, GColorBlack);
+    graphics_fill_circle(ctx, marker, VEHICLE_MARKER_RADIUS);
+    graphics_context_set_fill_color(ctx, GColorWhite);
+    graphics_fill_circle(ctx, marker, VEHICLE_MARKER_RADIUS / 2);
+  }
+}
+
+// The scale and center that fit the whole pattern to the frame, or a scale of 0 if there is nothing to fit yet
+// The phone fit a projected pattern already. Any other is fit by its hull diameter
+static int32_t fit_pattern(Pattern *pattern, GRect pattern_frame, GPoint *fit_center){
+  if(pattern->bounds.projected){
+    *fit_center = GPoint((pattern_frame.size.w / 2) << PATTERN_MAX_ZOOM_SHIFT, (pattern_frame.size.h / 2) << PATTERN_MAX_ZOOM_SHIFT);
+    return Q16_ONE >> PATTERN_MAX_ZOOM_SHIFT;
+  }
+  
+  // The extremes of the convex hull are cached on the pattern until a hull vertex changes
+  if(!pattern->diameter_valid){
+    pattern->diameter_valid = extreme_points(pattern->convex_hull, pattern->diameter);
+  }
+  if(!pattern->diameter_valid) return 0;
+  GPoint* hull_extremes = pattern->diameter;
+  
+  // Get the scale, in Q16 so each point is projected with a multiply and a shift
+  // Quantized routes span tens of thousands of units, so the scale stays small enough for 32 bit products
+  uint32_t extreme_dist = distance(&hull_extremes[0], &hull_extremes[1]);
+  *fit_center = center(&hull_extremes[0], &hull_extremes[1]);
+  return extreme_dist > 0 ? ((int32_t)(pattern_frame.size.w - PATTERN_FRAME_PADDING) << Q16_SHIFT) / (int32_t)extreme_dist : 0;
+}
+
+static bool pattern_cache_key_equal(const PatternCacheKey *a, const PatternCacheKey *b){
+  return a->pattern == b->pattern && a->points_len == b->points_len && a->lod_valid == b->lod_valid &&
+    a->scale == b->scale && gpoint_equal(&a->center, &b->center);
+}
+
+// Copy the route line just drawn out of the framebuffer, in the framebuffer's own format so it is drawn back as is
+// The cache is a screen's worth of heap, so it is only made if that still leaves the reserve free
+static void capture_pattern_cache(GContext* ctx, const PatternCacheKey *key){
+  GBitmap *frame_buffer = graphics_capture_frame_buffer(ctx);
+  if(frame_buffer == NULL) return;
+  GRect bounds = gbitmap_get_bounds(frame_buffer);
+  if(s_pattern_cache == NULL){
+    uint32_t needed = (uint32_t)gbitmap_get_bytes_per_row(frame_buffer) * bounds.size.h;
+    if(heap_bytes_free() >= HEAP_FREE_RESERVE + needed){
+      s_pattern_cache = gbitmap_create_blank(bounds.size, gbitmap_get_format(frame_buffer));
+    }
+  }
+  if(s_pattern_cache != NULL){
+#ifdef PBL_ROUND
+    // A round framebuffer's rows only hold the pixels inside the circle
+    for(int16_t y=0; y<bounds.size.h; y++){
+      GBitmapDataRowInfo from = gbitmap_get_data_row_info(frame_buffer, y);
+      GBitmapDataRowInfo to = gbitmap_get_data_row_info(s_pattern_cache, y);
+      memcpy(&to.data[from.min_x], &from.data[from.min_x], from.max_x - from.min_x + 1);
+    }
+#else
+    uint16_t from_row = gbitmap_get_bytes_per_row(frame_buffer);
+    uint16_t to_row = gbitmap_get_bytes_per_row(s_pattern_cache);
+    uint8_t *from = gbitmap_get_data(frame_buffer);
+    uint8_t *to = gbitmap_get_data(s_pattern_cache);
+    for(int16_t y=0; y<bounds.size.h; y++){
+      memcpy(&to[y * to_row], &from[y * from_row], from_row < to_row ? from_row : to_row);
+    }
+#endif
+    s_pattern_cache_key = *key;
+  }
+  graphics_release_frame_buffer(ctx, frame_buffer);
+}
+
+// At zoom 0 the route is fit to the frame. Each zoom level doubles that scale around s_view_center
+// A complete pattern's line is kept in s_pattern_cache until the pattern or the view changes, so redraws for
+// vehicles blit it and draw only the vehicles. The layer fills the window, so framebuffer and layer share coordinates
+static void pattern_layer_update_proc(Layer *my_layer, GContext* ctx){
+  if(s_selected_route == NULL || route_pattern(s_selected_route)->points == NULL) return;
+  uint32_t start = clock_ms();
+  Pattern *pattern = route_pattern(s_selected_route);
+  GRect pattern_frame = layer_get_frame(my_layer);
+  
+  GPoint fit_center;
+  int32_t fit_scale = fit_pattern(pattern, pattern_frame, &fit_center);
+  if(fit_scale == 0) return;
+  if(!pattern->lod_valid && pattern_complete(pattern)) build_pattern_lod(pattern, fit_scale);
+  
+  int32_t scale = fit_scale << s_view_zoom;
+  GPoint view_center = s_view_zoom == 0 ? fit_center : s_view_center;
+  
+  PatternCacheKey key = { pattern, pattern->points_len, pattern->lod_valid, scale, view_center };
+  if(s_pattern_cache != NULL && pattern_cache_key_equal(&key, &s_pattern_cache_key)){
+    graphics_draw_bitmap_in_rect(ctx, s_pattern_cache, gbitmap_get_bounds(s_pattern_cache));
   }
-  if(s_pattern_gpath != NULL){
-    // Fill the path:
-    //graphics_context_set_fill_color(ctx, GColorWhite);
-    //gpath_draw_filled(ctx, s_pattern_gpath);
-    // Stroke the path:
-    GColor outline_color = GColorBlack;
-    if(s_selected_route != NULL && s_selected_route->color_rgb != NULL){
-      outline_color = GColorFromRGB(s_selected_route->color_rgb[0], s_selected_route->color_rgb[1], s_selected_route->color_rgb[2]);
+  else{
+    graphics_context_set_stroke_color(ctx, (GColor8){ .argb = s_selected_route->color });
+    graphics_context_set_stroke_width(ctx, PATTERN_STROKE_WIDTH);
+    if(pattern->bounds.projected && s_view_zoom == 0){
+      draw_projected_pattern(ctx, pattern);
+    }
+    else{
+      draw_pattern(ctx, pattern, pattern_frame, view_center, scale);
     }
-    graphics_context_set_stroke_color(ctx, outline_color);
-    graphics_context_set_stroke_width(ctx, 2);
-    gpath_draw_outline_open(ctx, s_pattern_gpath);
+    // A pattern still streaming in would be captured again on every redraw
+    if(pattern_complete(pattern)) capture_pattern_cache(ctx, &key);
+  }
+  draw_vehicles(ctx, pattern_frame, view_center, scale);
+  counters_add_frame(start);
+}
+
+// Make the selected route's pattern resident for a window showing it. Returns whether it already is
+// A pattern evicted to save memory is loaded again like any other
+// A prefetched pattern is kept in storage now that it has been viewed
+// A pattern whose departures never arrived asks for them again
+static bool open_selected_route(bool with_vehicles){
+  Pattern *pattern = route_pattern(s_selected_route);
+  pattern->last_viewed = ++s_view_clock;
+  bool pattern_loaded = pattern_complete(pattern) || persist_load_pattern(s_selected_route);
+  memset(s_vehicles, 0, sizeof(s_vehicles));
+  if(pattern_loaded){
+    finish_pattern(s_selected_route);
+    bool missing_times = pattern_missing_times(pattern);
+    if(with_vehicles) request_vehicles(s_selected_route->id, missing_times, pattern->transfer_id);
+    else if(missing_times) request_stop_times(s_selected_route->id, pattern->transfer_id);
+  }
+  else{
+    request_route_pattern(s_selected_route->id);
+  }
+  return pattern_loaded;
+}
+
+// The phone stops sending the rest of the pattern, so a partial one is dropped and requested again next time
+static void close_selected_route(){
+  if(s_selected_route != NULL){
+    send_route_closed(s_selected_route->id);
+    if(!pattern_complete(route_pattern(s_selected_route))) reset_pattern(route_pattern(s_selected_route));
+    if(s_prefetch_route == s_selected_route) s_prefetch_route = NULL;
   }
+  s_pattern_loading = S_FALSE;
+  schedule_prefetch();
 }
 
 static void route_window_load(Window *window) {
   Layer *window_layer = window_get_root_layer(window);
   GRect window_frame = layer_get_frame(window_layer);
   
-  APP_LOG(APP_LOG_LEVEL_DEBUG, "Loading route window"); 
-  if(s_selected_route->pattern->points == NULL && s_selected_route->pattern->stops == NULL) request_route_pattern(s_selected_route->title);
+  LOG_DEBUG("Loading route window"); 
+  bool pattern_loaded = open_selected_route(true);
+  s_view_zoom = 0;
+  s_view_stop = 0;
   
   // Create the route name text
   s_route_name_text = text_layer_create(window_frame);
@@ -744,7 +2748,7 @@ static void route_window_load(Window *window) {
   text_layer_set_text_color(s_route_name_text, GColorBlack);
   text_layer_set_text_alignment(s_route_name_text, GTextAlignmentCenter);
   if(s_selected_route != NULL){
-    text_layer_set_text(s_route_name_text, s_selected_route->subtitle);
+    text_layer_set_text(s_route_name_text, catalog_string(s_selected_route->subtitle));
   }
   else{
     text_layer_set_text(s_route_name_text, "No route selected");
@@ -760,29 +2764,27 @@ static void route_window_load(Window *window) {
   layer_set_frame(text_layer_get_layer(s_route_name_text), s_route_name_frame);
   layer_mark_dirty(text_layer_get_layer(s_route_name_text));
   
-  // Create the pattern display layer
+  // Create the pattern display layer. A pattern already in memory is shown straight away
   s_route_pattern = layer_create(window_frame);
-  layer_set_hidden(s_route_pattern, true);
-  s_pattern_loading = S_TRUE;
+  layer_set_hidden(s_route_pattern, !pattern_loaded);
+  layer_set_hidden(text_layer_get_layer(s_route_name_text), pattern_loaded);
+  s_pattern_loading = !pattern_loaded;
   layer_set_update_proc(s_route_pattern, pattern_layer_update_proc);
   layer_add_child(window_layer, s_route_pattern);
 }
 
 static void route_window_unload(Window *window) {
+  close_selected_route();
   text_layer_destroy(s_route_name_text);
   s_route_name_text = NULL;
-  if(s_pattern_gpath_info != NULL){
-    if(s_pattern_gpath_info->points != NULL){
-      free(s_pattern_gpath_info->points);
-      s_pattern_gpath_info->points = NULL;
-    }
-    free(s_pattern_gpath_info);
-    s_pattern_gpath_info = NULL;
-  }
-  if(s_pattern_gpath != NULL){
-    gpath_destroy(s_pattern_gpath);
-    s_pattern_gpath = NULL;
+  if(s_redraw_timer != NULL){
+    app_timer_cancel(s_redraw_timer);
+    s_redraw_timer = NULL;
   }
+  s_redraw_pending = S_FALSE;
+  layer_destroy(s_route_pattern);
+  s_route_pattern = NULL;
+  destroy_pattern_cache();
 }
 
 static void enter_route_window(){
@@ -792,12 +2794,320 @@ static void enter_route_window(){
       .load = route_window_load,
       .unload = route_window_unload
     });
+    window_set_click_config_provider(s_route_window, (ClickConfigProvider) config_provider);
   }
 	window_stack_push(s_route_window, true);
 }
 
+//========================================= DEPARTURES WINDOW ======================================================
+// Index of the first departure at or after minute, or times_len if there are none left today
+static uint16_t next_departure(const Stop *stop, uint16_t minute){
+  uint16_t low = 0;
+  uint16_t high = stop->times_len;
+  while(low < high){
+    uint16_t mid = low + (high - low) / 2;
+    if(stop->times[mid] < minute) low = mid + 1;
+    else high = mid;
+  }
+  return low;
+}
+
+// Minutes into the service day. Times after midnight belong to the day before until the rollover
+static uint16_t service_minute(){
+  time_t now = time(NULL);
+  struct tm *local = localtime(&now);
+  uint16_t minute = local->tm_hour * 60 + local->tm_min;
+  return minute < SERVICE_DAY_ROLLOVER_MIN ? minute + 24 * 60 : minute;
+}
+
+// The row-th stop with a timetable, or NULL
+static Stop* timed_stop(Pattern *pattern, uint16_t row){
+  for(uint16_t i=0; i<pattern->stops_len && pattern->stops != NULL; i++){
+    if(pattern->stops[i].times_len == 0) continue;
+    if(row-- == 0) return &pattern->stops[i];
+  }
+  return NULL;
+}
+
+static uint16_t departures_get_num_rows_callback(MenuLayer *menu_layer, uint16_t section_index, void *context) {
+  uint16_t rows = 0;
+  while(timed_stop(route_pattern(s_selected_route), rows) != NULL) rows++;
+  return rows > 0 ? rows : 1; // Room for a message while there is nothing to list
+}
+
+static void departures_draw_row_callback(GContext* gctx, const Layer *cell_layer, MenuIndex *cell_index, void *context) {
+  Stop *stop = timed_stop(route_pattern(s_selected_route), cell_index->row);
+  if(stop == NULL){
+    menu_cell_basic_draw(gctx, cell_layer, "No timetable", pattern_complete(route_pattern(s_selected_route)) ? "for today" : "Loading...", NULL);
+    return;
+  }
+  
+  char departures[8 * DEPARTURES_SHOWN];
+  uint16_t len = 0;
+  uint16_t first = next_departure(stop, service_minute());
+  for(uint16_t i=first; i<stop->times_len && i<first+DEPARTURES_SHOWN; i++){
+    uint16_t hour = (stop->times[i] / 60) % 24;
+    if(!clock_is_24h_style()) hour = hour % 12 == 0 ? 12 : hour % 12;
+    len += snprintf(departures + len, sizeof(departures) - len, "%s%d:%02d", len > 0 ? " " : "", hour, stop->times[i] % 60);
+  }
+  menu_cell_basic_draw(gctx, cell_layer, stop->name, len > 0 ? departures : "No more today", NULL);
+}
+
+// Called when the stops or times of a route change
+static void departures_changed(MenuItem *route){
+  if(s_departures_layer != NULL && route == s_selected_route) menu_layer_reload_data(s_departures_layer);
+}
+
+// The next departures move along every minute
+static void departures_tick_handler(struct tm *tick_time, TimeUnits units_changed){
+  if(s_departures_layer != NULL) menu_layer_reload_data(s_departures_layer);
+}
+
+static void departures_window_load(Window *window) {
+  Layer *window_layer = window_get_root_layer(window);
+  GRect window_frame = layer_get_frame(window_layer);
+  
+  LOG_DEBUG("Loading departures window"); 
+  open_selected_route(false);
+  
+  s_departures_layer = menu_layer_create(window_frame);
+  menu_layer_set_callbacks(s_departures_layer, NULL, (MenuLayerCallbacks){
+    .get_num_rows = departures_get_num_rows_callback,
+    .draw_row = departures_draw_row_callback,
+  });
+  menu_layer_set_click_config_onto_window(s_departures_layer, window);
+  layer_add_child(window_layer, menu_layer_get_layer(s_departures_layer));
+  tick_timer_service_subscribe(MINUTE_UNIT, departures_tick_handler);
+}
+
+static void departures_window_unload(Window *window) {
+  tick_timer_service_unsubscribe();
+  close_selected_route();
+  menu_layer_destroy(s_departures_layer);
+  s_departures_layer = NULL;
+}
+
+static void enter_departures_window(){
+  if(s_departures_window == NULL){
+    s_departures_window = window_create();
+    window_set_window_handlers(s_departures_window, (WindowHandlers) {
+      .load = departures_window_load,
+      .unload = departures_window_unload
+    });
+  }
+	window_stack_push(s_departures_window, true);
+}
+
+//========================================= STOP INDEX ======================================================
+static bool stop_index_complete(const StopIndex *index){
+  return index->stops != NULL && index->stops_len == index->stops_total;
+}
+
+// The cell holding a point. Points off the grid get the nearest cell on its edge
+static void stop_index_cell(const StopIndex *index, int32_t x, int32_t y, int *col, int *row){
+  *col = x < 0 ? 0 : x / index->cell;
+  *row = y < 0 ? 0 : y / index->cell;
+  if(*col >= index->cols) *col = index->cols - 1;
+  if(*row >= index->rows) *row = index->rows - 1;
+}
+
+// The stop nearest to p, searching rings of cells outward from p's cell
+// Every cell past ring r is more than r cells from p, so the search stops once the best stop is closer than that
+static NearbyStop* nearest_stop(const StopIndex *index, GPoint p, uint32_t *distance_m){
+  int col, row;
+  stop_index_cell(index, p.x, p.y, &col, &row);
+  NearbyStop *best = NULL;
+  uint64_t best_distance = UINT64_MAX;
+  int rings = index->cols > index->rows ? index->cols : index->rows;
+  for(int ring=0; ring<rings; ring++){
+    for(int r=row-ring; r<=row+ring; r++){
+      if(r < 0 || r >= index->rows) continue;
+      // Rows inside the ring only have its two side cells
+      int step = (r == row - ring || r == row + ring || ring == 0) ? 1 : 2 * ring;
+      for(int c=col-ring; c<=col+ring; c+=step){
+        if(c < 0 || c >= index->cols) continue;
+        uint16_t cell = r * index->cols + c;
+        for(uint16_t i=index->cell_starts[cell]; i<index->cell_starts[cell + 1]; i++){
+          uint64_t d = squared_distance(&p, &index->stops[i].position);
+          if(d < best_distance){
+            best_distance = d;
+            best = &index->stops[i];
+          }
+        }
+      }
+    }
+    uint64_t searched = (uint64_t)ring * index->cell;
+    if(best != NULL && best_distance <= searched * searched) break;
+  }
+  if(best != NULL) *distance_m = pebble_sqrt(best_distance);
+  return best;
+}
+
+// Up to max stops within radius meters of p, nearest first. Only the cells the radius reaches are searched
+static uint16_t stops_within(const StopIndex *index, GPoint p, uint32_t radius, NearbyResult *results, uint16_t max){
+  int col_min, row_min, col_max, row_max;
+  stop_index_cell(index, p.x - (int32_t)radius, p.y - (int32_t)radius, &col_min, &row_min);
+  stop_index_cell(index, p.x + (int32_t)radius, p.y + (int32_t)radius, &col_max, &row_max);
+  uint64_t radius_squared = (uint64_t)radius * radius;
+  uint16_t len = 0;
+  for(int r=row_min; r<=row_max; r++){
+    for(int c=col_min; c<=col_max; c++){
+      uint16_t cell = r * index->cols + c;
+      for(uint16_t i=index->cell_starts[cell]; i<index->cell_starts[cell + 1]; i++){
+        uint64_t d = squared_distance(&p, &index->stops[i].position);
+        if(d > radius_squared) continue;
+        uint32_t distance_m = pebble_sqrt(d);
+        if(len == max && distance_m >= results[len - 1].distance) continue;
+        
+        // Insert in order, dropping the farthest when full
+        uint16_t j = len < max ? len++ : len - 1;
+        for(; j > 0 && results[j - 1].distance > distance_m; j--) results[j] = results[j - 1];
+        results[j] = (NearbyResult){ .stop = &index->stops[i], .distance = distance_m };
+      }
+    }
+  }
+  return len;
+}
+
+//========================================= NEARBY WINDOW ======================================================
+// List the stops in the radius, or the nearest stop if none are, once both the index and the position are here
+static void nearby_changed(){
+  s_nearby_results_len = 0;
+  if(s_nearby_located && stop_index_complete(&s_stop_index)){
+    s_nearby_results_len = stops_within(&s_stop_index, s_nearby_position, NEARBY_RADIUS_M, s_nearby_results, NEARBY_SHOWN);
+    if(s_nearby_results_len == 0){
+      NearbyStop *stop = nearest_stop(&s_stop_index, s_nearby_position, &s_nearby_results[0].distance);
+      if(stop != NULL){
+        s_nearby_results[0].stop = stop;
+        s_nearby_results_len = 1;
+      }
+    }
+  }
+  if(s_nearby_layer != NULL) menu_layer_reload_data(s_nearby_layer);
+}
+
+static uint16_t nearby_get_num_rows_callback(MenuLayer *menu_layer, uint16_t section_index, void *context) {
+  return s_nearby_results_len > 0 ? s_nearby_results_len : 1; // Room for a message while there is nothing to list
+}
+
+static void nearby_draw_row_callback(GContext* gctx, const Layer *cell_layer, MenuIndex *cell_index, void *context) {
+  if(s_nearby_results_len == 0){
+    if(s_nearby_lost) menu_cell_basic_draw(gctx, cell_layer, "No location", "Select to try again", NULL);
+    else if(!s_nearby_located) menu_cell_basic_draw(gctx, cell_layer, "Locating...", NULL, NULL);
+    else if(!stop_index_complete(&s_stop_index)) menu_cell_basic_draw(gctx, cell_layer, "Loading stops...", NULL, NULL);
+    else menu_cell_basic_draw(gctx, cell_layer, "No stops", NULL, NULL);
+    return;
+  }
+  
+  // The distance, then the short names of the routes serving the stop
+  NearbyResult *result = &s_nearby_results[cell_index->row];
+  char subtitle[32];
+  uint16_t len;
+  if(result->distance < 1000) len = snprintf(subtitle, sizeof(subtitle), "%d m", (int)result->distance);
+  else len = snprintf(subtitle, sizeof(subtitle), "%d.%d km", (int)(result->distance / 1000), (int)(result->distance % 1000 / 100));
+  for(uint8_t i=0; i<result->stop->routes_len && len < sizeof(subtitle); i++){
+    MenuItem *route = find_route(result->stop->routes[i]);
+    if(route != NULL) len += snprintf(subtitle + len, sizeof(subtitle) - len, " %s", catalog_string(route->title));
+  }
+  menu_cell_basic_draw(gctx, cell_layer, result->stop->name, subtitle, NULL);
+}
+
+// Ask for a fresh position
+static void nearby_select_callback(MenuLayer *menu_layer, MenuIndex *cell_index, void *context) {
+  s_nearby_located = S_FALSE;
+  s_nearby_lost = S_FALSE;
+  request_nearby();
+  nearby_changed();
+}
+
+static void nearby_window_load(Window *window) {
+  Layer *window_layer = window_get_root_layer(window);
+  GRect window_frame = layer_get_frame(window_layer);
+  
+  LOG_DEBUG("Loading nearby window"); 
+  s_nearby_layer = menu_layer_create(window_frame);
+  menu_layer_set_callbacks(s_nearby_layer, NULL, (MenuLayerCallbacks){
+    .get_num_rows = nearby_get_num_rows_callback,
+    .draw_row = nearby_draw_row_callback,
+    .select_click = nearby_select_callback,
+  });
+  menu_layer_set_click_config_onto_window(s_nearby_layer, window);
+  layer_add_child(window_layer, menu_layer_get_layer(s_nearby_layer));
+  nearby_select_callback(s_nearby_layer, NULL, NULL);
+}
+
+static void nearby_window_unload(Window *window) {
+  menu_layer_destroy(s_nearby_layer);
+  s_nearby_layer = NULL;
+}
+
+static void enter_nearby_window(){
+  if(s_nearby_window == NULL){
+    s_nearby_window = window_create();
+    window_set_window_handlers(s_nearby_window, (WindowHandlers) {
+      .load = nearby_window_load,
+      .unload = nearby_window_unload
+    });
+  }
+	window_stack_push(s_nearby_window, true);
+}
+
+//========================================= DEBUG WINDOW ======================================================
+static void debug_refresh(){
+  Counters *counters = &s_counters;
+  snprintf(s_debug_buffer, sizeof(s_debug_buffer),
+    "In %d msgs, %d B\nDropped %d, out failed %d\nDecode %d ms, max %d\nDrawn %d frames\nDraw %d ms avg, max %d\nHeap peak %d B, free %d B",
+    (int)counters->messages_in, (int)counters->bytes_in, (int)counters->dropped, (int)counters->out_failed,
+    (int)counters->decode_ms, (int)counters->decode_ms_max, (int)counters->frames_drawn,
+    (int)(counters->frames_drawn > 0 ? counters->render_ms / counters->frames_drawn : 0), (int)counters->render_ms_max,
+    (int)counters->heap_peak, (int)heap_bytes_free());
+  text_layer_set_text(s_debug_text, s_debug_buffer);
+}
+
+// The counters move while the window is open, and the phone gets a copy each time
+static void debug_timer_callback(void *data){
+  debug_refresh();
+  send_counters();
+  s_debug_timer = app_timer_register(DEBUG_REFRESH_MS, debug_timer_callback, NULL);
+}
+
+static void debug_window_load(Window *window) {
+  Layer *window_layer = window_get_root_layer(window);
+  GRect window_frame = layer_get_frame(window_layer);
+  
+  LOG_DEBUG("Loading debug window"); 
+  GRect text_frame = GRect(4, PBL_IF_ROUND_ELSE(24, 4), window_frame.size.w - 8, window_frame.size.h - PBL_IF_ROUND_ELSE(48, 8));
+  s_debug_text = text_layer_create(text_frame);
+  text_layer_set_text_alignment(s_debug_text, PBL_IF_ROUND_ELSE(GTextAlignmentCenter, GTextAlignmentLeft));
+  layer_add_child(window_layer, text_layer_get_layer(s_debug_text));
+  debug_timer_callback(NULL);
+}
+
+static void debug_window_unload(Window *window) {
+  if(s_debug_timer != NULL){
+    app_timer_cancel(s_debug_timer);
+    s_debug_timer = NULL;
+  }
+  text_layer_destroy(s_debug_text);
+  s_debug_text = NULL;
+}
+
+static void enter_debug_window(){
+  if(s_debug_window == NULL){
+    s_debug_window = window_create();
+    window_set_window_handlers(s_debug_window, (WindowHandlers) {
+      .load = debug_window_load,
+      .unload = debug_window_unload
+    });
+  }
+	window_stack_push(s_debug_window, true);
+}
+
 //========================================= INIT ======================================================
 static void init(void) {
+  persist_check_version();
+  inbox_decoder_init();
+  
   s_menu_window = window_create();
   window_set_window_handlers(s_menu_window, (WindowHandlers) {
     .load = menu_window_load,
@@ -822,12 +3132,17 @@ static void deinit(void) {
 	app_message_deregister_callbacks();
 	window_destroy(s_menu_window);
   window_destroy(s_route_window);
+  window_destroy(s_departures_window);
+  window_destroy(s_nearby_window);
+  window_destroy(s_debug_window);
   
   destroy_menu_items();
+  arena_reset(&s_stop_index.arena);
 }
 
 int main( void ) {
 	init();
 	app_event_loop();
 	deinit();
+	return 0;
 }
\ No newline at end of file
@@ -13,20 +13,89 @@ var MessageTypeEnum = {
   SET_INBOX_SIZE: 1,
   ROUTES: 2,
   ROUTE_PATTERN: 3,
-  ROUTE_PATTERN_POINTS: 4,
-  ROUTE_PATTERN_STOPS: 5
+  ROUTE_PATTERN_STOPS: 5,
+  ROUTE_PATTERN_POINTS_FRAME: 6,
+  ROUTE_PATTERN_HEADER: 7,
+  ROUTES_CURRENT: 8,
+  ROUTE_CLOSED: 9,
+  ROUTE_PATTERN_PREFETCH: 10,
+  VEHICLES: 11,
+  STOP_TIMES: 12,
+  NEARBY: 13,
+  NEARBY_STOPS: 14,
+  NEARBY_POSITION: 15,
+  COUNTERS: 16,
+  ROUTE_PATTERN_NACK: 17
 };
 
+// What changed for a vehicle, in the low two bits of each vehicle update record
+var VehicleOpEnum = {
+  ADDED: 1, // Followed by its position
+  MOVED: 2, // Followed by the change in its position
+  REMOVED: 3
+};
+
+// Transmit queue priority classes, most urgent first
+var PriorityEnum = {
+  CONTROL: 0, // Status and handshake messages
+  VISIBLE: 1, // The pattern of the route on screen
+  CATALOG: 2, // The route catalog
+  PREFETCH: 3 // Patterns the watch may show next
+};
+
+// Pattern points are quantized into signed 16 bit offsets from the center of the route's bounding box
+var QUANTIZED_EXTENT = 32767;
+var Q16_ONE = 65536;
+
+
 var apiUrl = "http://transport.tamu.edu/BusRoutesFeed/api/";
 var routesPath = "Routes";
 var patternPath = "route/{0}/pattern/{1}-{2}-{3}";
+var vehiclesPath = "route/{0}/buses/mentor";
+var timetablePath = "route/{0}/TimeTable/{1}-{2}-{3}";
 var myStatus = 1;
+var routeCatalog = []; // Route short names indexed by the route ID the watch knows them by
+var pendingPatternRequests = []; // Route IDs the watch asked for before the catalog was fetched
+var pendingNearbyRequest = null; // A nearby request from the watch which came before the catalog was fetched
+var watchCatalogHash = 0; // Hash of the catalog the watch has, so it is only sent when it changed
 
 var retryWaitOriginal = 100; // in ms
-var retryWait = retryWaitOriginal;
+var retryWaitMax = 6400; // Backoff stops doubling here, so a long outage does not stall the link once it is back
+var retryWait = retryWaitOriginal; // Shared by everything in the transmit queue
+var transmitQueues = [[], [], [], []]; // Jobs waiting to be sent, per priority. Each job is a list of messages sent in order
+var TRANSMIT_WINDOW = 4; // Messages of a windowed job sent ahead of their ACKs
+var inFlight = 0; // Messages sent and not yet acknowledged
+var backingOff = false; // A message failed, so nothing is sent until the backoff is over
+var patternPriority = {}; // Route ID -> priority its pattern is sent at, until the watch closes the route
+var patternHeaders = {}; // Route ID -> header of its pattern, whose box vehicle positions are quantized in too
+var patternProjections = {}; // Route ID -> screen projection of its pattern, when the watch asked for one
+var patternTransfers = {}; // Route ID -> the pattern transfer under way, which the watch may ask to have parts of again
+var patternFetches = {}; // Route ID -> true while its pattern is being fetched and has not been delivered yet
+var transferSequence = 0; // Numbers each pattern transfer, so the watch can tell a stale frame from a current one
+var vehicleTracking = null; // The route whose vehicles are being polled for the watch, see startVehicles
+
+var VEHICLES_LEN = 16; // Matches the watch, vehicles are numbered below this
+var VEHICLE_POLL_MS = 5000; // Poll interval while the route is on screen
+var VEHICLE_POLL_MAX_MS = 20000; // The interval doubles up to this while nothing moves
+var SERVICE_DAY_ROLLOVER_MIN = 180; // Matches the watch, before 3 am it is still yesterday's service day
+var NEARBY_CELLS_MAX = 512; // Matches the watch, which keeps a table entry per cell of the stop index
+var NEARBY_CELL_MIN_M = 200; // Cells are at least this wide, so a query only needs the cells around the user
+var NEARBY_SAME_STOP_M = 30; // Stops of different routes with the same name this close together are one stop
+var METERS_PER_DEGREE = 111320; // Of latitude, or of longitude at the equator
+
+// The watch's link and render counters, in the order of its Counters struct. Each is a little endian uint32
+var WATCH_COUNTERS = ["messages_in", "bytes_in", "dropped", "out_failed", "decode_ms", "decode_ms_max",
+  "frames_drawn", "render_ms", "render_ms_max", "heap_peak"];
+var watchCounters = null; // The last counters the watch sent, while its debug window was open
 var pebbleInboxSize = 124; // The defult minimum
 var pebbleUsedInbox = 0;
 
+// What the watch can show, reported along with the inbox size. Defaults are an aplite screen
+// A watch which sets projected wants patterns in screen units rather than quantized, see fitProjection
+var pebbleScreen = {width: 144, height: 168, zoomMax: 1, maxPoints: 256, round: false, projected: false};
+var PATTERN_FRAME_PADDING = 20; // Matches the watch, the route is fit to the screen width less this padding
+var SIMPLIFY_TOLERANCE_PX = 0.5; // Points closer than this to the simplified line at the deepest zoom are dropped
+
 console.log("Phone JS is running");
 
 // String formating function 
@@ -40,93 +109,1208 @@ if (!String.prototype.format) {
   };
 }
 
+// Every AppMessage dictionary has a 1 byte tuple count, and every tuple has a 7 byte header (key, type, length)
+var DICT_HEADER_SIZE = 1;
+var TUPLE_HEADER_SIZE = 7;
+
 // Used to figure if there is room to send more items
-// Courtesy of @tomwrong http://stackoverflow.com/questions/1248302/javascript-object-size
-function roughSizeOfObject( object ) {
-
-    var objectList = [];
-    var stack = [ object ];
-    var bytes = 0;
-
-    while ( stack.length ) {
-        var value = stack.pop();
-
-        if ( typeof value === 'boolean' ) {
-            bytes += 4;
-        }
-        else if ( typeof value === 'string' ) {
-            bytes += value.length * 2;
-        }
-        else if ( typeof value === 'number' ) {
-            bytes += 8;
-        }
-        else if
-        (
-            typeof value === 'object' && objectList.indexOf( value ) === -1
-        )
-        {
-            objectList.push( value );
-
-            for( var i in value ) {
-                stack.push( value[ i ] );
-            }
-        }
+// Mirrors how PebbleKit JS serializes a message: numbers as int32, strings null terminated, arrays as byte arrays
+function appMessageSize(message) {
+  var bytes = DICT_HEADER_SIZE;
+  for(var key in message) {
+    var value = message[key];
+    bytes += TUPLE_HEADER_SIZE;
+    if(typeof value === 'string') {
+      bytes += unescape(encodeURIComponent(value)).length + 1;
+    } else if(Array.isArray(value)) {
+      bytes += value.length;
+    } else {
+      bytes += 4;
     }
-    return bytes;
+  }
+  return bytes;
 }
 
-// Function to send a message to the Pebble using AppMessage API
-// We are currently only sending a message using the "status" appKey defined in appinfo.json/Settings     
-function sendStatusMessage() {
-  Pebble.sendAppMessage({"message_type": MessageTypeEnum.STATUS, "js_status": myStatus}, statusMessageSuccessHandler, statusMessageFailureHandler);
+// Append an unsigned LEB128 varint to a byte array
+function writeVarint(bytes, value) {
+  while(value >= 0x80) {
+    bytes.push((value & 0x7F) | 0x80);
+    value >>>= 7;
+  }
+  bytes.push(value);
 }
 
-// Called when the message send attempt succeeds
-function statusMessageSuccessHandler() {
-  console.log("Ready message send succeeded.");  
+// Map signed integers to unsigned so small negative deltas stay small: 0, -1, 1, -2 -> 0, 1, 2, 3
+function zigZagEncode(value) {
+  return ((value << 1) ^ (value >> 31)) >>> 0;
 }
 
-// Called when the message send attempt fails
-function statusMessageFailureHandler() {
-  console.log("Ready message send failed.");
-  sendStatusMessage();
+// Quantize raw latitude/longitude points (in degrees) into the route's bounding box
+// The larger side of the box spans the whole signed 16 bit range and both axes share one step size.
+// Longitude is left uncorrected; the header carries cos(latitude) so the watch can fix the aspect with a multiply-shift.
+function quantizePattern(points) {
+  var minLat = Number.MAX_VALUE, minLon = Number.MAX_VALUE;
+  var maxLat = -Number.MAX_VALUE, maxLon = -Number.MAX_VALUE;
+  for(var i = 0; i < points.length; i++) {
+    minLat = Math.min(minLat, points[i].lat);
+    maxLat = Math.max(maxLat, points[i].lat);
+    minLon = Math.min(minLon, points[i].lon);
+    maxLon = Math.max(maxLon, points[i].lon);
+  }
+  var centerLat = (minLat + maxLat) / 2;
+  var centerLon = (minLon + maxLon) / 2;
+  var span = Math.max(maxLat - minLat, maxLon - minLon);
+  var step = span > 0 ? span / (2 * QUANTIZED_EXTENT) : 1;
+
+  var quantized = [];
+  for(var i = 0; i < points.length; i++) {
+    quantized.push({
+      x: Math.round((points[i].lon - centerLon) / step),
+      y: Math.round((points[i].lat - centerLat) / step)
+    });
+  }
+
+  var header = {
+    "message_type": MessageTypeEnum.ROUTE_PATTERN_HEADER,
+    "list_index": 0,
+    "list_len": points.length,
+    "bbox_min_lat": Math.round(minLat * 1e6),
+    "bbox_min_lon": Math.round(minLon * 1e6),
+    "bbox_max_lat": Math.round(maxLat * 1e6),
+    "bbox_max_lon": Math.round(maxLon * 1e6),
+    "aspect": Math.round(Math.cos(centerLat * Math.PI / 180) * Q16_ONE)
+  };
+  return {header: header, points: quantized};
+}
+
+// Squared distance from p to the segment a-b
+// x is scaled by aspect so both axes measure the same ground distance
+function squaredSegmentDistance(p, a, b, aspect) {
+  var ax = a.x * aspect, bx = b.x * aspect, px = p.x * aspect;
+  var dx = bx - ax;
+  var dy = b.y - a.y;
+  var t = 0;
+  if(dx !== 0 || dy !== 0) {
+    t = ((px - ax) * dx + (p.y - a.y) * dy) / (dx * dx + dy * dy);
+    t = Math.max(0, Math.min(1, t));
+  }
+  var ex = px - (ax + t * dx);
+  var ey = p.y - (a.y + t * dy);
+  return ex * ex + ey * ey;
+}
+
+// Douglas-Peucker simplification. Returns the indexes of the points to keep, in order
+// keep[i] pins point i (the ends and every stop), so each run between pinned points is simplified on its own
+function simplifyPolyline(points, keep, tolerance, aspect) {
+  var kept = [];
+  for(var i = 0; i < points.length; i++) kept.push(i === 0 || i === points.length - 1 || !!keep[i]);
+
+  var toleranceSq = tolerance * tolerance;
+  var stack = [];
+  var start = 0;
+  for(var i = 1; i < points.length; i++) {
+    if(kept[i]) {
+      stack.push([start, i]);
+      start = i;
+    }
+  }
+  while(stack.length) {
+    var run = stack.pop();
+    var farthest = -1;
+    var farthestDist = toleranceSq;
+    for(var i = run[0] + 1; i < run[1]; i++) {
+      var dist = squaredSegmentDistance(points[i], points[run[0]], points[run[1]], aspect);
+      if(dist > farthestDist) {
+        farthest = i;
+        farthestDist = dist;
+      }
+    }
+    if(farthest >= 0) {
+      kept[farthest] = true;
+      stack.push([run[0], farthest]);
+      stack.push([farthest, run[1]]);
+    }
+  }
+
+  var indexes = [];
+  for(var i = 0; i < points.length; i++) {
+    if(kept[i]) indexes.push(i);
+  }
+  return indexes;
+}
+
+// Drop the points of a quantized pattern that the watch could not tell apart at its deepest zoom
+// Stops are always kept and their point indexes are remapped to the simplified list
+function simplifyPattern(pattern, stops) {
+  var points = pattern.points;
+  var aspect = pattern.header.aspect / Q16_ONE;
+  var keep = [];
+  for(var i = 0; i < stops.length; i++) keep[stops[i].stop_point_index] = true;
+
+  // A pixel at the deepest zoom covers this many quantized units
+  var minX = Number.MAX_VALUE, minY = Number.MAX_VALUE;
+  var maxX = -Number.MAX_VALUE, maxY = -Number.MAX_VALUE;
+  for(var i = 0; i < points.length; i++) {
+    minX = Math.min(minX, points[i].x);
+    maxX = Math.max(maxX, points[i].x);
+    minY = Math.min(minY, points[i].y);
+    maxY = Math.max(maxY, points[i].y);
+  }
+  var extent = Math.max((maxX - minX) * aspect, maxY - minY);
+  var unitsPerPixel = extent / ((pebbleScreen.width - PATTERN_FRAME_PADDING) * pebbleScreen.zoomMax);
+  if(pattern.header.projected) unitsPerPixel = 1; // Projected units are pixels of the deepest zoom
+  var tolerance = SIMPLIFY_TOLERANCE_PX * unitsPerPixel;
+
+  // Loosen the tolerance until the pattern fits what the watch asked for. Projected points sit on whole units, so
+  // doubling can leave the count unchanged for a step. Past the extent only the pinned points are left
+  var indexes = simplifyPolyline(points, keep, tolerance, aspect);
+  while(indexes.length > pebbleScreen.maxPoints && tolerance > 0 && tolerance < extent) {
+    tolerance *= 2;
+    indexes = simplifyPolyline(points, keep, tolerance, aspect);
+  }
+
+  var remap = [];
+  var simplified = [];
+  for(var i = 0; i < indexes.length; i++) {
+    remap[indexes[i]] = i;
+    simplified.push(points[indexes[i]]);
+  }
+  for(var i = 0; i < stops.length; i++) stops[i].stop_point_index = remap[stops[i].stop_point_index];
+
+  console.log("Simplified pattern from " + points.length + " to " + simplified.length + " points");
+  pattern.points = simplified;
+  pattern.header.list_len = simplified.length;
+  return pattern;
+}
+
+// The projection that fits a quantized pattern to the watch's screen, or null if the watch projects it itself
+// Projected points are in pixels of the deepest zoom, from the top left of the screen and with north up, so the
+// watch only shifts them to draw the whole route. A rectangular screen fits the route's box less the padding.
+// A round screen fits the circle around the box's center that holds every point inside the padded display circle,
+// so no corner of the route is cut off by the bezel
+function fitProjection(pattern) {
+  if(!pebbleScreen.projected) return null;
+  var points = pattern.points;
+  var aspect = pattern.header.aspect / Q16_ONE;
+  var minX = Number.MAX_VALUE, minY = Number.MAX_VALUE;
+  var maxX = -Number.MAX_VALUE, maxY = -Number.MAX_VALUE;
+  for(var i = 0; i < points.length; i++) {
+    minX = Math.min(minX, points[i].x * aspect);
+    maxX = Math.max(maxX, points[i].x * aspect);
+    minY = Math.min(minY, points[i].y);
+    maxY = Math.max(maxY, points[i].y);
+  }
+  var projection = {
+    aspect: aspect,
+    centerX: (minX + maxX) / 2,
+    centerY: (minY + maxY) / 2,
+    scale: 0
+  };
+  var zoom = pebbleScreen.zoomMax;
+  if(pebbleScreen.round) {
+    var radiusSq = 0;
+    for(var i = 0; i < points.length; i++) {
+      var dx = points[i].x * aspect - projection.centerX;
+      var dy = points[i].y - projection.centerY;
+      radiusSq = Math.max(radiusSq, dx * dx + dy * dy);
+    }
+    var inset = Math.min(pebbleScreen.width, pebbleScreen.height) - PATTERN_FRAME_PADDING;
+    if(radiusSq > 0) projection.scale = zoom * inset / (2 * Math.sqrt(radiusSq));
+  } else {
+    var scaleX = maxX > minX ? (pebbleScreen.width - PATTERN_FRAME_PADDING) / (maxX - minX) : Number.MAX_VALUE;
+    var scaleY = maxY > minY ? (pebbleScreen.height - PATTERN_FRAME_PADDING) / (maxY - minY) : Number.MAX_VALUE;
+    if(Math.min(scaleX, scaleY) < Number.MAX_VALUE) projection.scale = zoom * Math.min(scaleX, scaleY);
+  }
+  return projection.scale > 0 ? projection : null;
+}
+
+// A quantized point in projected units, clamped to what the watch holds in a GPoint
+function projectPoint(projection, point) {
+  var clamp = function(value) { return Math.max(-QUANTIZED_EXTENT, Math.min(QUANTIZED_EXTENT, Math.round(value))); };
+  return {
+    x: clamp((point.x * projection.aspect - projection.centerX) * projection.scale + pebbleScreen.width * pebbleScreen.zoomMax / 2),
+    y: clamp((projection.centerY - point.y) * projection.scale + pebbleScreen.height * pebbleScreen.zoomMax / 2)
+  };
+}
+
+// Move a quantized pattern into projected units. The header tells the watch, and the aspect is already corrected
+function projectPattern(pattern, projection) {
+  var projected = [];
+  for(var i = 0; i < pattern.points.length; i++) projected.push(projectPoint(projection, pattern.points[i]));
+  pattern.points = projected;
+  pattern.header.aspect = Q16_ONE;
+  pattern.header.projected = 1;
+  return pattern;
+}
+
+// Encode one point as a pair of zig-zag varint deltas
+function encodePointDelta(x, y, prevX, prevY) {
+  var bytes = [];
+  writeVarint(bytes, zigZagEncode(x - prevX));
+  writeVarint(bytes, zigZagEncode(y - prevY));
+  return bytes;
+}
+
+// Pack pattern points into as few messages as the watch inbox allows
+// Each frame holds zig-zag varint deltas from the previous point. The first point of a frame is a delta from (0, 0)
+// so every frame can be decoded on its own.
+function packPointFrames(points, routeId) {
+  var newFrame = function(index) {
+    return {
+      "message_type": MessageTypeEnum.ROUTE_PATTERN_POINTS_FRAME,
+      "route_id": routeId,
+      "list_index": index,
+      "list_len": points.length,
+      "transfer_id": 0, // Numbered once the transfer starts, but counted in the frame's size now
+      "frame_data": []
+    };
+  };
+  var frames = [];
+  var frame = newFrame(0);
+  var budget = pebbleInboxSize - appMessageSize(frame);
+  var prevX = 0;
+  var prevY = 0;
+
+  for(var i = 0; i < points.length; i++) {
+    var x = Math.round(points[i].x);
+    var y = Math.round(points[i].y);
+    var encoded = encodePointDelta(x, y, prevX, prevY);
+    if(frame.frame_data.length > 0 && frame.frame_data.length + encoded.length > budget) {
+      // Out of room, so start a new frame with this point written absolutely
+      frames.push(frame);
+      frame = newFrame(i);
+      encoded = encodePointDelta(x, y, 0, 0);
+    }
+    Array.prototype.push.apply(frame.frame_data, encoded);
+    prevX = x;
+    prevY = y;
+  }
+  if(frame.frame_data.length > 0) frames.push(frame);
+  return frames;
+}
+
+// Function to send a message to the Pebble using AppMessage API
+// We are currently only sending a message using the "status" appKey defined in appinfo.json/Settings     
+function sendStatusMessage() {
+  transmit([{"message_type": MessageTypeEnum.STATUS, "js_status": myStatus}], PriorityEnum.CONTROL);
 }
 
 // Called when JS is ready
 Pebble.addEventListener("ready", function(e) {
   console.log("JS is ready!");
+  pruneCache();
   sendStatusMessage();
 });
 
-// Used when sending a list of items
-function sendNextItem(items, index) {
-  // Send the message
-  items[index].list_index = index;
-  Pebble.sendAppMessage(items[index], function() {
-    // Use success callback to increment index
-    index++;
-    retryWait = retryWaitOriginal;
+// Everything for the watch goes through one queue. The most urgent job is sent first, so a job is preempted between
+// messages when something more urgent comes in.
+// Most jobs are stop-and-wait: a message is only sent once the one before it was acknowledged, and a failed message is
+// sent again after the shared backoff. A windowed job (a pattern transfer) keeps up to TRANSMIT_WINDOW messages in
+// flight and does not resend what failed, since the watch tracks what arrived and asks for the rest.
+function transmitNext() {
+  while(!backingOff) {
+    var job = null;
+    for(var priority = 0; priority < transmitQueues.length && !job; priority++) {
+      if(transmitQueues[priority].length) job = transmitQueues[priority][0];
+    }
+    if(!job || inFlight >= (job.windowed ? TRANSMIT_WINDOW : 1)) return;
+    sendFromJob(job);
+  }
+}
 
-    if(index < items.length) {
-      sendNextItem(items, index);
-    } else {
-      console.log('Last item sent!');
+function sendFromJob(job) {
+  var index = job.index;
+  inFlight++;
+  if(job.windowed) {
+    job.index++;
+    if(job.index >= job.items.length) removeJob(job);
+  }
+  Pebble.sendAppMessage(job.items[index], function() {
+    inFlight--;
+    retryWait = retryWaitOriginal;
+    if(!job.windowed) {
+      job.index++;
+      if(job.index >= job.items.length) removeJob(job);
     }
+    transmitNext();
   }, function() {
+    inFlight--;
     console.log('Item transmission failed at index: ' + index);
-    // Retry with exponential backoff
-    setTimeout(function(){ sendNextItem(items, index); }, retryWait);
-    retryWait *= 2;
+    // Back off exponentially before sending anything else
+    backingOff = true;
+    setTimeout(function() {
+      backingOff = false;
+      transmitNext();
+    }, retryWait);
+    retryWait = Math.min(retryWait * 2, retryWaitMax);
   });
 }
 
-// Send a list of items
-function sendList(items) {
-  var index = 0;
+function removeJob(job) {
+  var queue = transmitQueues[job.priority];
+  var index = queue.indexOf(job);
+  if(index >= 0) queue.splice(index, 1);
+}
+
+// Queue messages to be sent in order. routeId tags the job so it can be cancelled when the route is closed
+// Returns the job, or null if there was nothing to send
+function transmit(items, priority, routeId, windowed) {
+  if(!items.length) return null;
+  var job = {items: items, index: 0, priority: priority, routeId: routeId, windowed: !!windowed};
+  transmitQueues[priority].push(job);
+  transmitNext();
+  return job;
+}
+
+function jobQueued(job) {
+  return transmitQueues[job.priority].indexOf(job) >= 0;
+}
+
+// Move a job to another priority, behind the jobs already there. Returns whether it was still queued
+function promoteJob(job, priority) {
+  if(!job || !jobQueued(job)) return false;
+  if(job.priority !== priority) {
+    removeJob(job);
+    job.priority = priority;
+    transmitQueues[priority].push(job);
+  }
+  return true;
+}
+
+// Drop the queued messages for a route. A message already in flight is left to finish
+function cancelTransmit(routeId) {
+  for(var priority = 0; priority < transmitQueues.length; priority++) {
+    transmitQueues[priority] = transmitQueues[priority].filter(function(job) {
+      return job.routeId !== routeId;
+    });
+  }
+}
+
+// Number a list of items
+// Lists which carry their own indexing (like point frames) are left alone
+function indexList(items) {
   if(items.length >= 1){
-    items[0].list_len = items.length;
-    sendNextItem(items, index); 
+    if(items[0].list_len === undefined) items[0].list_len = items.length;
+    for(var i = 0; i < items.length; i++) {
+      if(items[i].list_index === undefined) items[i].list_index = i;
+    }
+  }
+}
+
+// Responses are kept in localStorage already processed, keyed by URL (pattern URLs carry the service date).
+// A cached entry is delivered right away and then revalidated with the server in the background.
+var CACHE_PREFIX = "cache:";
+var CACHE_INDEX_KEY = "cacheIndex"; // URL -> when the entry was last confirmed by the server, in ms
+var CACHE_KEEP_MS = 7 * 24 * 60 * 60 * 1000; // Entries not confirmed for this long are dropped
+
+function readCacheIndex() {
+  try {
+    return JSON.parse(localStorage.getItem(CACHE_INDEX_KEY)) || {};
+  } catch(e) {
+    return {};
+  }
+}
+
+function readCacheEntry(url) {
+  try {
+    return JSON.parse(localStorage.getItem(CACHE_PREFIX + url));
+  } catch(e) {
+    return null;
+  }
+}
+
+// Mark an entry as confirmed by the server, storing it too when it is new or changed
+function writeCacheEntry(url, entry) {
+  var index = readCacheIndex();
+  index[url] = Date.now();
+  if(entry) {
+    try {
+      localStorage.setItem(CACHE_PREFIX + url, JSON.stringify(entry));
+    } catch(e) {
+      // Most likely over quota. Drop everything else and try once more
+      console.log("Cache write failed, clearing the cache: " + e);
+      for(var key in index) {
+        if(key != url) localStorage.removeItem(CACHE_PREFIX + key);
+      }
+      index = {};
+      index[url] = Date.now();
+      try {
+        localStorage.setItem(CACHE_PREFIX + url, JSON.stringify(entry));
+      } catch(e2) {
+        delete index[url];
+      }
+    }
+  }
+  localStorage.setItem(CACHE_INDEX_KEY, JSON.stringify(index));
+}
+
+// Drop entries which have not been confirmed recently, like patterns for past service dates
+function pruneCache() {
+  var index = readCacheIndex();
+  var now = Date.now();
+  for(var url in index) {
+    if(now - index[url] > CACHE_KEEP_MS) {
+      localStorage.removeItem(CACHE_PREFIX + url);
+      delete index[url];
+    }
+  }
+  localStorage.setItem(CACHE_INDEX_KEY, JSON.stringify(index));
+}
+
+// Hand deliver the processed response for url, from the cache first if there is an entry
+// The request is then revalidated with If-None-Match/If-Modified-Since, and deliver is only called again if the data changed
+// fail, if given, is called when the request fails, whether or not a cached entry was delivered
+function cachedFetch(url, process, deliver, fail) {
+  var entry = readCacheEntry(url);
+  var cachedData = null;
+  if(entry) {
+    console.log("Serving from cache: " + url);
+    cachedData = JSON.stringify(entry.data); // Before deliver gets a chance to modify it
+    deliver(entry.data);
+  }
+
+  var req = new XMLHttpRequest();
+  console.log("Requesting URL:" + url);
+  req.open("GET", url, true);
+  req.responseType = "json";
+  req.setRequestHeader("Cache-Control", "no-cache");
+  if(entry && entry.etag) req.setRequestHeader("If-None-Match", entry.etag);
+  if(entry && entry.lastModified) req.setRequestHeader("If-Modified-Since", entry.lastModified);
+  req.addEventListener("load", function() {
+    if(this.status == 304) {
+      console.log("Cache is current: " + url);
+      writeCacheEntry(url, null);
+      return;
+    }
+    if(this.status != 200 || !this.response) {
+      console.log("Request failed with status " + this.status + ": " + url);
+      if(fail) fail();
+      return;
+    }
+    var data = process(this.response);
+    var json = JSON.stringify(data);
+    if(json === cachedData) {
+      writeCacheEntry(url, null);
+      return;
+    }
+    writeCacheEntry(url, {
+      etag: this.getResponseHeader("ETag"),
+      lastModified: this.getResponseHeader("Last-Modified"),
+      data: data
+    });
+    deliver(data);
+  });
+  req.addEventListener("error", function() {
+    console.log("Request failed: " + url);
+    if(fail) fail();
+  });
+  req.send();
+}
+
+// FNV-1a hash of a string. The watch keeps the hash of its cached catalog so it only has to be resent when it changes
+function hashString(str) {
+  var hash = 0x811c9dc5;
+  for(var i = 0; i < str.length; i++) {
+    hash ^= str.charCodeAt(i);
+    hash = (hash + (hash << 1) + (hash << 4) + (hash << 7) + (hash << 8) + (hash << 24)) >>> 0;
+  }
+  return hash;
+}
+
+// Turn the Routes response into the list of routes, in route ID order
+function processRoutes(resp) {
+  var routes = [];
+  for (var i = 0; i < resp.length; i++) {
+    var route = {id: routes.length, name: resp[i].Name.trim(), shortName: resp[i].ShortName.trim()};
+    switch(resp[i].Group.trim()){
+      case "On Campus": route.section = RouteTypeEnum.ON_CAMPUS;
+        break;
+      case "Off Campus": route.section = RouteTypeEnum.OFF_CAMPUS;
+        break;
+      case "Game Day Routes": route.section = RouteTypeEnum.GAME_DAY;
+        break;
+      default: route.section = RouteTypeEnum.OTHER;
+        break;
+    }
+    // Packed like GColorFromRGB packs it on the watch: opaque, with the top two bits of each channel
+    var rgb = resp[i].Color ? parseCSSColor(resp[i].Color) : null;
+    route.color = rgb ? 0xC0 | (rgb[0] >> 6) << 4 | (rgb[1] >> 6) << 2 | rgb[2] >> 6 : 0xC0;
+    routes.push(route);
+  }
+  return routes;
+}
+
+// Lay the catalog out the way the watch keeps it: a route count per section, then a fixed size record per route in
+// section order, then one string table. Records hold offsets into the table, so a string used twice is stored once
+function packCatalog(sections) {
+  var strings = [];
+  var offsets = {};
+  var stringOffset = function(str) {
+    if(offsets[str] === undefined) {
+      offsets[str] = strings.length;
+      var utf8 = unescape(encodeURIComponent(str));
+      for(var i = 0; i < utf8.length; i++) strings.push(utf8.charCodeAt(i));
+      strings.push(0);
+    }
+    return offsets[str];
+  };
+
+  var bytes = [];
+  for(var section = 0; section < sections.length; section++) bytes.push(sections[section].length);
+  for(var section = 0; section < sections.length; section++) {
+    for(var i = 0; i < sections[section].length; i++) {
+      var route = sections[section][i];
+      var title = stringOffset(route.shortName);
+      var subtitle = stringOffset(route.name);
+      bytes.push(route.id, section, route.color, 0, title & 0xFF, title >> 8, subtitle & 0xFF, subtitle >> 8);
+    }
+  }
+  return bytes.concat(strings);
+}
+
+// Split the catalog blob into as few messages as the watch inbox allows, each tagged with its byte offset
+function packCatalogFrames(blob, catalogHash) {
+  var frames = [];
+  var budget = pebbleInboxSize - appMessageSize({
+    "message_type": MessageTypeEnum.ROUTES,
+    "catalog_hash": catalogHash,
+    "catalog_len": blob.length,
+    "list_index": 0,
+    "frame_data": []
+  });
+  for(var offset = 0; offset < blob.length; offset += budget) {
+    frames.push({
+      "message_type": MessageTypeEnum.ROUTES,
+      "catalog_hash": catalogHash,
+      "catalog_len": blob.length,
+      "list_index": offset,
+      "frame_data": blob.slice(offset, offset + budget)
+    });
+  }
+  return frames;
+}
+
+// Send the catalog to the watch, unless the watch's cached copy (by hash) is still current
+function deliverRoutes(allRoutes) {
+  var catalogHash = hashString(JSON.stringify(allRoutes));
+  var sections = [];
+  sections[RouteTypeEnum.ON_CAMPUS] = [];
+  sections[RouteTypeEnum.OFF_CAMPUS] = [];
+  sections[RouteTypeEnum.GAME_DAY] = [];
+  sections[RouteTypeEnum.OTHER] = [];
+  routeCatalog = [];
+  for(var i = 0; i < allRoutes.length; i++) {
+    routeCatalog.push(allRoutes[i].shortName);
+    sections[allRoutes[i].section].push(allRoutes[i]);
+  }
+  console.log(JSON.stringify(sections));
+
+  // Patterns the watch asked for before the catalog was here can go out now
+  var pending = pendingPatternRequests;
+  pendingPatternRequests = [];
+  for(var i = 0; i < pending.length; i++) requestPattern(pending[i]);
+  if(pendingNearbyRequest) {
+    var nearby = pendingNearbyRequest;
+    pendingNearbyRequest = null;
+    requestNearby(nearby.hash, nearby.capacity);
+  }
+
+  if(catalogHash === watchCatalogHash) {
+    console.log("Watch catalog is current");
+    transmit([{"message_type": MessageTypeEnum.ROUTES_CURRENT, "catalog_hash": catalogHash | 0}], PriorityEnum.CONTROL);
+    return;
+  }
+  watchCatalogHash = catalogHash;
+  transmit(packCatalogFrames(packCatalog(sections), catalogHash | 0), PriorityEnum.CATALOG);
+}
+
+// Fetch the route catalog and send it to the watch
+function requestRoutes(catalogHash) {
+  watchCatalogHash = catalogHash >>> 0;
+  cachedFetch(apiUrl + routesPath, processRoutes, deliverRoutes);
+}
+
+// Turn a pattern response into a quantized pattern and its stops
+// Simplification waits until delivery since it depends on the watch's screen
+function processPattern(resp) {
+  var points = [];
+  var stops = []; // Stops is the subset of points which a bus stops at
+  for(var i = 0; i < resp.length; i++) {
+    if(resp[i].PointTypeCode == 1){
+      var stop = {"message_type": MessageTypeEnum.ROUTE_PATTERN_STOPS};
+      stop.stop_is_timed = resp[i].Stop && resp[i].Stop.IsTimePoint ? 1 : 0;
+      stop.stop_name = resp[i].Name.trim(); // A point is only named if the bus actually stops there
+      stop.stop_point_index = i;
+      stops.push(stop);
+    }
+    
+    // We are going to use Latitude and Longitude as if they were Y and X.
+    // On the scale of a bus route this is a good approximation, once longitude is scaled by cos(latitude).
+    // College Station is around 30.6 degrees latitude and -96.3 degrees longitude
+    // In College Station, TX: 1 degree Longitude = 96.5 km ; 1 degree Latitude = 110.8 km
+    points.push({lat: resp[i].Latitude, lon: resp[i].Longtitude});
+  }
+  var pattern = quantizePattern(points);
+  pattern.stops = stops;
+  return pattern;
+}
+
+// Simplify a processed pattern for the watch and send it as a header, point frames and stops
+// A pattern which arrives after the watch closed its route is dropped
+function deliverPattern(routeId, pattern) {
+  patternHeaders[routeId] = pattern.header;
+  patternProjections[routeId] = fitProjection(pattern);
+  var priority = patternPriority[routeId];
+  if(priority === undefined) {
+    console.log("Route closed before its pattern arrived: " + routeId);
+    return;
+  }
+  var stops = pattern.stops;
+  for(var i = 0; i < stops.length; i++) stops[i].route_id = routeId;
+  pattern.header.route_id = routeId;
+  pattern.header.stops_len = stops.length;
+  if(patternProjections[routeId]) pattern = projectPattern(pattern, patternProjections[routeId]);
+  pattern = simplifyPattern(pattern, stops);
+  console.log("Sending pattern of route " + routeId + ": " + pattern.points.length + " points, " + stops.length + " stops");
+  indexList(stops);
+  var transfer = startPatternTransfer(routeId, packPointFrames(pattern.points, routeId), stops, pattern.points.length);
+  pattern.header.transfer_id = transfer.id;
+  transfer.headerJob = transmit([pattern.header], priority, routeId);
+  transfer.job = transmit(transfer.frames.concat(transfer.stops), priority, routeId, true);
+  requestTimetable(routeId, stops, transfer.id);
+}
+
+// A pattern transfer is its header, sent stop-and-wait so it is in before anything else, then its point frames and
+// stops in one windowed job. Every message carries the transfer's number
+// The watch indexes a transfer by its points, then its stops, and asks for the runs of those it is missing
+function startPatternTransfer(routeId, frames, stops, pointsLen) {
+  transferSequence = transferSequence % 0xFFFF + 1;
+  var transfer = {id: transferSequence, frames: frames, stops: stops, pointsLen: pointsLen, headerJob: null, job: null};
+  for(var i = 0; i < frames.length; i++) frames[i].transfer_id = transfer.id;
+  for(var j = 0; j < stops.length; j++) stops[j].transfer_id = transfer.id;
+  patternTransfers[routeId] = transfer;
+  return transfer;
+}
+
+// Varint (start, count) pairs, as the watch packs the runs it is missing
+function readRanges(bytes) {
+  var values = [];
+  var value = 0, shift = 0;
+  for(var i = 0; i < bytes.length; i++) {
+    value += (bytes[i] & 0x7F) * Math.pow(2, shift);
+    shift += 7;
+    if(!(bytes[i] & 0x80)) {
+      values.push(value);
+      value = 0;
+      shift = 0;
+    }
+  }
+  var ranges = [];
+  for(var j = 0; j + 1 < values.length; j += 2) ranges.push({start: values[j], end: values[j] + values[j + 1]});
+  return ranges;
+}
+
+// Send the frames and stops covering the runs the watch is missing. A request made while the transfer (or an earlier
+// resend) is still queued is ignored, since what it is missing may yet arrive, and the watch asks again at the end
+function resendPattern(routeId, transferId, ranges) {
+  var transfer = patternTransfers[routeId];
+  var priority = patternPriority[routeId];
+  if(!transfer || transfer.id !== transferId || priority === undefined) return;
+  if(transfer.job && jobQueued(transfer.job)) return;
+
+  var missing = function(start, end) {
+    for(var i = 0; i < ranges.length; i++) {
+      if(ranges[i].start < end && start < ranges[i].end) return true;
+    }
+    return false;
+  };
+  var items = [];
+  for(var i = 0; i < transfer.frames.length; i++) {
+    var start = transfer.frames[i].list_index;
+    var end = i + 1 < transfer.frames.length ? transfer.frames[i + 1].list_index : transfer.pointsLen;
+    if(missing(start, end)) items.push(transfer.frames[i]);
+  }
+  for(var j = 0; j < transfer.stops.length; j++) {
+    if(missing(transfer.pointsLen + j, transfer.pointsLen + j + 1)) items.push(transfer.stops[j]);
+  }
+  console.log("Resending " + items.length + " messages of route " + routeId + "'s pattern");
+  transfer.job = transmit(items, priority, routeId, true);
+}
+
+// URL of the service day's pattern (or timetable, given its path) for a route
+function patternUrl(routeId, path) {
+  var today = new Date(Date.now() - SERVICE_DAY_ROLLOVER_MIN * 60 * 1000);
+  return apiUrl + (path || patternPath).format(
+    routeCatalog[routeId], 
+    today.getFullYear(), 
+    today.getMonth()+1, 
+    today.getDate()
+  );
+}
+
+// Fetch today's pattern for a route and send it to the watch
+// A request for a pattern still being fetched joins that fetch, which is sent at the route's priority once it is in
+function requestPattern(routeId) {
+  if(routeCatalog[routeId] === undefined) {
+    // The watch showed a cached catalog before this phone session fetched one
+    console.log("Pattern requested before the catalog for route: " + routeId);
+    pendingPatternRequests.push(routeId);
+    return;
+  }
+  if(patternFetches[routeId]) return;
+  patternFetches[routeId] = true;
+  cachedFetch(patternUrl(routeId), processPattern, function(pattern) {
+    delete patternFetches[routeId];
+    deliverPattern(routeId, pattern);
+  }, function() {
+    delete patternFetches[routeId];
+  });
+}
+
+// Move a pattern transfer still queued, and the stop times sent after it, up to a priority. Returns whether any of
+// the transfer was still queued
+function promotePattern(routeId, priority) {
+  var transfer = patternTransfers[routeId];
+  if(!transfer) return false;
+  var header = promoteJob(transfer.headerJob, priority);
+  var body = promoteJob(transfer.job, priority);
+  promoteJob(transfer.timesJob, priority);
+  return header || body;
+}
+
+// Minutes since midnight of a time like "7:05 AM" or "19:05", or null
+function parseMinutes(text) {
+  var match = /(\d{1,2}):(\d{2})\s*([AaPp])?/.exec(text || "");
+  if(!match) return null;
+  var hour = parseInt(match[1], 10) % (match[3] ? 12 : 24);
+  if(match[3] && match[3].toUpperCase() == "P") hour += 12;
+  return hour * 60 + parseInt(match[2], 10);
+}
+
+// Turn the TimeTable response, one object per trip mapping a column per timed stop to its time, into each column's
+// departures in minutes from the start of the service day, ascending. Trips run in order, so a time earlier than
+// the one before it in a column is after midnight
+function processTimetable(resp) {
+  var columns = {};
+  for(var i = 0; i < resp.length; i++) {
+    for(var column in resp[i]) {
+      var minutes = parseMinutes(resp[i][column]);
+      if(minutes === null) continue;
+      var times = columns[column] || (columns[column] = []);
+      while(times.length && minutes < times[times.length - 1]) minutes += 24 * 60;
+      times.push(minutes);
+    }
+  }
+  for(var column in columns) columns[column].sort(function(a, b) { return a - b; });
+  return columns;
+}
+
+// The timetable column for a stop. Columns are named after their stop, sometimes behind an ID
+function timetableColumn(timetable, stopName) {
+  var best = null;
+  for(var column in timetable) {
+    var name = column.trim();
+    if(name.slice(-stopName.length) === stopName && (best === null || column.length < best.length)) best = column;
+  }
+  return best === null ? [] : timetable[best];
+}
+
+// Pack the departures of the timed stops into as few messages as the watch inbox allows
+// Each stop is a varint of its index in the stop list, a varint count, then the first departure and the gaps after it
+// The times carry the number of the pattern transfer whose stops they index, so the watch can tell stale ones
+function packStopTimes(stops, timetable, routeId, transferId) {
+  var newMessage = function() {
+    return {
+      "message_type": MessageTypeEnum.STOP_TIMES,
+      "route_id": routeId,
+      "transfer_id": transferId,
+      "list_index": 0,
+      "list_len": 0,
+      "frame_data": []
+    };
+  };
+  var messages = [];
+  var message = newMessage();
+  var budget = pebbleInboxSize - appMessageSize(message);
+  for(var i = 0; i < stops.length; i++) {
+    if(!stops[i].stop_is_timed) continue;
+    var times = timetableColumn(timetable, stops[i].stop_name);
+    var record = [];
+    var count = times.length;
+    do {
+      // A stop with more departures than one message holds keeps the earliest
+      record = [];
+      writeVarint(record, i);
+      writeVarint(record, count);
+      for(var j = 0; j < count; j++) writeVarint(record, times[j] - (j > 0 ? times[j - 1] : 0));
+    } while(record.length > budget && count-- > 0);
+    if(message.frame_data.length > 0 && message.frame_data.length + record.length > budget) {
+      messages.push(message);
+      message = newMessage();
+    }
+    Array.prototype.push.apply(message.frame_data, record);
+  }
+  if(message.frame_data.length > 0) messages.push(message);
+  for(var i = 0; i < messages.length; i++) {
+    messages[i].list_index = i;
+    messages[i].list_len = messages.length;
   }
+  return messages;
+}
+
+// Fetch today's timetable for a route's timed stops and send it after the pattern, so the watch can look up
+// departures for the rest of the service day without asking again
+// A pattern the watch had already, as from its storage, has no transfer here, so its times go to the transfer it named
+function requestTimetable(routeId, stops, transferId) {
+  var timed = stops.some(function(stop) { return stop.stop_is_timed; });
+  if(!timed) return;
+  cachedFetch(patternUrl(routeId, timetablePath), processTimetable, function(timetable) {
+    var priority = patternPriority[routeId];
+    var transfer = patternTransfers[routeId];
+    if(priority === undefined || (transfer && transfer.id !== transferId)) return;
+    var job = transmit(packStopTimes(stops, timetable, routeId, transferId), priority, routeId);
+    if(transfer) transfer.timesJob = job;
+  });
+}
+
+// Send the departures of a pattern the watch has without them, as when its window closed before they arrived
+// The stops are numbered as in the pattern, which comes from the cache unless it was evicted
+function requestDepartures(routeId, transferId) {
+  if(routeCatalog[routeId] === undefined) return;
+  patternPriority[routeId] = PriorityEnum.VISIBLE;
+  var requested = false;
+  cachedFetch(patternUrl(routeId), processPattern, function(pattern) {
+    // The watch has the stops of the version it was sent, which is the cached one if any, so a newer one is not used
+    if(requested) return;
+    requested = true;
+    requestTimetable(routeId, pattern.stops, transferId);
+  });
+}
+
+// Quantize a position into the box of a pattern header, exactly like quantizePattern did the pattern's points
+function quantizeInPattern(header, lat, lon) {
+  var minLat = header.bbox_min_lat / 1e6, maxLat = header.bbox_max_lat / 1e6;
+  var minLon = header.bbox_min_lon / 1e6, maxLon = header.bbox_max_lon / 1e6;
+  var span = Math.max(maxLat - minLat, maxLon - minLon);
+  var step = span > 0 ? span / (2 * QUANTIZED_EXTENT) : 1;
+  var clamp = function(value) { return Math.max(-QUANTIZED_EXTENT, Math.min(QUANTIZED_EXTENT, Math.round(value))); };
+  return {
+    x: clamp((lon - (minLon + maxLon) / 2) / step),
+    y: clamp((lat - (minLat + maxLat) / 2) / step)
+  };
+}
+
+// The latitude and longitude a point was quantized from, the inverse of quantizeInPattern
+function dequantizeInPattern(header, point) {
+  var minLat = header.bbox_min_lat / 1e6, maxLat = header.bbox_max_lat / 1e6;
+  var minLon = header.bbox_min_lon / 1e6, maxLon = header.bbox_max_lon / 1e6;
+  var span = Math.max(maxLat - minLat, maxLon - minLon);
+  var step = span > 0 ? span / (2 * QUANTIZED_EXTENT) : 1;
+  return {
+    lat: (minLat + maxLat) / 2 + point.y * step,
+    lon: (minLon + maxLon) / 2 + point.x * step
+  };
+}
+
+// Encode what changed since the last poll as records of a varint (number << 2 | op) and, for added and moved
+// vehicles, zig-zag varints of the position or the change in it. Vehicles are numbered by the order they appeared
+function encodeVehicleUpdates(tracking, vehicles) {
+  var header = patternHeaders[tracking.routeId];
+  var projection = patternProjections[tracking.routeId];
+  var bytes = [];
+  var seen = {};
+  for(var i = 0; i < vehicles.length; i++) {
+    if(!vehicles[i].GPS || vehicles[i].Key === undefined) continue;
+    var key = String(vehicles[i].Key);
+    var position = quantizeInPattern(header, vehicles[i].GPS.Lat, vehicles[i].GPS.Long);
+    if(projection) position = projectPoint(projection, position);
+    var number = tracking.numbers[key];
+    if(number === undefined) {
+      // Take the lowest free number. A route with more vehicles than the watch can hold just shows the first ones
+      for(number = 0; number < VEHICLES_LEN && tracking.positions[number]; number++);
+      if(number >= VEHICLES_LEN) continue;
+      tracking.numbers[key] = number;
+      writeVarint(bytes, (number << 2) | VehicleOpEnum.ADDED);
+      writeVarint(bytes, zigZagEncode(position.x));
+      writeVarint(bytes, zigZagEncode(position.y));
+    } else {
+      var last = tracking.positions[number];
+      if(last.x !== position.x || last.y !== position.y) {
+        writeVarint(bytes, (number << 2) | VehicleOpEnum.MOVED);
+        writeVarint(bytes, zigZagEncode(position.x - last.x));
+        writeVarint(bytes, zigZagEncode(position.y - last.y));
+      }
+    }
+    tracking.positions[number] = position;
+    seen[key] = true;
+  }
+  for(var key in tracking.numbers) {
+    if(seen[key]) continue;
+    writeVarint(bytes, (tracking.numbers[key] << 2) | VehicleOpEnum.REMOVED);
+    delete tracking.positions[tracking.numbers[key]];
+    delete tracking.numbers[key];
+  }
+  return bytes;
+}
+
+// Poll the route's vehicles and send the watch what changed. Polling slows down while nothing moves
+function pollVehicles(tracking) {
+  tracking.timer = null;
+  if(tracking !== vehicleTracking) return;
+  var schedule = function() {
+    if(tracking === vehicleTracking) tracking.timer = setTimeout(function() { pollVehicles(tracking); }, tracking.wait);
+  };
+
+  if(routeCatalog[tracking.routeId] === undefined) {
+    // The catalog is still on its way
+    schedule();
+    return;
+  }
+  if(!patternHeaders[tracking.routeId]) {
+    // A pattern being sent to the watch sets its box when it arrives. Otherwise the watch had the pattern already,
+    // so its box comes from the phone's cache or the feed, fetched once unless that fails
+    if(tracking.fetchPattern) {
+      tracking.fetchPattern = false;
+      cachedFetch(patternUrl(tracking.routeId), processPattern, function(pattern) {
+        patternHeaders[tracking.routeId] = pattern.header;
+        patternProjections[tracking.routeId] = fitProjection(pattern);
+      }, function() {
+        tracking.fetchPattern = true;
+      });
+    }
+    schedule();
+    return;
+  }
+
+  var req = new XMLHttpRequest();
+  req.open("GET", apiUrl + vehiclesPath.format(routeCatalog[tracking.routeId]), true);
+  req.responseType = "json";
+  req.setRequestHeader("Cache-Control", "no-cache");
+  req.addEventListener("load", function() {
+    if(tracking !== vehicleTracking) return;
+    var bytes = this.status == 200 && Array.isArray(this.response) ? encodeVehicleUpdates(tracking, this.response) : [];
+    if(bytes.length) {
+      transmit([{
+        "message_type": MessageTypeEnum.VEHICLES,
+        "route_id": tracking.routeId,
+        "frame_data": bytes
+      }], PriorityEnum.VISIBLE, tracking.routeId);
+      tracking.wait = VEHICLE_POLL_MS;
+    } else {
+      tracking.wait = Math.min(tracking.wait * 2, VEHICLE_POLL_MAX_MS);
+    }
+    schedule();
+  });
+  req.send();
+}
+
+// Start polling a route's vehicles for the watch, in place of any other route's
+// The watch starts with no vehicles, so every vehicle is sent as added first
+// fetchPattern is set when the watch had the pattern already, so no request for it is on its way
+function startVehicles(routeId, fetchPattern) {
+  stopVehicles();
+  vehicleTracking = {routeId: routeId, numbers: {}, positions: {}, wait: VEHICLE_POLL_MS, timer: null, fetchPattern: fetchPattern};
+  pollVehicles(vehicleTracking);
+}
+
+function stopVehicles() {
+  if(vehicleTracking && vehicleTracking.timer !== null) clearTimeout(vehicleTracking.timer);
+  vehicleTracking = null;
+}
+
+// The user's position, or null if the phone cannot get one
+function locate(done) {
+  if(typeof navigator === "undefined" || !navigator.geolocation) {
+    done(null);
+    return;
+  }
+  navigator.geolocation.getCurrentPosition(function(position) {
+    done({lat: position.coords.latitude, lon: position.coords.longitude});
+  }, function(error) {
+    console.log("Could not get a position: " + error.message);
+    done(null);
+  }, {enableHighAccuracy: true, timeout: 15000, maximumAge: 60000});
+}
+
+// Every stop of every route as {name, lat, lon, routes}, from the patterns in the cache or the feed
+// A route whose pattern cannot be fetched is left out rather than holding up the rest
+function collectStops(done) {
+  var stops = [];
+  var remaining = routeCatalog.length;
+  var collected = {};
+  var collect = function(routeId, pattern) {
+    if(collected[routeId]) return; // A revalidated pattern is delivered again, and failures can follow a cached copy
+    collected[routeId] = true;
+    for(var i = 0; pattern && i < pattern.stops.length; i++) {
+      var position = dequantizeInPattern(pattern.header, pattern.points[pattern.stops[i].stop_point_index]);
+      stops.push({name: pattern.stops[i].stop_name, lat: position.lat, lon: position.lon, routes: [routeId]});
+    }
+    if(--remaining === 0) done(stops);
+  };
+  routeCatalog.forEach(function(shortName, routeId) {
+    cachedFetch(patternUrl(routeId), processPattern, function(pattern) {
+      collect(routeId, pattern);
+    }, function() {
+      collect(routeId, null);
+    });
+  });
+}
+
+// Bucket stops into a uniform grid over their bounding box, in meters east and north of its south west corner.
+// The same stop on several routes becomes one stop listing them all. With more stops than the watch has room for, the
+// ones farthest from the user are left out. Stops are sorted by cell so the watch can index cells by where they start
+function buildStopIndex(stops, capacity, position) {
+  var merged = [];
+  var byName = {};
+  for(var i = 0; i < stops.length; i++) {
+    var stop = stops[i];
+    var same = (byName[stop.name] || []).filter(function(other) {
+      return groundDistance(other, stop) < NEARBY_SAME_STOP_M;
+    })[0];
+    if(same) {
+      if(same.routes.indexOf(stop.routes[0]) < 0) same.routes.push(stop.routes[0]);
+      continue;
+    }
+    stop = {name: stop.name, lat: stop.lat, lon: stop.lon, routes: stop.routes.slice()};
+    (byName[stop.name] = byName[stop.name] || []).push(stop);
+    merged.push(stop);
+  }
+  if(merged.length > capacity && position) {
+    merged.sort(function(a, b) { return groundDistance(a, position) - groundDistance(b, position); });
+  }
+  merged = merged.slice(0, capacity);
+  if(!merged.length) return null;
+
+  var minLat = Number.MAX_VALUE, minLon = Number.MAX_VALUE;
+  var maxLat = -Number.MAX_VALUE, maxLon = -Number.MAX_VALUE;
+  for(var i = 0; i < merged.length; i++) {
+    minLat = Math.min(minLat, merged[i].lat);
+    maxLat = Math.max(maxLat, merged[i].lat);
+    minLon = Math.min(minLon, merged[i].lon);
+    maxLon = Math.max(maxLon, merged[i].lon);
+  }
+  var index = {
+    lat: minLat,
+    lon: minLon,
+    lonScale: METERS_PER_DEGREE * Math.cos((minLat + maxLat) / 2 * Math.PI / 180)
+  };
+  var width = Math.round((maxLon - minLon) * index.lonScale);
+  var height = Math.round((maxLat - minLat) * METERS_PER_DEGREE);
+  index.cell = NEARBY_CELL_MIN_M;
+  while((Math.floor(width / index.cell) + 1) * (Math.floor(height / index.cell) + 1) > NEARBY_CELLS_MAX) {
+    index.cell = Math.ceil(index.cell * 1.25);
+  }
+  index.cols = Math.floor(width / index.cell) + 1;
+  index.rows = Math.floor(height / index.cell) + 1;
+  index.stops = merged.map(function(stop) {
+    var point = projectToIndex(index, stop);
+    point.cell = Math.floor(point.y / index.cell) * index.cols + Math.floor(point.x / index.cell);
+    point.name = stop.name;
+    point.routes = stop.routes.sort(function(a, b) { return a - b; });
+    return point;
+  });
+  index.stops.sort(function(a, b) { return a.cell - b.cell || (a.name < b.name ? -1 : a.name > b.name ? 1 : 0); });
+  index.hash = hashString(JSON.stringify([index.cell, index.cols, index.rows, index.stops]));
+  return index;
+}
+
+// Meters between two {lat, lon}, near enough over the few kilometers of a campus
+function groundDistance(a, b) {
+  var dx = (a.lon - b.lon) * METERS_PER_DEGREE * Math.cos(a.lat * Math.PI / 180);
+  var dy = (a.lat - b.lat) * METERS_PER_DEGREE;
+  return Math.sqrt(dx * dx + dy * dy);
+}
+
+// A position in the stop index's meters, kept to the 16 bits the watch stores them in
+function projectToIndex(index, position) {
+  var clamp = function(value) { return Math.max(-QUANTIZED_EXTENT, Math.min(QUANTIZED_EXTENT, Math.round(value))); };
+  return {
+    x: clamp((position.lon - index.lon) * index.lonScale),
+    y: clamp((position.lat - index.lat) * METERS_PER_DEGREE)
+  };
+}
+
+// Pack the stop index into as few messages as the watch inbox allows
+// Each stop is a varint cell (the change from the stop before, or the cell itself for the first stop of a message),
+// varint offsets east and north of the cell's corner, a varint count and that many route IDs, then its name
+function packNearbyStops(index) {
+  var newFrame = function(listIndex) {
+    return {
+      "message_type": MessageTypeEnum.NEARBY_STOPS,
+      "list_index": listIndex,
+      "frame_data": []
+    };
+  };
+  var encode = function(stop, previousCell) {
+    var bytes = [];
+    writeVarint(bytes, stop.cell - previousCell);
+    writeVarint(bytes, stop.x - (stop.cell % index.cols) * index.cell);
+    writeVarint(bytes, stop.y - Math.floor(stop.cell / index.cols) * index.cell);
+    writeVarint(bytes, stop.routes.length);
+    Array.prototype.push.apply(bytes, stop.routes);
+    var name = unescape(encodeURIComponent(stop.name));
+    for(var i = 0; i < name.length; i++) bytes.push(name.charCodeAt(i));
+    bytes.push(0);
+    return bytes;
+  };
+  var frames = [];
+  var frame = newFrame(0);
+  var budget = pebbleInboxSize - appMessageSize(frame);
+  var previousCell = 0;
+  for(var i = 0; i < index.stops.length; i++) {
+    var record = encode(index.stops[i], previousCell);
+    if(frame.frame_data.length > 0 && frame.frame_data.length + record.length > budget) {
+      frames.push(frame);
+      frame = newFrame(i);
+      record = encode(index.stops[i], 0);
+    }
+    Array.prototype.push.apply(frame.frame_data, record);
+    previousCell = index.stops[i].cell;
+  }
+  if(frame.frame_data.length > 0) frames.push(frame);
+  return frames;
+}
+
+// Answer the watch's nearby window with the user's position in the stop index's meters, sending the index first
+// unless the watch already has it (by hash)
+function requestNearby(watchHash, capacity) {
+  if(!routeCatalog.length) {
+    pendingNearbyRequest = {hash: watchHash, capacity: capacity};
+    return;
+  }
+  locate(function(position) {
+    collectStops(function(stops) {
+      var index = buildStopIndex(stops, capacity, position);
+      var located = {"message_type": MessageTypeEnum.NEARBY_POSITION};
+      if(index && index.hash !== watchHash) {
+        var header = {
+          "message_type": MessageTypeEnum.NEARBY,
+          "nearby_hash": index.hash | 0,
+          "list_len": index.stops.length,
+          "grid_cols": index.cols,
+          "grid_rows": index.rows,
+          "grid_cell": index.cell
+        };
+        transmit([header].concat(packNearbyStops(index)), PriorityEnum.VISIBLE);
+      }
+      if(index && position) {
+        var point = projectToIndex(index, position);
+        located.position_x = point.x;
+        located.position_y = point.y;
+      }
+      transmit([located], PriorityEnum.VISIBLE);
+    });
+  });
+}
+
+// Unpack the counters the watch sends as its Counters struct
+function unpackCounters(bytes) {
+  var counters = {};
+  for(var i = 0; i < WATCH_COUNTERS.length && (i + 1) * 4 <= bytes.length; i++) {
+    var at = i * 4;
+    counters[WATCH_COUNTERS[i]] = (bytes[at] | bytes[at + 1] << 8 | bytes[at + 2] << 16 | bytes[at + 3] << 24) >>> 0;
+  }
+  return counters;
 }
 
 // Called when incoming message from the Pebble is received
@@ -137,114 +1321,70 @@ Pebble.addEventListener("appmessage", function(e) {
     // Watch is letting the phone know what the max it can handle at once is
     case MessageTypeEnum.SET_INBOX_SIZE:
       pebbleInboxSize = e.payload.inbox_size;
-      console.log("Inbox size set to: " + pebbleInboxSize);
+      if(e.payload.screen_w) pebbleScreen.width = e.payload.screen_w;
+      if(e.payload.screen_h) pebbleScreen.height = e.payload.screen_h;
+      if(e.payload.zoom_max) pebbleScreen.zoomMax = e.payload.zoom_max;
+      if(e.payload.pattern_max_len) pebbleScreen.maxPoints = e.payload.pattern_max_len;
+      pebbleScreen.round = !!e.payload.screen_round;
+      pebbleScreen.projected = !!e.payload.projected;
+      console.log("Inbox size set to: " + pebbleInboxSize + ", screen " + JSON.stringify(pebbleScreen));
       myStatus = 0;
       sendStatusMessage();
     break;
   
     // Watch is requesting a list of all routes
     case MessageTypeEnum.ROUTES:
-      var req = new XMLHttpRequest();
-      var reqUrl = apiUrl + routesPath;
-      console.log("Requesting URL:" + reqUrl);
-      req.open("GET", reqUrl, true);
-      req.responseType = "json";
-      req.setRequestHeader("Cache-Control", "no-cache");
-      req.addEventListener("load", function() {
-        // Will be called when data is returned from the server
-        var resp = this.response;
-        var routes = [];
-        routes[RouteTypeEnum.ON_CAMPUS] = [];
-        routes[RouteTypeEnum.OFF_CAMPUS] = [];
-        routes[RouteTypeEnum.GAME_DAY] = [];
-        routes[RouteTypeEnum.OTHER] = [];
-        for (var i = 0; i < resp.length; i++) {
-          var route = {"message_type": MessageTypeEnum.ROUTES};
-          route.route_name = resp[i].Name.trim();
-          switch(resp[i].Group.trim()){
-            case "On Campus": route.route_type = RouteTypeEnum.ON_CAMPUS;
-              break;
-            case "Off Campus": route.route_type = RouteTypeEnum.OFF_CAMPUS;
-              break;
-            case "Game Day Routes": route.route_type = RouteTypeEnum.GAME_DAY;
-              break;
-            default: route.route_type = RouteTypeEnum.OTHER;
-              break;
-          }
-          route.route_short_name = resp[i].ShortName.trim();
-          if(resp[i].Color){
-            var route_color = parseCSSColor(resp[i].Color);
-            route.route_color_r = route_color[0];
-            route.route_color_g = route_color[1];
-            route.route_color_b = route_color[2];
-          }
-          routes[route.route_type].push(route);
-        }
-        console.log(JSON.stringify(routes));
-        console.log(JSON.stringify(resp));
-        sendList(routes[RouteTypeEnum.ON_CAMPUS]);
-        sendList(routes[RouteTypeEnum.OFF_CAMPUS]);
-        sendList(routes[RouteTypeEnum.GAME_DAY]);
-        sendList(routes[RouteTypeEnum.OTHER]);
-      });
-      req.send();
+      requestRoutes(e.payload.catalog_hash);
     break;
   
-    // Watch is requesting a today's pattern for route specified by route_short_name
+    // Watch is requesting a today's pattern for route specified by route_id
+    // A pattern still being prefetched just moves up the queue, or is sent at this priority once its fetch is in
     case MessageTypeEnum.ROUTE_PATTERN:
-      var req = new XMLHttpRequest();
-      var today = new Date();
-      var reqUrl = apiUrl + patternPath.format(
-        e.payload.route_short_name, 
-        today.getFullYear(), 
-        today.getMonth()+1, 
-        today.getDate()
-      );
-      req.route_short_name = e.payload.route_short_name; // Implant a nonstandard field to use req as the vehicle to transport the route short name into the callback.
-      console.log("Requesting URL:" + reqUrl);
-      req.open("GET", reqUrl, true);
-      req.responseType = "json";
-      req.setRequestHeader("Cache-Control", "no-cache");
-      req.addEventListener("load", function() {
-        var resp = this.response;
-        var points = [];
-        var stops = []; // Stops is the subset of points which a bus stops at
-        var minX = Number.MAX_VALUE;
-        var minY = Number.MAX_VALUE;
-        for(var i = 0; i < resp.length; i++) {
-          var point = {"message_type": MessageTypeEnum.ROUTE_PATTERN_POINTS, "route_short_name": this.route_short_name}; // Context providing elements
-          if(resp[i].PointTypeCode == 1){
-            var stop = {"message_type": MessageTypeEnum.ROUTE_PATTERN_STOPS, "route_short_name": this.route_short_name};
-            if(resp[i].Stop.IsTimePoint) stop.stop_is_timed = 1;
-            stop.stop_is_timed = 0;
-            stop.stop_name = resp[i].Name.trim(); // A point is only named if the bus actually stops there
-            stop.stop_point_index = i;
-            stops.push(stop);
-          }
-          
-          // We are going to use Latitude and Longitude as if they were X and Y.
-          // On the scale of a bus route this is a good approximation.
-          // College Station around 30.6 degrees longitude and -96.3 degrees latitude
-          // In College Station, TX: 1 degree Longitude = 96.5 km ; 1 degree Latitude = 110.8 km
-          point.point_x = resp[i].Longtitude;
-          point.point_y = resp[i].Latitude;
-          minX = Math.min(minX, point.point_x);
-          minY = Math.min(minY, point.point_y);
-          points.push(point);
-        }
-        // Normalize the X and Y so we can work with smaller numbers, then multiply so we can get precision without floats
-        for(var i = 0; i < points.length; i++){
-          points[i].point_x -= minX;
-          points[i].point_y -= minY;
-          points[i].point_x *= 1; 
-          points[i].point_y *= 1;
-        }
-        console.log(JSON.stringify(points));
-        console.log(JSON.stringify(resp));
-        sendList(points);
-        sendList(stops);
-      });
-      req.send();
+      patternPriority[e.payload.route_id] = PriorityEnum.VISIBLE;
+      if(!promotePattern(e.payload.route_id, PriorityEnum.VISIBLE)) requestPattern(e.payload.route_id);
+      startVehicles(e.payload.route_id, false);
+    break;
+
+    // Watch opened a route whose pattern it already had, and wants its vehicles
+    // A transfer_id asks for the pattern's departures too, since they never arrived
+    case MessageTypeEnum.VEHICLES:
+      startVehicles(e.payload.route_id, true);
+      if(e.payload.transfer_id !== undefined) requestDepartures(e.payload.route_id, e.payload.transfer_id);
+    break;
+
+    // Watch opened the departures of a route whose pattern it had without them
+    case MessageTypeEnum.STOP_TIMES:
+      requestDepartures(e.payload.route_id, e.payload.transfer_id);
+    break;
+
+    // Watch is asking for a pattern the user may open next, to be sent when the link is otherwise idle
+    case MessageTypeEnum.ROUTE_PATTERN_PREFETCH:
+      if(patternPriority[e.payload.route_id] === undefined) patternPriority[e.payload.route_id] = PriorityEnum.PREFETCH;
+      requestPattern(e.payload.route_id);
+    break;
+
+    // Watch opened its nearby window, or asked for a fresh position in it
+    case MessageTypeEnum.NEARBY:
+      requestNearby(e.payload.nearby_hash >>> 0, e.payload.list_len);
+    break;
+
+    // Watch closed a route window, so the rest of its pattern is no longer needed
+    case MessageTypeEnum.ROUTE_CLOSED:
+      delete patternPriority[e.payload.route_id];
+      delete patternTransfers[e.payload.route_id];
+      cancelTransmit(e.payload.route_id);
+      if(vehicleTracking && vehicleTracking.routeId === e.payload.route_id) stopVehicles();
+    break;
+
+    // Watch is missing parts of a pattern transfer
+    case MessageTypeEnum.ROUTE_PATTERN_NACK:
+      resendPattern(e.payload.route_id, e.payload.transfer_id, readRanges(e.payload.frame_data || []));
+    break;
+
+    // Watch's debug window is open and sent its counters
+    case MessageTypeEnum.COUNTERS:
+      watchCounters = unpackCounters(e.payload.frame_data || []);
+      console.log("Watch counters: " + JSON.stringify(watchCounters));
     break;
   }
-});
\ No newline at end of file
+});